@@ -0,0 +1,177 @@
+#include <atomic>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <capnp/serialize-packed.h>
+#include <kj/common.h>
+#include <cdm/content_decryption_module.h>
+#include "cdm.capnp.h"
+#include "util.h"
+
+// method ordinals as declared in cdm.capnp
+
+enum CdmProxyMethod: uint16_t {
+  CDM_PROXY_INITIALIZE                          =  0,
+  CDM_PROXY_GET_STATUS_FOR_POLICY               =  1,
+  CDM_PROXY_SET_SERVER_CERTIFICATE              =  2,
+  CDM_PROXY_CREATE_SESSION_AND_GENERATE_REQUEST =  3,
+  CDM_PROXY_LOAD_SESSION                        =  4,
+  CDM_PROXY_UPDATE_SESSION                      =  5,
+  CDM_PROXY_CLOSE_SESSION                       =  6,
+  CDM_PROXY_REMOVE_SESSION                      =  7,
+  CDM_PROXY_TIMER_EXPIRED                       =  8,
+  CDM_PROXY_DECRYPT                             =  9,
+  CDM_PROXY_INITIALIZE_AUDIO_DECODER            = 10,
+  CDM_PROXY_INITIALIZE_VIDEO_DECODER            = 11,
+  CDM_PROXY_DEINITIALIZE_DECODER                = 12,
+  CDM_PROXY_RESET_DECODER                       = 13,
+  CDM_PROXY_DECRYPT_AND_DECODE_FRAME            = 14,
+  CDM_PROXY_DECRYPT_AND_DECODE_SAMPLES          = 15,
+  CDM_PROXY_ON_PLATFORM_CHALLENGE_RESPONSE      = 16,
+  CDM_PROXY_ON_QUERY_OUTPUT_PROTECTION_STATUS   = 17,
+  CDM_PROXY_ON_STORAGE_ID                       = 18,
+  CDM_PROXY_PING                                = 19,
+  CDM_PROXY_REGISTER_REGION                     = 20,
+  CDM_PROXY_UNREGISTER_REGION                   = 21,
+  CDM_PROXY_GET_COUNTERS                        = 22,
+  CDM_PROXY_READ_FILE                           = 23,
+};
+
+static const char* const CDM_PROXY_METHOD_NAMES[] = {
+  "Initialize", "GetStatusForPolicy", "SetServerCertificate", "CreateSessionAndGenerateRequest", "LoadSession",
+  "UpdateSession", "CloseSession", "RemoveSession", "TimerExpired", "Decrypt", "InitializeAudioDecoder",
+  "InitializeVideoDecoder", "DeinitializeDecoder", "ResetDecoder", "DecryptAndDecodeFrame", "DecryptAndDecodeSamples",
+  "OnPlatformChallengeResponse", "OnQueryOutputProtectionStatus", "OnStorageId", "Ping",
+  "RegisterRegion", "UnregisterRegion", "GetCounters", "ReadFile",
+};
+
+inline bool is_data_plane(uint16_t method) {
+  return method == CDM_PROXY_DECRYPT || method == CDM_PROXY_DECRYPT_AND_DECODE_FRAME || method == CDM_PROXY_DECRYPT_AND_DECODE_SAMPLES;
+}
+
+enum HostProxyMethod: uint16_t {
+  HOST_PROXY_SET_TIMER                       =  0,
+  HOST_PROXY_ON_INITIALIZED                  =  1,
+  HOST_PROXY_ON_RESOLVE_KEY_STATUS_PROMISE   =  2,
+  HOST_PROXY_ON_RESOLVE_NEW_SESSION_PROMISE  =  3,
+  HOST_PROXY_ON_RESOLVE_PROMISE              =  4,
+  HOST_PROXY_ON_REJECT_PROMISE               =  5,
+  HOST_PROXY_ON_SESSION_MESSAGE              =  6,
+  HOST_PROXY_ON_SESSION_KEYS_CHANGE          =  7,
+  HOST_PROXY_ON_EXPIRATION_CHANGE            =  8,
+  HOST_PROXY_ON_SESSION_CLOSED               =  9,
+  HOST_PROXY_QUERY_OUTPUT_PROTECTION_STATUS  = 12,
+};
+
+// Binary log of the calls crossing the CdmProxy/HostProxy boundary of one CDM instance, written as a sequence of
+// packed CaptureRecord messages. Enabled by pointing FCDM_CAPTURE_DIR at a directory, read back by fcdm-replay.
+class CaptureLog {
+
+  kj::AutoCloseFd m_fd;
+  int64_t         m_start;
+
+public:
+
+  class Record {
+
+    CaptureLog&                 m_log;
+    capnp::MallocMessageBuilder m_message;
+    CaptureRecord::Builder      m_record;
+    int64_t                     m_start;
+
+  public:
+
+    CaptureRecord::Builder get() {
+      return m_record;
+    }
+
+    void finish() {
+      m_record.setDuration(monotonic_ns() - m_start);
+      capnp::writePackedMessageToFd(m_log.m_fd.get(), m_message);
+    }
+
+    Record(CaptureLog& log, CaptureRecord::Interface interface, uint16_t method) :
+      m_log(log), m_record(m_message.initRoot<CaptureRecord>()), m_start(monotonic_ns())
+    {
+      m_record.setTimestamp(m_start - log.m_start);
+      m_record.setInterface(interface);
+      m_record.setMethod(method);
+    }
+
+    KJ_DISALLOW_COPY(Record);
+  };
+
+  kj::Own<Record> begin(CaptureRecord::Interface interface, uint16_t method) {
+    return kj::heap<Record>(*this, interface, method);
+  }
+
+  static kj::Own<CaptureLog> open() {
+
+    char* capture_dir = getenv("FCDM_CAPTURE_DIR");
+    if (capture_dir == nullptr) {
+      return nullptr;
+    }
+
+    // instances are created from any host thread
+    static std::atomic<uint32_t> instance(0);
+    auto path = kj::str(capture_dir, "/fcdm-", getpid(), "-", instance.fetch_add(1), ".capture");
+
+    int fd;
+    KJ_SYSCALL(fd = ::open(path.cStr(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600), path);
+
+    KJ_LOG(INFO, "capturing to", path);
+    return kj::heap<CaptureLog>(kj::AutoCloseFd(fd));
+  }
+
+  CaptureLog(kj::AutoCloseFd fd) : m_fd(kj::mv(fd)), m_start(monotonic_ns()) {}
+
+  KJ_DISALLOW_COPY(CaptureLog);
+};
+
+template <typename Params>
+kj::Own<CaptureLog::Record> capture_call(CaptureLog* log, CaptureRecord::Interface interface, uint16_t method, Params params) {
+  if (log == nullptr) {
+    return nullptr;
+  }
+  auto record = log->begin(interface, method);
+  record->get().getParams().setAs<typename Params::Reads>(params);
+  return record;
+}
+
+inline void finish_capture(kj::Own<CaptureLog::Record>& record) {
+  if (record.get() != nullptr) {
+    record->finish();
+  }
+}
+
+template <typename Results>
+void finish_capture(kj::Own<CaptureLog::Record>& record, uint32_t status, const Results& results) {
+  if (record.get() != nullptr) {
+    record->get().setStatus(status);
+    record->get().getResults().setAs<typename Results::Reads>(results);
+    record->finish();
+  }
+}
+
+inline void capture_input_buffer(kj::Own<CaptureLog::Record>& record, const cdm::InputBuffer_2& source) {
+
+  if (record.get() == nullptr) {
+    return;
+  }
+
+  auto target = record->get().initInput();
+  target.setData (kj::arrayPtr(source.data,   source.data_size));
+  target.setKeyId(kj::arrayPtr(source.key_id, source.key_id_size));
+  target.setIv   (kj::arrayPtr(source.iv,     source.iv_size));
+
+  auto subsamples = target.initSubsamples(source.num_subsamples);
+  for (uint32_t i = 0; i < source.num_subsamples; i++) {
+    subsamples[i].setClearBytes (source.subsamples[i].clear_bytes);
+    subsamples[i].setCipherBytes(source.subsamples[i].cipher_bytes);
+  }
+
+  target.setEncryptionScheme(static_cast<uint32_t>(source.encryption_scheme));
+  target.setPatternCryptByteBlock(source.pattern.crypt_byte_block);
+  target.setPatternSkipByteBlock (source.pattern.skip_byte_block);
+  target.setTimestamp(source.timestamp);
+}
@@ -1,2 +1,23 @@
+#pragma once
+
 #define FIBER_STACK_SIZE ( 1 * 1024 * 1024)
 #define SHMEM_ARENA_SIZE (10 * 1024 * 1024)
+#define SHMEM_ARENA_MAX_SIZE (64 * 1024 * 1024)
+#define COMPACT_VIDEO_FRAMES 1
+#define EXPORTED_FRAMES 8
+#define EXPORT_WAIT_MS 20
+#define WRITE_BEHIND_DELAY_MS 200
+#define SPIN_US 0
+#define IDLE_SECONDS 30
+#define MAX_WORKERS 0
+#define MEMORY_BUDGET_MB 0
+#define ADMISSION_TIMEOUT_MS 0
+#define DATA_DEADLINE_MS 1000
+#define CONTROL_DEADLINE_MS 30000
+#define DATA_PLANE_BURST 8
+#define WATCHDOG_MS 5000
+#define REAP_INTERVAL_MS 100
+#define ACCEPT_BACKOFF_MS 100
+#define POLICY_CACHE_MS 5000
+#define LOG_RATE 20
+#define LOG_BUFFER_SIZE (256 * 1024)
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include <kj/debug.h>
+#include <kj/map.h>
+#include <kj/memory.h>
+#include <kj/mutex.h>
+#include <kj/vector.h>
+
+// Resource counters around the hot-path calls, shared by the shim and the worker. Enabled with FCDM_COUNTERS=1;
+// workers inherit it from the host. Counters come from perf_event_open where the kernel lets us, and from
+// getrusage deltas of the whole process otherwise, which only know page faults and context switches and are off
+// while calls overlap.
+//
+// A call is counted on the thread that makes it, plus the threads registered with register_counted_thread() that
+// work on its behalf, i.e. the shim's I/O thread. Those are shared with the other calls in flight.
+
+enum Counter {
+  COUNTER_INSTRUCTIONS,
+  COUNTER_CACHE_MISSES,
+  COUNTER_PAGE_FAULTS,
+  COUNTER_CONTEXT_SWITCHES,
+  COUNTER_SYSCALLS,
+  COUNTER_COUNT,
+};
+
+struct CounterValues {
+  uint64_t values[COUNTER_COUNT] = {};
+};
+
+// The perf events of one thread. Any thread may read them.
+class ThreadCounters {
+
+  int m_fds[COUNTER_COUNT];
+
+#ifdef __linux__
+  // the id of the syscall entry tracepoint, 0 if tracefs isn't mounted where we can read it
+  static uint64_t syscallTracepoint() {
+    for (auto path: { "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id", "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id" }) {
+      FILE* file = fopen(path, "re");
+      if (file == nullptr) {
+        continue;
+      }
+      unsigned long long id = 0;
+      if (fscanf(file, "%llu", &id) != 1) {
+        id = 0;
+      }
+      fclose(file);
+      return id;
+    }
+    return 0;
+  }
+
+  static int open(uint32_t type, uint64_t config, pid_t tid) {
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size   = sizeof(attr);
+    attr.type   = type;
+    attr.config = config;
+
+    // unprivileged processes may only count user space with the default perf_event_paranoid
+    for (bool exclude_kernel: { false, true }) {
+      attr.exclude_kernel = exclude_kernel;
+      attr.exclude_hv     = exclude_kernel;
+      int fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+      if (fd >= 0) {
+        return fd;
+      }
+    }
+    return -1;
+  }
+#endif
+
+public:
+
+  // bit i is set if counter i is counted
+  uint32_t available() const {
+    uint32_t mask = 0;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+      if (m_fds[i] >= 0) {
+        mask |= 1 << i;
+      }
+    }
+    return mask;
+  }
+
+  void addTo(CounterValues& target) const {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+      uint64_t value;
+      if (m_fds[i] >= 0 && read(m_fds[i], &value, sizeof(value)) == sizeof(value)) {
+        target.values[i] += value;
+      }
+    }
+  }
+
+  ThreadCounters() {
+
+    for (auto& fd: m_fds) {
+      fd = -1;
+    }
+
+#ifdef __linux__
+    pid_t tid = syscall(SYS_gettid);
+    m_fds[COUNTER_INSTRUCTIONS]     = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, tid);
+    m_fds[COUNTER_CACHE_MISSES]     = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, tid);
+    m_fds[COUNTER_PAGE_FAULTS]      = open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, tid);
+    m_fds[COUNTER_CONTEXT_SWITCHES] = open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, tid);
+
+    static const uint64_t tracepoint = syscallTracepoint();
+    if (tracepoint != 0) {
+      m_fds[COUNTER_SYSCALLS] = open(PERF_TYPE_TRACEPOINT, tracepoint, tid);
+    }
+#endif
+  }
+
+  ~ThreadCounters() noexcept {
+    for (auto fd: m_fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  KJ_DISALLOW_COPY(ThreadCounters);
+};
+
+inline bool counters_enabled() {
+  static const bool enabled = getenv("FCDM_COUNTERS") != nullptr && strcmp(getenv("FCDM_COUNTERS"), "0") != 0;
+  return enabled;
+}
+
+inline kj::MutexGuarded<kj::Vector<kj::Own<ThreadCounters>>>& counted_threads() {
+  // never destroyed, like the threads registered here
+  static auto threads = new kj::MutexGuarded<kj::Vector<kj::Own<ThreadCounters>>>();
+  return *threads;
+}
+
+// Counts the calling thread along with every call from here on, see above
+inline void register_counted_thread() {
+  if (counters_enabled()) {
+    counted_threads().lockExclusive()->add(kj::heap<ThreadCounters>());
+  }
+}
+
+inline ThreadCounters& this_thread_counters() {
+  static thread_local kj::Own<ThreadCounters> counters = kj::heap<ThreadCounters>();
+  return *counters;
+}
+
+// Per-method aggregates of one instance
+class CallCounters {
+
+  struct Method {
+    uint64_t      calls = 0;
+    CounterValues sums;
+  };
+
+  kj::MutexGuarded<kj::HashMap<uint16_t, Method>> m_methods;
+
+  static void snapshot(CounterValues& values) {
+
+    auto& own = this_thread_counters();
+    own.addTo(values);
+    for (auto& thread: *counted_threads().lockShared()) {
+      thread->addTo(values);
+    }
+
+    // what perf doesn't count, and rusage does
+    auto perf = own.available();
+    if ((perf & (1 << COUNTER_PAGE_FAULTS)) == 0 || (perf & (1 << COUNTER_CONTEXT_SWITCHES)) == 0) {
+      struct rusage usage;
+      KJ_SYSCALL(getrusage(RUSAGE_SELF, &usage));
+      if ((perf & (1 << COUNTER_PAGE_FAULTS)) == 0) {
+        values.values[COUNTER_PAGE_FAULTS] = usage.ru_minflt + usage.ru_majflt;
+      }
+      if ((perf & (1 << COUNTER_CONTEXT_SWITCHES)) == 0) {
+        values.values[COUNTER_CONTEXT_SWITCHES] = usage.ru_nvcsw + usage.ru_nivcsw;
+      }
+    }
+  }
+
+public:
+
+  // Counts what happens between its construction and destruction towards `method`. Does nothing without counters.
+  class Scope {
+
+    CallCounters* m_counters;
+    uint16_t      m_method;
+    CounterValues m_start;
+
+  public:
+
+    Scope(CallCounters* counters, uint16_t method) : m_counters(counters), m_method(method) {
+      if (m_counters != nullptr) {
+        snapshot(m_start);
+      }
+    }
+
+    ~Scope() noexcept(false) {
+      if (m_counters == nullptr) {
+        return;
+      }
+
+      CounterValues end;
+      snapshot(end);
+
+      auto  methods = m_counters->m_methods.lockExclusive();
+      auto& method  = methods->findOrCreate(m_method, [&]() {
+        return kj::HashMap<uint16_t, Method>::Entry { m_method, Method() };
+      });
+      method.calls++;
+      for (int i = 0; i < COUNTER_COUNT; i++) {
+        method.sums.values[i] += end.values[i] - m_start.values[i];
+      }
+    }
+
+    KJ_DISALLOW_COPY(Scope);
+  };
+
+  // bit i is set if counter i is counted
+  static uint32_t available() {
+    return this_thread_counters().available() | (1 << COUNTER_PAGE_FAULTS) | (1 << COUNTER_CONTEXT_SWITCHES);
+  }
+
+  // Returns false if `method` hasn't been called
+  bool get(uint16_t method, uint64_t& calls, CounterValues& sums) {
+    auto methods = m_methods.lockShared();
+    KJ_IF_MAYBE(found, methods->find(method)) {
+      calls = found->calls;
+      sums  = found->sums;
+      return true;
+    }
+    return false;
+  }
+
+  template <typename Func>
+  void forEach(Func&& func) {
+    for (auto& entry: *m_methods.lockShared()) {
+      func(entry.key, entry.value.calls, entry.value.sums);
+    }
+  }
+
+  // nullptr unless counters are enabled
+  static kj::Own<CallCounters> create() {
+    return counters_enabled() ? kj::heap<CallCounters>() : nullptr;
+  }
+
+  CallCounters() {}
+
+  KJ_DISALLOW_COPY(CallCounters);
+};
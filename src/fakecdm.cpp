@@ -0,0 +1,342 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <cdm/content_decryption_module.h>
+
+// Stand-in CDM for benchmarking the shim and the worker without a real one, loaded by the worker through
+// FCDM_CDM_SO_PATH like any other. It plays the protocol straight: a session's license request is its init data,
+// the license is any response to it, after which the one key, FAKE_KEY_ID, is usable. "Decryption" XORs the
+// cipher bytes with FAKE_KEY_BYTE, "decoding" spreads the sample over an I420 frame of the configured size.
+// Persistent-license sessions keep their license in the host's FileIO store, so LoadSession can resume them.
+
+#define FAKE_KEY_ID   "fcdm fake key id"
+#define FAKE_KEY_BYTE 0x5a
+
+// Reads or writes one file through the host's FileIO, reports back and deletes itself
+class FakeFile: public cdm::FileIOClient {
+
+  typedef std::function<void(bool success, const uint8_t* data, uint32_t size)> Done;
+
+  cdm::FileIO*         m_file = nullptr;
+  std::vector<uint8_t> m_write; // read if empty
+  Done                 m_done;
+
+  void finish(bool success, const uint8_t* data, uint32_t size) {
+    // `data` belongs to the FileIO until it's closed
+    m_done(success, data, size);
+    m_file->Close();
+    delete this;
+  }
+
+  FakeFile(std::vector<uint8_t> write, Done done) : m_write(std::move(write)), m_done(std::move(done)) {}
+
+public:
+
+  void OnOpenComplete(Status status) override {
+    if (status != kSuccess) {
+      finish(false, nullptr, 0);
+    } else if (m_write.empty()) {
+      m_file->Read();
+    } else {
+      m_file->Write(m_write.data(), m_write.size());
+    }
+  }
+
+  void OnReadComplete(Status status, const uint8_t* data, uint32_t data_size) override {
+    finish(status == kSuccess, data, data_size);
+  }
+
+  void OnWriteComplete(Status status) override {
+    finish(status == kSuccess, nullptr, 0);
+  }
+
+  static void start(cdm::Host_10* host, const std::string& name, std::vector<uint8_t> write, Done done) {
+    auto file = new FakeFile(std::move(write), std::move(done));
+    file->m_file = host->CreateFileIO(file);
+    if (file->m_file == nullptr) {
+      file->m_done(false, nullptr, 0);
+      delete file;
+      return;
+    }
+    file->m_file->Open(name.data(), name.size());
+  }
+};
+
+class FakeCdm: public cdm::ContentDecryptionModule_10 {
+
+  struct Session {
+    std::string      id;
+    cdm::SessionType type;
+  };
+
+  cdm::Host_10*        m_host;
+  uint32_t             m_next_session = 1;
+  std::vector<Session> m_sessions;
+  bool                 m_key_usable = false;
+  cdm::Size            m_coded_size = { 0, 0 };
+
+  Session* findSession(const char* session_id, uint32_t session_id_size) {
+    for (auto& session: m_sessions) {
+      if (session.id.size() == session_id_size && memcmp(session.id.data(), session_id, session_id_size) == 0) {
+        return &session;
+      }
+    }
+    return nullptr;
+  }
+
+  static std::string fileName(const std::string& session_id) {
+    return "session." + session_id;
+  }
+
+  void reject(uint32_t promise_id, const char* message) {
+    m_host->OnRejectPromise(promise_id, cdm::kExceptionInvalidStateError, 0, message, strlen(message));
+  }
+
+  void keysChanged(const std::string& session_id) {
+    cdm::KeyInformation key;
+    key.key_id      = reinterpret_cast<const uint8_t*>(FAKE_KEY_ID);
+    key.key_id_size = strlen(FAKE_KEY_ID);
+    key.status      = m_key_usable ? cdm::kUsable : cdm::kReleased;
+    key.system_code = 0;
+    m_host->OnSessionKeysChange(session_id.data(), session_id.size(), m_key_usable, &key, 1);
+  }
+
+  // Returns false if the sample's key isn't usable
+  bool decrypt(const cdm::InputBuffer_2& encrypted_buffer, uint8_t* target) {
+
+    if (encrypted_buffer.encryption_scheme == cdm::EncryptionScheme::kUnencrypted) {
+      memcpy(target, encrypted_buffer.data, encrypted_buffer.data_size);
+      return true;
+    }
+
+    if (!m_key_usable || encrypted_buffer.key_id_size != strlen(FAKE_KEY_ID) ||
+        memcmp(encrypted_buffer.key_id, FAKE_KEY_ID, encrypted_buffer.key_id_size) != 0) {
+      return false;
+    }
+
+    uint32_t offset = 0;
+    auto xor_bytes = [&](uint32_t size) {
+      for (uint32_t end = offset + size; offset < end && offset < encrypted_buffer.data_size; offset++) {
+        target[offset] = encrypted_buffer.data[offset] ^ FAKE_KEY_BYTE;
+      }
+    };
+    auto copy_bytes = [&](uint32_t size) {
+      for (uint32_t end = offset + size; offset < end && offset < encrypted_buffer.data_size; offset++) {
+        target[offset] = encrypted_buffer.data[offset];
+      }
+    };
+
+    if (encrypted_buffer.num_subsamples == 0) {
+      xor_bytes(encrypted_buffer.data_size);
+    }
+    for (uint32_t i = 0; i < encrypted_buffer.num_subsamples; i++) {
+      copy_bytes(encrypted_buffer.subsamples[i].clear_bytes);
+      xor_bytes(encrypted_buffer.subsamples[i].cipher_bytes);
+    }
+    return true;
+  }
+
+public:
+
+  void Initialize(bool allow_distinctive_identifier, bool allow_persistent_state, bool use_hw_secure_codecs) override {
+    m_host->OnInitialized(true);
+  }
+
+  void GetStatusForPolicy(uint32_t promise_id, const cdm::Policy& policy) override {
+    m_host->OnResolveKeyStatusPromise(promise_id, cdm::kUsable);
+  }
+
+  void SetServerCertificate(uint32_t promise_id, const uint8_t* server_certificate_data, uint32_t server_certificate_data_size) override {
+    m_host->OnResolvePromise(promise_id);
+  }
+
+  void CreateSessionAndGenerateRequest(
+    uint32_t promise_id, cdm::SessionType session_type, cdm::InitDataType init_data_type, const uint8_t* init_data, uint32_t init_data_size) override {
+    // persistent sessions outlive the instance, and need ids that do too
+    auto session_id = session_type == cdm::kPersistentLicense ?
+      std::to_string(getpid()) + "-" + std::to_string(reinterpret_cast<uintptr_t>(this)) + "-" + std::to_string(m_next_session++) :
+      std::to_string(m_next_session++);
+    m_sessions.push_back(Session { session_id, session_type });
+    m_host->OnResolveNewSessionPromise(promise_id, session_id.data(), session_id.size());
+    m_host->OnSessionMessage(session_id.data(), session_id.size(), cdm::kLicenseRequest,
+      reinterpret_cast<const char*>(init_data), init_data_size);
+  }
+
+  void LoadSession(uint32_t promise_id, cdm::SessionType session_type, const char* session_id, uint32_t session_id_size) override {
+    std::string id(session_id, session_id_size);
+    FakeFile::start(m_host, fileName(id), {}, [this, promise_id, session_type, id](bool success, const uint8_t* data, uint32_t size) {
+      if (!success || size == 0) {
+        // not stored, which resolves with no session
+        m_host->OnResolveNewSessionPromise(promise_id, nullptr, 0);
+        return;
+      }
+      m_sessions.push_back(Session { id, session_type });
+      m_key_usable = true;
+      m_host->OnResolveNewSessionPromise(promise_id, id.data(), id.size());
+      keysChanged(id);
+    });
+  }
+
+  void UpdateSession(uint32_t promise_id, const char* session_id, uint32_t session_id_size, const uint8_t* response, uint32_t response_size) override {
+    auto session = findSession(session_id, session_id_size);
+    if (session == nullptr) {
+      reject(promise_id, "no such session");
+      return;
+    }
+    m_key_usable = true;
+    keysChanged(session->id);
+
+    if (session->type != cdm::kPersistentLicense) {
+      m_host->OnResolvePromise(promise_id);
+      return;
+    }
+
+    // the license is stored before the promise resolves
+    std::vector<uint8_t> license(response, response + response_size);
+    if (license.empty()) {
+      license.push_back(0);
+    }
+    FakeFile::start(m_host, fileName(session->id), std::move(license), [this, promise_id](bool success, const uint8_t* data, uint32_t size) {
+      if (success) {
+        m_host->OnResolvePromise(promise_id);
+      } else {
+        reject(promise_id, "unable to store the license");
+      }
+    });
+  }
+
+  void CloseSession(uint32_t promise_id, const char* session_id, uint32_t session_id_size) override {
+    for (size_t i = 0; i < m_sessions.size(); i++) {
+      if (m_sessions[i].id == std::string(session_id, session_id_size)) {
+        m_sessions.erase(m_sessions.begin() + i);
+        m_key_usable = !m_sessions.empty() && m_key_usable;
+        m_host->OnResolvePromise(promise_id);
+        m_host->OnSessionClosed(session_id, session_id_size);
+        return;
+      }
+    }
+    reject(promise_id, "no such session");
+  }
+
+  void RemoveSession(uint32_t promise_id, const char* session_id, uint32_t session_id_size) override {
+    reject(promise_id, "temporary sessions can't be removed");
+  }
+
+  void TimerExpired(void* context) override {}
+
+  cdm::Status Decrypt(const cdm::InputBuffer_2& encrypted_buffer, cdm::DecryptedBlock* decrypted_buffer) override {
+
+    auto buffer = m_host->Allocate(encrypted_buffer.data_size);
+    if (buffer == nullptr) {
+      return cdm::kDecryptError;
+    }
+    if (!decrypt(encrypted_buffer, buffer->Data())) {
+      buffer->Destroy();
+      return cdm::kNoKey;
+    }
+
+    buffer->SetSize(encrypted_buffer.data_size);
+    decrypted_buffer->SetDecryptedBuffer(buffer);
+    decrypted_buffer->SetTimestamp(encrypted_buffer.timestamp);
+    return cdm::kSuccess;
+  }
+
+  cdm::Status InitializeAudioDecoder(const cdm::AudioDecoderConfig_2& audio_decoder_config) override {
+    return cdm::kInitializationError;
+  }
+
+  cdm::Status InitializeVideoDecoder(const cdm::VideoDecoderConfig_2& video_decoder_config) override {
+    if (video_decoder_config.format != cdm::kI420 || video_decoder_config.coded_size.width <= 0 || video_decoder_config.coded_size.height <= 0) {
+      return cdm::kInitializationError;
+    }
+    m_coded_size = video_decoder_config.coded_size;
+    return cdm::kSuccess;
+  }
+
+  void DeinitializeDecoder(cdm::StreamType decoder_type) override {
+    m_coded_size = { 0, 0 };
+  }
+
+  void ResetDecoder(cdm::StreamType decoder_type) override {}
+
+  cdm::Status DecryptAndDecodeFrame(const cdm::InputBuffer_2& encrypted_buffer, cdm::VideoFrame* video_frame) override {
+
+    if (m_coded_size.width == 0) {
+      return cdm::kDecodeError;
+    }
+
+    std::vector<uint8_t> sample(encrypted_buffer.data_size);
+    if (!decrypt(encrypted_buffer, sample.data())) {
+      return cdm::kNoKey;
+    }
+
+    uint32_t y_size  = m_coded_size.width * m_coded_size.height;
+    uint32_t uv_size = y_size / 4;
+    auto     buffer  = m_host->Allocate(y_size + uv_size * 2);
+    if (buffer == nullptr) {
+      return cdm::kDecodeError;
+    }
+
+    // every page gets written, as a decoder would
+    for (uint32_t i = 0; i < y_size + uv_size * 2; i++) {
+      buffer->Data()[i] = sample.empty() ? 0 : sample[i % sample.size()];
+    }
+    buffer->SetSize(y_size + uv_size * 2);
+
+    video_frame->SetFormat(cdm::kI420);
+    video_frame->SetSize(m_coded_size);
+    video_frame->SetFrameBuffer(buffer);
+    video_frame->SetPlaneOffset(cdm::kYPlane, 0);
+    video_frame->SetPlaneOffset(cdm::kUPlane, y_size);
+    video_frame->SetPlaneOffset(cdm::kVPlane, y_size + uv_size);
+    video_frame->SetStride(cdm::kYPlane, m_coded_size.width);
+    video_frame->SetStride(cdm::kUPlane, m_coded_size.width / 2);
+    video_frame->SetStride(cdm::kVPlane, m_coded_size.width / 2);
+    video_frame->SetTimestamp(encrypted_buffer.timestamp);
+    return cdm::kSuccess;
+  }
+
+  cdm::Status DecryptAndDecodeSamples(const cdm::InputBuffer_2& encrypted_buffer, cdm::AudioFrames* audio_frames) override {
+    return cdm::kDecodeError;
+  }
+
+  void OnPlatformChallengeResponse(const cdm::PlatformChallengeResponse& response) override {}
+
+  void OnQueryOutputProtectionStatus(cdm::QueryResult result, uint32_t link_mask, uint32_t output_protection_mask) override {}
+
+  void OnStorageId(uint32_t version, const uint8_t* storage_id, uint32_t storage_id_size) override {}
+
+  void Destroy() override {
+    delete this;
+  }
+
+  FakeCdm(cdm::Host_10* host) : m_host(host) {}
+};
+
+extern "C" {
+
+CDM_API void INITIALIZE_CDM_MODULE() {}
+
+CDM_API void DeinitializeCdmModule() {}
+
+CDM_API void* CreateCdmInstance(int cdm_interface_version, const char* key_system, uint32_t key_system_size, GetCdmHostFunc get_cdm_host_func, void* user_data) {
+  if (cdm_interface_version != cdm::ContentDecryptionModule_10::kVersion) {
+    return nullptr;
+  }
+  auto host = static_cast<cdm::Host_10*>(get_cdm_host_func(cdm::Host_10::kVersion, user_data));
+  if (host == nullptr) {
+    return nullptr;
+  }
+  return static_cast<cdm::ContentDecryptionModule_10*>(new FakeCdm(host));
+}
+
+CDM_API const char* GetCdmVersion() {
+  return "fcdm-fake 1.0";
+}
+
+}
@@ -0,0 +1,140 @@
+#include <cdm/content_decryption_module.h>
+
+// Entry points the library exports on top of the CDM API. `cdm_instance` is what CreateCdmInstance returned.
+
+extern "C" {
+
+// Workers and shared memory accounted against the process-wide budget. Limits of 0 mean there is none.
+struct FcdmUsage {
+  uint32_t workers;
+  uint32_t max_workers;
+  uint64_t shmem_bytes;
+  uint64_t max_shmem_bytes;
+  uint32_t waiting;         // CreateCdmInstance calls waiting for room
+  uint64_t rejected;        // CreateCdmInstance calls refused so far
+  uint32_t unreaped;        // workers of destroyed instances that haven't exited yet
+};
+
+// Returns an fd that turns readable when the worker has made host callbacks that haven't been delivered yet.
+// Hosts that poll it get callbacks as soon as they arrive instead of with their next call into the instance.
+// The fd is owned by the instance.
+CDM_API int FcdmGetCallbackFd(void* cdm_instance);
+
+// Delivers the pending host callbacks on the calling thread
+CDM_API void FcdmDispatchCallbacks(void* cdm_instance);
+
+// Zero-copy decoding. FcdmDecryptAndDecodeFrameExport() decodes like DecryptAndDecodeFrame, but instead of copying
+// the frame into a host buffer leaves it in the instance's decrypted arena. The host maps the arena once, read-only,
+// from the fd and offset FcdmGetFrameArena() returns; the fd is owned by the instance. The size returned is what
+// the arena may grow to, the host should map all of it. A frame stays put until FcdmReleaseFrame() is called with
+// its slot. While all slots are held, decoding waits up to FCDM_EXPORT_WAIT_MS for one and then fails with
+// kDecodeError.
+struct FcdmFrame {
+  uint32_t         slot;
+  cdm::VideoFormat format;
+  int32_t          width;
+  int32_t          height;
+  uint32_t         offset;           // of the frame buffer in the arena
+  uint32_t         size;
+  uint32_t         plane_offsets[3]; // Y, U, V, from the start of the frame buffer
+  uint32_t         strides[3];
+  int64_t          timestamp;
+};
+
+CDM_API int FcdmGetFrameArena(void* cdm_instance, uint64_t* offset, uint64_t* size);
+
+// `region` is as for FcdmDecryptFromRegion(), 0 to pass the sample data by pointer
+CDM_API cdm::Status FcdmDecryptAndDecodeFrameExport(void* cdm_instance, uint32_t region, const cdm::InputBuffer_2* encrypted_buffer, struct FcdmFrame* frame);
+
+CDM_API void FcdmReleaseFrame(void* cdm_instance, uint32_t slot);
+
+// Zero-copy sample submission. A host that demuxes into a memfd registers it once with FcdmRegisterRegion(), which
+// hands the fd to the worker. Samples in it are then submitted with FcdmDecryptFromRegion() and
+// FcdmDecryptAndDecodeFrameFromRegion(), where `data` of the InputBuffer_2 is the sample's offset into the region
+// instead of a pointer and `data_size` its length. The worker reads them straight from its mapping of the region;
+// only the key id, IV and subsamples are still copied. The host must not rewrite a sample while a call on it is
+// running. The memfd must be sealed with F_SEAL_SHRINK, so that it can't be cut short under the worker's mapping.
+// Returns 0 if the region can't be registered, `fd` stays the caller's.
+CDM_API uint32_t FcdmRegisterRegion(void* cdm_instance, int fd);
+
+// Waits for the calls reading from the region, later ones fail
+CDM_API void FcdmUnregisterRegion(void* cdm_instance, uint32_t region);
+
+CDM_API cdm::Status FcdmDecryptFromRegion(void* cdm_instance, uint32_t region, const cdm::InputBuffer_2* encrypted_buffer, cdm::DecryptedBlock* decrypted_buffer);
+
+CDM_API cdm::Status FcdmDecryptAndDecodeFrameFromRegion(void* cdm_instance, uint32_t region, const cdm::InputBuffer_2* encrypted_buffer, cdm::VideoFrame* video_frame);
+
+// Resource counters of the hot-path calls, with FCDM_COUNTERS=1 in the environment. `method` is the ordinal of the
+// call in cdm.capnp: 9 for Decrypt, 14 for DecryptAndDecodeFrame; the export and region variants count as those.
+// Values are summed over the calls, in the shim (the calling thread and the I/O thread) and in the worker. Bit i of
+// `available` is set if counter i is counted on both sides. Returns false if counters are off or the worker
+// didn't answer.
+enum FcdmCounter {
+  FCDM_COUNTER_INSTRUCTIONS,
+  FCDM_COUNTER_CACHE_MISSES,
+  FCDM_COUNTER_PAGE_FAULTS,
+  FCDM_COUNTER_CONTEXT_SWITCHES,
+  FCDM_COUNTER_SYSCALLS,
+  FCDM_COUNTER_COUNT,
+};
+
+// for reports
+static const char* const FCDM_COUNTER_NAMES[FCDM_COUNTER_COUNT] = {
+  "instructions", "cache misses", "page faults", "context switches", "syscalls",
+};
+
+struct FcdmCallCounters {
+  uint64_t calls;
+  uint64_t shim[FCDM_COUNTER_COUNT];
+  uint64_t worker_calls;
+  uint64_t worker[FCDM_COUNTER_COUNT];
+  uint32_t available;
+};
+
+CDM_API bool FcdmGetCallCounters(void* cdm_instance, uint32_t method, struct FcdmCallCounters* counters);
+
+// Where CreateCdmInstance spent its time, in ns
+struct FcdmStartupTimes {
+  uint64_t spawn_ns;             // posix_spawn of the worker, or connecting to the daemon
+  uint64_t bootstrap_ns;         // the rest of the createCdmInstance round trip: exec, the capnp bootstrap and IPC
+  uint64_t load_ns;              // dlopen and dlsym of the CDM in the worker, 0 unless it started for this instance
+  uint64_t initialize_module_ns; // INITIALIZE_CDM_MODULE in the worker, likewise
+  uint64_t create_instance_ns;   // memfd, mmap and CreateCdmInstance in the worker
+  uint64_t map_ns;               // mapping the arenas here
+};
+
+CDM_API void FcdmGetStartupTimes(void* cdm_instance, struct FcdmStartupTimes* times);
+
+// Samples or frames that didn't fit their arena fail their call with kDecryptError or kDecodeError instead of
+// taking the worker down. The decrypted arena first grows, up to SHMEM_ARENA_MAX_SIZE, and shrinks back once the
+// instance is idle.
+struct FcdmArenaStats {
+  uint64_t grown;     // times the decrypted arena grew
+  uint64_t overflows; // calls failed for want of arena space or a free export slot
+};
+
+CDM_API void FcdmGetArenaStats(void* cdm_instance, struct FcdmArenaStats* stats);
+
+// Usage of the cgroup the instance's worker runs in, see FCDM_CGROUP. Returns false if it has none.
+struct FcdmWorkerUsage {
+  uint64_t cpu_usage_us;
+  uint64_t cpu_throttled_us;   // time held back by cpu.max
+  uint64_t memory_bytes;
+  uint64_t memory_high_events; // times memory.high was hit
+};
+
+CDM_API bool FcdmGetWorkerUsage(void* cdm_instance, struct FcdmWorkerUsage* usage);
+
+// Looks up the status of a key as last reported through OnSessionKeysChange, without a round trip to the worker.
+// Returns false if none of the instance's sessions has the key.
+CDM_API bool FcdmGetKeyStatus(void* cdm_instance, const uint8_t* key_id, uint32_t key_id_size, cdm::KeyStatus* status);
+
+// Shards the Decrypt calls of a decrypt-only instance over `shards` instances, this one included, each on a worker
+// of its own, for streams that keep one worker busy. The others load the persistent-license sessions loaded here,
+// reading the license through this instance's worker, and samples come back in the order they went in. They start
+// with the first Decrypt made while no decoder is initialized, which waits for them; call this before that.
+CDM_API void FcdmEnableDecryptShards(void* cdm_instance, uint32_t shards);
+
+CDM_API void FcdmGetUsage(struct FcdmUsage* usage);
+
+}
@@ -0,0 +1,320 @@
+#include <cstdio>
+#include <dlfcn.h>
+#include <sys/time.h>
+#include <kj/array.h>
+#include <kj/debug.h>
+#include <kj/map.h>
+#include <kj/string.h>
+#include <kj/vector.h>
+#include <cdm/content_decryption_module.h>
+#include "fcdm.h"
+
+// Stand-in for the browser side of a CDM instance, used by the command line tools that drive a shim
+
+class HeapBuffer: public cdm::Buffer {
+
+  kj::Array<uint8_t> m_data;
+  uint32_t           m_size;
+
+public:
+
+  void Destroy() override {
+    delete this;
+  }
+
+  uint32_t Capacity() const override {
+    return m_data.size();
+  }
+
+  uint8_t* Data() override {
+    return m_data.begin();
+  }
+
+  void SetSize(uint32_t size) override {
+    KJ_ASSERT(size <= m_data.size());
+    m_size = size;
+  }
+
+  uint32_t Size() const override {
+    return m_size;
+  }
+
+  HeapBuffer(uint32_t capacity) : m_data(kj::heapArray<uint8_t>(capacity)), m_size(capacity) {}
+
+  ~HeapBuffer() {}
+};
+
+class HostDecryptedBlock: public cdm::DecryptedBlock {
+
+  cdm::Buffer* m_buffer    = nullptr;
+  int64_t      m_timestamp = 0;
+
+public:
+
+  void SetDecryptedBuffer(cdm::Buffer* buffer) override {
+    m_buffer = buffer;
+  }
+
+  cdm::Buffer* DecryptedBuffer() override {
+    return m_buffer;
+  }
+
+  void SetTimestamp(int64_t timestamp) override {
+    m_timestamp = timestamp;
+  }
+
+  int64_t Timestamp() const override {
+    return m_timestamp;
+  }
+
+  HostDecryptedBlock() {}
+
+  ~HostDecryptedBlock() {
+    if (m_buffer != nullptr) {
+      m_buffer->Destroy();
+    }
+  }
+};
+
+class HostVideoFrame: public cdm::VideoFrame {
+
+  cdm::VideoFormat m_format       = cdm::kUnknownVideoFormat;
+  cdm::Size        m_size         = cdm::Size { .width = 0, .height = 0 };
+  cdm::Buffer*     m_frame_buffer = nullptr;
+  uint32_t         m_offsets[cdm::kMaxPlanes] = {};
+  uint32_t         m_strides[cdm::kMaxPlanes] = {};
+  int64_t          m_timestamp    = 0;
+
+public:
+
+  void SetFormat(cdm::VideoFormat format) override {
+    m_format = format;
+  }
+
+  cdm::VideoFormat Format() const override {
+    return m_format;
+  }
+
+  void SetSize(cdm::Size size) override {
+    m_size = size;
+  }
+
+  cdm::Size Size() const override {
+    return m_size;
+  }
+
+  void SetFrameBuffer(cdm::Buffer* frame_buffer) override {
+    m_frame_buffer = frame_buffer;
+  }
+
+  cdm::Buffer* FrameBuffer() override {
+    return m_frame_buffer;
+  }
+
+  void SetPlaneOffset(cdm::VideoPlane plane, uint32_t offset) override {
+    KJ_ASSERT(plane < cdm::kMaxPlanes);
+    m_offsets[plane] = offset;
+  }
+
+  uint32_t PlaneOffset(cdm::VideoPlane plane) override {
+    KJ_ASSERT(plane < cdm::kMaxPlanes);
+    return m_offsets[plane];
+  }
+
+  void SetStride(cdm::VideoPlane plane, uint32_t stride) override {
+    KJ_ASSERT(plane < cdm::kMaxPlanes);
+    m_strides[plane] = stride;
+  }
+
+  uint32_t Stride(cdm::VideoPlane plane) override {
+    KJ_ASSERT(plane < cdm::kMaxPlanes);
+    return m_strides[plane];
+  }
+
+  void SetTimestamp(int64_t timestamp) override {
+    m_timestamp = timestamp;
+  }
+
+  int64_t Timestamp() const override {
+    return m_timestamp;
+  }
+
+  HostVideoFrame() {}
+
+  ~HostVideoFrame() {
+    if (m_frame_buffer != nullptr) {
+      m_frame_buffer->Destroy();
+    }
+  }
+};
+
+class ToolHost: public cdm::Host_10 {
+
+  struct Timer {
+    double due;
+    void*  context;
+  };
+
+  kj::Vector<Timer> m_timers;
+  bool              m_output_protection_queried = false;
+
+public:
+
+  cdm::ContentDecryptionModule_10*  cdm = nullptr;
+  bool                              initialized = false;
+  kj::HashMap<uint32_t, kj::String> new_sessions; // promise id -> session id
+  kj::String                        last_message_session;
+  kj::Array<uint8_t>                last_message;
+  uint32_t                          resolved = 0;
+  uint32_t                          rejected = 0;
+  uint32_t                          keys_changes = 0;
+
+  // Delivers what the CDM asked the host for since the last call: expired timers (all of them if `all_timers`)
+  // and output protection queries.
+  void runPending(bool all_timers) {
+
+    if (m_output_protection_queried) {
+      m_output_protection_queried = false;
+      cdm->OnQueryOutputProtectionStatus(cdm::kQuerySucceeded, 0, 0);
+    }
+
+    auto now = GetCurrentWallTime();
+    auto timers = kj::mv(m_timers);
+    m_timers = kj::Vector<Timer>();
+    for (auto& timer: timers) {
+      if (all_timers || timer.due <= now) {
+        cdm->TimerExpired(timer.context);
+      } else {
+        m_timers.add(timer);
+      }
+    }
+  }
+
+  cdm::Buffer* Allocate(uint32_t capacity) override {
+    return new HeapBuffer(capacity);
+  }
+
+  void SetTimer(int64_t delay_ms, void* context) override {
+    m_timers.add(Timer { .due = GetCurrentWallTime() + delay_ms / 1000.0, .context = context });
+  }
+
+  cdm::Time GetCurrentWallTime() override {
+    struct timeval tv;
+    KJ_SYSCALL(gettimeofday(&tv, nullptr));
+    return static_cast<double>(tv.tv_sec) + tv.tv_usec / 1000000.0;
+  }
+
+  void OnInitialized(bool success) override {
+    initialized = success;
+  }
+
+  void OnResolveKeyStatusPromise(uint32_t promise_id, cdm::KeyStatus key_status) override {
+    resolved++;
+  }
+
+  void OnResolveNewSessionPromise(uint32_t promise_id, const char* session_id, uint32_t session_id_size) override {
+    new_sessions.upsert(promise_id, kj::heapString(session_id, session_id_size));
+    resolved++;
+  }
+
+  void OnResolvePromise(uint32_t promise_id) override {
+    resolved++;
+  }
+
+  void OnRejectPromise(uint32_t promise_id, cdm::Exception exception, uint32_t system_code, const char* error_message, uint32_t error_message_size) override {
+    KJ_LOG(WARNING, "promise rejected", promise_id, exception, system_code, kj::heapString(error_message, error_message_size));
+    rejected++;
+  }
+
+  void OnSessionMessage(const char* session_id, uint32_t session_id_size, cdm::MessageType message_type, const char* message, uint32_t message_size) override {
+    last_message_session = kj::heapString(session_id, session_id_size);
+    last_message = kj::heapArray(reinterpret_cast<const uint8_t*>(message), message_size);
+  }
+
+  void OnSessionKeysChange(const char* session_id, uint32_t session_id_size, bool has_additional_usable_key, const cdm::KeyInformation* keys_info, uint32_t keys_info_count) override {
+    keys_changes++;
+  }
+
+  void OnExpirationChange(const char* session_id, uint32_t session_id_size, cdm::Time new_expiry_time) override {}
+
+  void OnSessionClosed(const char* session_id, uint32_t session_id_size) override {}
+
+  void SendPlatformChallenge(const char* service_id, uint32_t service_id_size, const char* challenge, uint32_t challenge_size) override {}
+
+  void EnableOutputProtection(uint32_t desired_protection_mask) override {}
+
+  void QueryOutputProtectionStatus() override {
+    m_output_protection_queried = true;
+  }
+
+  void OnDeferredInitializationDone(cdm::StreamType stream_type, cdm::Status decoder_status) override {}
+
+  cdm::FileIO* CreateFileIO(cdm::FileIOClient* client) override {
+    // storage is served by the worker
+    return nullptr;
+  }
+
+  void RequestStorageId(uint32_t version) override {}
+
+  ToolHost() {}
+
+  ~ToolHost() {}
+};
+
+inline void* get_tool_host(int host_interface_version, void* user_data) {
+  KJ_ASSERT(host_interface_version == 10);
+  return user_data;
+}
+
+#define X_STR_(x) #x
+#define X_STR(x) X_STR_(x)
+
+// entry points of a fcdm-*.so shim
+struct Shim {
+
+  typedef void  (*InitializeCdmModuleFunc)();
+  typedef void  (*DeinitializeCdmModuleFunc)();
+  typedef void* (*CreateCdmInstanceFunc)(int, const char*, uint32_t, GetCdmHostFunc, void*);
+  typedef void  (*DispatchCallbacksFunc)(void*);
+  typedef void  (*GetUsageFunc)(FcdmUsage*);
+  typedef bool  (*GetCallCountersFunc)(void*, uint32_t, FcdmCallCounters*);
+  typedef int   (*GetCallbackFdFunc)(void*);
+  typedef void  (*GetStartupTimesFunc)(void*, FcdmStartupTimes*);
+
+  void*                     handle;
+  InitializeCdmModuleFunc   initialize;
+  DeinitializeCdmModuleFunc deinitialize;
+  CreateCdmInstanceFunc     create_instance;
+  DispatchCallbacksFunc     dispatch_callbacks; // these are ours, nullptr for other CDMs
+  GetUsageFunc              get_usage;
+  GetCallCountersFunc       get_call_counters;
+  GetCallbackFdFunc         get_callback_fd;
+  GetStartupTimesFunc       get_startup_times;
+
+  cdm::ContentDecryptionModule_10* createInstance(kj::StringPtr key_system, ToolHost& host) {
+    auto instance = create_instance(10, key_system.cStr(), key_system.size(), get_tool_host, static_cast<cdm::Host_10*>(&host));
+    KJ_ASSERT(instance != nullptr, "unable to create CDM instance", key_system);
+    host.cdm = reinterpret_cast<cdm::ContentDecryptionModule_10*>(instance);
+    return host.cdm;
+  }
+
+  static Shim load(const char* path) {
+    void* handle = dlopen(path, RTLD_NOW);
+    KJ_ASSERT(handle != nullptr, "dlopen", path, dlerror());
+
+    Shim shim;
+    shim.handle             = handle;
+    shim.initialize         = (InitializeCdmModuleFunc)dlsym(handle, X_STR(INITIALIZE_CDM_MODULE));
+    shim.deinitialize       = (DeinitializeCdmModuleFunc)dlsym(handle, "DeinitializeCdmModule");
+    shim.create_instance    = (CreateCdmInstanceFunc)dlsym(handle, "CreateCdmInstance");
+    shim.dispatch_callbacks = (DispatchCallbacksFunc)dlsym(handle, "FcdmDispatchCallbacks");
+    shim.get_usage          = (GetUsageFunc)dlsym(handle, "FcdmGetUsage");
+    shim.get_call_counters  = (GetCallCountersFunc)dlsym(handle, "FcdmGetCallCounters");
+    shim.get_callback_fd    = (GetCallbackFdFunc)dlsym(handle, "FcdmGetCallbackFd");
+    shim.get_startup_times  = (GetStartupTimesFunc)dlsym(handle, "FcdmGetStartupTimes");
+    KJ_ASSERT(shim.initialize != nullptr && shim.deinitialize != nullptr && shim.create_instance != nullptr);
+
+    shim.initialize();
+    return shim;
+  }
+};
@@ -1,6 +1,9 @@
+#include <atomic>
 #include <cerrno>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <signal.h>
 #include <fcntl.h>
 #include <dlfcn.h>
 #include <spawn.h>
@@ -8,144 +11,1669 @@
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <kj/main.h>
+#include <kj/map.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
 #include <capnp/rpc-twoparty.h>
 #include <cdm/content_decryption_module.h>
 #include "cdm.capnp.h"
+#include "capture.h"
 #include "config.h"
+#include "counters.h"
+#include "fcdm.h"
+#include "log.h"
 #include "util.h"
 
-static uint32_t write_input_buffer(const cdm::InputBuffer_2& source, XAlloc& allocator) {
+// With `data_in_region`, `data` is an offset into a host region the worker has mapped and stays as it is. Returns
+// false if the sample doesn't fit into the arena.
+static bool write_input_buffer(const cdm::InputBuffer_2& source, XAlloc& allocator, bool data_in_region, uint32_t& offset) {
 
-  auto data = allocator.allocate(source.data_size);
-  memcpy(data, source.data, source.data_size);
+  uint8_t* data = nullptr;
+  if (!data_in_region) {
+    data = allocator.allocate(source.data_size);
+    if (data == nullptr) {
+      return false;
+    }
+    memcpy(data, source.data, source.data_size);
+  }
+
+  auto key_id       = allocator.allocate(source.key_id_size);
+  auto iv           = allocator.allocate(source.iv_size);
+  auto subsamples   = allocator.allocate(sizeof(cdm::SubsampleEntry) * source.num_subsamples);
+  auto input_buffer = reinterpret_cast<cdm::InputBuffer_2*>(allocator.allocate(sizeof(cdm::InputBuffer_2)));
+  if (key_id == nullptr || iv == nullptr || subsamples == nullptr || input_buffer == nullptr) {
+    return false;
+  }
+
+  memcpy(key_id, source.key_id, source.key_id_size);
+  memcpy(iv, source.iv, source.iv_size);
+  memcpy(subsamples, source.subsamples, sizeof(cdm::SubsampleEntry) * source.num_subsamples);
+  memcpy(input_buffer, &source, sizeof(cdm::InputBuffer_2));
+
+  if (!data_in_region) {
+    input_buffer->data     = reinterpret_cast<uint8_t*>(allocator.getOffset(data));
+  }
+  input_buffer->key_id     = reinterpret_cast<uint8_t*>(allocator.getOffset(key_id));
+  input_buffer->iv         = reinterpret_cast<uint8_t*>(allocator.getOffset(iv));
+  input_buffer->subsamples = reinterpret_cast<cdm::SubsampleEntry*>(allocator.getOffset(subsamples));
+
+  offset = allocator.getOffset(reinterpret_cast<uint8_t*>(input_buffer));
+  return true;
+}
+
+// The parts of a decrypt or decode response the calling thread needs. They are read out on the I/O thread, the
+// response itself never leaves it.
+struct DecryptedData {
+  uint32_t offset;
+  uint32_t size;
+  int64_t  timestamp;
+};
+
+struct DecodedFrame {
+  cdm::VideoFormat format;
+  cdm::Size        size;
+  uint32_t         offset;
+  uint32_t         buffer_size;
+  uint32_t         plane_offsets[3];
+  uint32_t         strides[3];
+  int64_t          timestamp;
+};
+
+static void read_decrypted_data(DecryptedBlock::Reader source, DecryptedData& target) {
+  target.offset    = source.getBuffer().getOffset();
+  target.size      = source.getBuffer().getSize();
+  target.timestamp = source.getTimestamp();
+}
+
+static void read_decoded_frame(VideoFrame::Reader source, DecodedFrame& target) {
+  target.format           = static_cast<cdm::VideoFormat>(source.getFormat());
+  target.size             = cdm::Size { .width = source.getSize().getWidth(), .height = source.getSize().getHeight() };
+  target.offset           = source.getFrameBuffer().getOffset();
+  target.buffer_size      = source.getFrameBuffer().getSize();
+  target.plane_offsets[0] = source.getKYPlaneOffset();
+  target.plane_offsets[1] = source.getKUPlaneOffset();
+  target.plane_offsets[2] = source.getKVPlaneOffset();
+  target.strides[0]       = source.getKYPlaneStride();
+  target.strides[1]       = source.getKUPlaneStride();
+  target.strides[2]       = source.getKVPlaneStride();
+  target.timestamp        = source.getTimestamp();
+}
+
+struct PlaneLayout {
+  uint32_t row_size; // visible bytes per row
+  uint32_t rows;
+};
+
+static bool get_plane_layout(cdm::VideoFormat format, cdm::Size size, cdm::VideoPlane plane, PlaneLayout& layout) {
+
+  uint32_t bytes_per_sample;
+  bool     subsampled_x;
+  bool     subsampled_y;
+
+  switch (format) {
+    case cdm::kYv12:
+    case cdm::kI420:
+      bytes_per_sample = 1; subsampled_x = true;  subsampled_y = true;  break;
+    case cdm::kYUV420P9:
+    case cdm::kYUV420P10:
+    case cdm::kYUV420P12:
+      bytes_per_sample = 2; subsampled_x = true;  subsampled_y = true;  break;
+    case cdm::kYUV422P9:
+    case cdm::kYUV422P10:
+    case cdm::kYUV422P12:
+      bytes_per_sample = 2; subsampled_x = true;  subsampled_y = false; break;
+    case cdm::kYUV444P9:
+    case cdm::kYUV444P10:
+    case cdm::kYUV444P12:
+      bytes_per_sample = 2; subsampled_x = false; subsampled_y = false; break;
+    default:
+      return false;
+  }
+
+  if (size.width <= 0 || size.height <= 0) {
+    return false;
+  }
+
+  uint32_t width  = size.width;
+  uint32_t height = size.height;
+  if (plane != cdm::kYPlane) {
+    if (subsampled_x) width  = (width  + 1) / 2;
+    if (subsampled_y) height = (height + 1) / 2;
+  }
+
+  layout.row_size = width * bytes_per_sample;
+  layout.rows     = height;
+  return true;
+}
+
+// Copies only the visible rows of each plane into a tightly packed host buffer, leaving out stride padding
+// and whatever gaps the CDM left between the planes. Returns false if the frame layout is unknown or doesn't
+// fit into the reported frame buffer, in which case the frame has to be copied verbatim.
+static bool copy_compacted_frame(const uint8_t* source, const DecodedFrame& source_frame, cdm::Host_10* host, cdm::VideoFrame* video_frame) {
+
+  const cdm::VideoPlane planes[] = { cdm::kYPlane, cdm::kUPlane, cdm::kVPlane };
+  const uint32_t* source_offsets = source_frame.plane_offsets;
+  const uint32_t* source_strides = source_frame.strides;
+  const uint64_t  source_size    = source_frame.buffer_size;
+
+  PlaneLayout layouts[3];
+  uint64_t    packed_size = 0;
+
+  for (int i = 0; i < 3; i++) {
+    if (!get_plane_layout(video_frame->Format(), video_frame->Size(), planes[i], layouts[i])) {
+      return false;
+    }
+    if (layouts[i].row_size > source_strides[i]) {
+      return false;
+    }
+    uint64_t plane_end = source_offsets[i] + static_cast<uint64_t>(layouts[i].rows - 1) * source_strides[i] + layouts[i].row_size;
+    if (plane_end > source_size) {
+      return false;
+    }
+    packed_size += static_cast<uint64_t>(layouts[i].row_size) * layouts[i].rows;
+  }
+
+  if (packed_size > UINT32_MAX) {
+    return false;
+  }
+
+  auto framebuffer = host->Allocate(packed_size);
+  framebuffer->SetSize(packed_size);
+
+  uint8_t* target = framebuffer->Data();
+  uint32_t target_offset = 0;
+
+  for (int i = 0; i < 3; i++) {
+    const uint8_t* row = source + source_offsets[i];
+    if (layouts[i].row_size == source_strides[i]) {
+      memcpy(target + target_offset, row, layouts[i].row_size * layouts[i].rows);
+    } else {
+      for (uint32_t y = 0; y < layouts[i].rows; y++) {
+        memcpy(target + target_offset + y * layouts[i].row_size, row, layouts[i].row_size);
+        row += source_strides[i];
+      }
+    }
+    video_frame->SetPlaneOffset(planes[i], target_offset);
+    video_frame->SetStride(planes[i], layouts[i].row_size);
+    target_offset += layouts[i].row_size * layouts[i].rows;
+  }
+
+  video_frame->SetFrameBuffer(framebuffer);
+  return true;
+}
+
+// size hints so that hot-path requests fit into the first segment of the outgoing message
+static const capnp::MessageSize DECRYPT_PARAMS_SIZE = {
+  capnp::sizeInWords<CdmProxy::DecryptParams>(), 0
+};
+
+static const capnp::MessageSize DECRYPT_AND_DECODE_FRAME_PARAMS_SIZE = {
+  capnp::sizeInWords<CdmProxy::DecryptAndDecodeFrameParams>(), 0
+};
+
+// Host callbacks and call completions the I/O thread leaves for the host threads using one instance.
+//
+// Callbacks are delivered by a host thread that is waiting on, or next calls into, the instance. Callbacks the
+// worker makes between calls (timers, FileIO completions, license renewals) would have to wait for the next call
+// that way, so they can also be delivered as soon as they arrive:
+//  - by the host, polling the fd from FcdmGetCallbackFd() and calling FcdmDispatchCallbacks() when it's readable
+//  - by a delivery thread of our own, if FCDM_CALLBACK_THREAD is set. Only for hosts that don't mind being
+//    called from a thread they don't know.
+class Mailbox {
+
+  struct State {
+    uint64_t                         generation = 0;
+    kj::Vector<kj::Function<void()>> callbacks;
+    bool                             stopping = false;
+  };
+
+  kj::MutexGuarded<State> m_state;
+  std::atomic<bool>       m_dispatching;
+  std::atomic<bool>       m_signalled;
+  std::atomic<int>        m_signal_fd;     // write end of the callback fd pipe, -1 until the host asks for it
+  kj::AutoCloseFd         m_callback_fds[2];
+  kj::Own<kj::Thread>     m_delivery_thread;
+
+  void signal() {
+    int fd = m_signal_fd.load(std::memory_order_acquire);
+    if (fd >= 0 && !m_signalled.exchange(true, std::memory_order_acq_rel)) {
+      uint8_t byte = 0;
+      KJ_SYSCALL(write(fd, &byte, 1));
+    }
+  }
+
+  void clearSignal() {
+    if (m_signal_fd.load(std::memory_order_acquire) >= 0 && m_signalled.exchange(false, std::memory_order_acq_rel)) {
+      uint8_t buffer[64];
+      ssize_t n;
+      KJ_NONBLOCKING_SYSCALL(n = read(m_callback_fds[0].get(), buffer, sizeof(buffer)));
+    }
+  }
+
+public:
+
+  // I/O thread
+
+  void post(kj::Function<void()> callback) {
+    {
+      auto state = m_state.lockExclusive();
+      if (state->stopping) {
+        // the host is done with the instance, late answers to calls it didn't wait for go nowhere
+        return;
+      }
+      state->callbacks.add(kj::mv(callback));
+      state->generation++;
+    }
+    signal();
+  }
+
+  // Completes a call a host thread waits for in wait(). `done` is set under the lock, so once the waiter has had
+  // the lock after seeing it, we're done with the mailbox and the call, and it may free either.
+  void notify(std::atomic<bool>& done) {
+    auto state = m_state.lockExclusive();
+    done.store(true, std::memory_order_release);
+    state->generation++;
+  }
+
+  // host threads
+
+  // Runs the pending callbacks in the order they came in. One thread delivers at a time, the others leave
+  // whatever arrives meanwhile to it.
+  void dispatch() {
+
+    bool expected = false;
+    while (m_dispatching.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+      clearSignal();
+      {
+        KJ_DEFER(m_dispatching.store(false, std::memory_order_release));
+        for (;;) {
+          kj::Vector<kj::Function<void()>> callbacks;
+          {
+            auto state = m_state.lockExclusive();
+            callbacks = kj::mv(state->callbacks);
+            state->callbacks = kj::Vector<kj::Function<void()>>();
+          }
+          if (callbacks.empty()) {
+            break;
+          }
+          for (auto& callback: callbacks) {
+            callback();
+          }
+        }
+      }
+      // something may have been posted between the last check and the flag being cleared
+      if (m_state.lockShared()->callbacks.empty()) {
+        break;
+      }
+      expected = false;
+    }
+  }
+
+  // Blocks until `done` is set, delivering host callbacks meanwhile. Spins on `done` for up to `spin_ns` first.
+  void wait(std::atomic<bool>& done, int64_t spin_ns) {
+    for (;;) {
+      uint64_t seen = m_state.lockShared()->generation;
+      dispatch();
+      if (spin_ns > 0) {
+        auto deadline = monotonic_ns() + spin_ns;
+        while (!done.load(std::memory_order_acquire) && monotonic_ns() < deadline) {
+          cpu_relax();
+        }
+        spin_ns = 0;
+      }
+      if (done.load(std::memory_order_acquire)) {
+        // wait for notify() to let go of the lock, see there
+        { auto state = m_state.lockExclusive(); }
+        // callbacks the worker made before answering belong to this call
+        dispatch();
+        return;
+      }
+      m_state.when([seen](const State& state) { return state.generation != seen; }, [](State&) {});
+    }
+  }
+
+  // Returns an fd that turns readable when there are callbacks to dispatch
+  int getCallbackFd() {
+
+    auto state = m_state.lockExclusive();
+
+    if (m_callback_fds[0] == nullptr) {
+      int fds[2];
+      KJ_SYSCALL(pipe2(fds, O_CLOEXEC | O_NONBLOCK));
+      m_callback_fds[0] = kj::AutoCloseFd(fds[0]);
+      m_callback_fds[1] = kj::AutoCloseFd(fds[1]);
+      m_signal_fd.store(fds[1], std::memory_order_release);
+      if (!state->callbacks.empty()) {
+        signal();
+      }
+    }
+
+    return m_callback_fds[0].get();
+  }
+
+  void startDeliveryThread() {
+    m_delivery_thread = kj::heap<kj::Thread>([this]() {
+      LogCallback log_callback;
+      for (;;) {
+        uint64_t seen = m_state.lockShared()->generation;
+        dispatch();
+        bool stopping = m_state.when([seen](const State& state) {
+          return state.stopping || state.generation != seen;
+        }, [](State& state) {
+          return state.stopping;
+        });
+        if (stopping) {
+          break;
+        }
+      }
+    });
+  }
+
+  void stop() {
+    m_state.lockExclusive()->stopping = true;
+    m_delivery_thread = nullptr;
+  }
+
+  Mailbox() : m_dispatching(false), m_signalled(false), m_signal_fd(-1) {}
+
+  KJ_DISALLOW_COPY(Mailbox);
+};
+
+// The thread every instance in the process talks to its worker from. Host threads hand it calls through a
+// lock-free queue and block on the instance's Mailbox until they complete, so capnp objects are only ever
+// touched here and the host is free to call into an instance from any of its threads.
+class IoThread {
+
+public:
+
+  typedef kj::Function<kj::Promise<void>(kj::AsyncIoContext&)> Start;
+
+private:
+
+  struct Node {
+    std::atomic<Node*> next { nullptr };
+  };
+
+  struct Call: Node {
+    Start                    start;
+    Mailbox*                 mailbox; // nullptr if nobody waits for the call
+    kj::Maybe<kj::Exception> exception;
+    std::atomic<bool>        done { false };
+
+    Call(Start start, Mailbox* mailbox) : start(kj::mv(start)), mailbox(mailbox) {}
+  };
+
+  // intrusive MPSC queue, host threads push at m_head, the I/O thread pops at m_tail
+  std::atomic<Node*>     m_head;
+  Node*                  m_tail;
+  Node                   m_stub;
+  std::atomic<bool>      m_awake;
+  int                    m_wakeup[2];
+  int64_t                m_spin_ns;
+  uint64_t               m_activity = 0; // calls started and completed, I/O thread only
+  kj::Own<kj::Thread>    m_thread;
+
+  void push(Node* node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    auto prev = m_head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // Returns nullptr if the queue is empty, or if the next call is still being linked in by its producer. That
+  // one wakes us up again once it's done.
+  Call* pop() {
+
+    Node* tail = m_tail;
+    Node* next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &m_stub) {
+      if (next == nullptr) {
+        return nullptr;
+      }
+      m_tail = next;
+      tail   = next;
+      next   = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr) {
+      m_tail = next;
+      return static_cast<Call*>(tail);
+    }
+
+    if (tail != m_head.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+
+    push(&m_stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+      m_tail = next;
+      return static_cast<Call*>(tail);
+    }
+
+    return nullptr;
+  }
+
+  void complete(Call* call) {
+    m_activity++;
+
+    if (call->mailbox == nullptr) {
+      KJ_IF_MAYBE(exception, call->exception) {
+        KJ_LOG(ERROR, *exception);
+      }
+      delete call;
+      return;
+    }
+
+    // the caller may return and free both as soon as notify() lets go of the mailbox
+    call->mailbox->notify(call->done);
+  }
+
+  void wakeUp() {
+    if (!m_awake.exchange(true, std::memory_order_acq_rel)) {
+      uint8_t byte = 0;
+      KJ_SYSCALL(write(m_wakeup[1], &byte, 1));
+    }
+  }
+
+  void drain(kj::AsyncIoContext& io) {
+    while (auto call = pop()) {
+      m_activity++;
+      kj::evalNow([&]() {
+        return call->start(io);
+      }).then([this, call]() {
+        complete(call);
+      }, [this, call](kj::Exception&& exception) {
+        call->exception = kj::mv(exception);
+        complete(call);
+      }).detach([](kj::Exception&& exception) {
+        KJ_LOG(ERROR, exception);
+      });
+    }
+  }
+
+  // Busy-polls the queue and the sockets until nothing has happened for m_spin_ns. Producers see us awake
+  // meanwhile and skip the wakeup pipe.
+  void spin(kj::AsyncIoContext& io) {
+    m_awake.store(true, std::memory_order_release);
+
+    auto seen     = m_activity;
+    auto deadline = monotonic_ns() + m_spin_ns;
+    for (auto now = monotonic_ns(); now < deadline; now = monotonic_ns()) {
+      drain(io);
+      io.waitScope.poll();
+      if (m_activity != seen) {
+        seen     = m_activity;
+        deadline = now + m_spin_ns;
+      }
+    }
+  }
+
+  void loop() {
+
+    LogCallback log_callback;
+    register_counted_thread();
+
+    auto io     = kj::setupAsyncIo();
+    auto wakeup = io.lowLevelProvider->wrapInputFd(m_wakeup[0]);
+
+    uint8_t buffer[64];
+    for (;;) {
+      if (m_spin_ns > 0) {
+        spin(io);
+      }
+
+      m_awake.exchange(false, std::memory_order_acq_rel);
+      drain(io);
+
+      wakeup->tryRead(buffer, 1, sizeof(buffer)).wait(io.waitScope);
+    }
+  }
+
+public:
+
+  // Runs `start` on the I/O thread and waits for the promise it returns, delivering `mailbox` callbacks
+  // meanwhile. Exceptions are rethrown on the calling thread.
+  void run(Mailbox& mailbox, Start start) {
+
+    Call call(kj::mv(start), &mailbox);
+    push(&call);
+    wakeUp();
+
+    mailbox.wait(call.done, m_spin_ns);
+
+    KJ_IF_MAYBE(exception, call.exception) {
+      kj::throwFatalException(kj::mv(*exception));
+    }
+  }
+
+  // Queues `start` for the I/O thread and returns right away. Calls queued from one thread, by run() or post(),
+  // start in the order they were queued. `start` has to handle its own errors, whatever escapes is only logged.
+  void post(Start start) {
+    push(new Call(kj::mv(start), nullptr));
+    wakeUp();
+  }
+
+  static IoThread& get() {
+    // never destroyed, instances may outlive static destructors
+    static IoThread* thread = new IoThread();
+    return *thread;
+  }
+
+  IoThread() : m_head(&m_stub), m_tail(&m_stub), m_awake(false), m_spin_ns(get_spin_ns()) {
+    KJ_SYSCALL(pipe2(m_wakeup, O_CLOEXEC));
+    m_thread = kj::heap<kj::Thread>([this]() { loop(); });
+  }
+
+  KJ_DISALLOW_COPY(IoThread);
+};
+
+// Process-wide accounting of workers and the shared memory given to them. CreateCdmInstance waits for room, or is
+// refused, instead of letting a burst of instances push the machine into swap. Limits come from
+// FCDM_MAX_WORKERS and FCDM_MEMORY_BUDGET_MB, how long to wait for room from FCDM_ADMISSION_TIMEOUT_MS (negative
+// waits for good). A limit of 0 means there is none.
+class Budget {
+
+  struct Usage {
+    uint32_t workers     = 0;
+    uint64_t shmem_bytes = 0;
+    uint32_t waiting     = 0;
+    uint64_t rejected    = 0;
+  };
+
+  kj::MutexGuarded<Usage>  m_usage;
+  uint32_t                 m_max_workers;
+  uint64_t                 m_max_shmem_bytes;
+  int64_t                  m_admission_timeout_ms;
+
+  bool fits(const Usage& usage, uint64_t shmem_bytes) const {
+    return (m_max_workers     == 0 || usage.workers + 1 <= m_max_workers) &&
+           (m_max_shmem_bytes == 0 || usage.shmem_bytes + shmem_bytes <= m_max_shmem_bytes);
+  }
+
+public:
+
+  // Accounts a worker with `shmem_bytes` of arenas. Returns false if there is no room for it, after waiting as
+  // long as configured.
+  bool acquire(uint64_t shmem_bytes) {
+
+    auto admit = [&](Usage& usage) {
+      if (!fits(usage, shmem_bytes)) {
+        usage.rejected++;
+        KJ_LOG(ERROR, "CDM instance refused, budget exhausted", usage.workers, m_max_workers, usage.shmem_bytes, m_max_shmem_bytes);
+        return false;
+      }
+      usage.workers++;
+      usage.shmem_bytes += shmem_bytes;
+      return true;
+    };
+
+    {
+      auto usage = m_usage.lockExclusive();
+      if (fits(*usage, shmem_bytes) || m_admission_timeout_ms == 0) {
+        return admit(*usage);
+      }
+      usage->waiting++;
+    }
+
+    kj::Maybe<kj::Duration> timeout = nullptr;
+    if (m_admission_timeout_ms > 0) {
+      timeout = m_admission_timeout_ms * kj::MILLISECONDS;
+    }
+
+    return m_usage.when([&](const Usage& usage) { return fits(usage, shmem_bytes); }, [&](Usage& usage) {
+      usage.waiting--;
+      return admit(usage);
+    }, timeout);
+  }
+
+  void release(uint64_t shmem_bytes) {
+    auto usage = m_usage.lockExclusive();
+    usage->workers--;
+    usage->shmem_bytes -= shmem_bytes;
+  }
+
+  // Charges `shmem_bytes` more to a worker that is accounted already, such as arena growth. Doesn't wait, returns
+  // false if they don't fit.
+  bool reserve(uint64_t shmem_bytes) {
+    auto usage = m_usage.lockExclusive();
+    if (m_max_shmem_bytes != 0 && usage->shmem_bytes + shmem_bytes > m_max_shmem_bytes) {
+      return false;
+    }
+    usage->shmem_bytes += shmem_bytes;
+    return true;
+  }
+
+  void unreserve(uint64_t shmem_bytes) {
+    m_usage.lockExclusive()->shmem_bytes -= shmem_bytes;
+  }
+
+  void getUsage(FcdmUsage& target) {
+    auto usage = m_usage.lockShared();
+    target.workers         = usage->workers;
+    target.max_workers     = m_max_workers;
+    target.shmem_bytes     = usage->shmem_bytes;
+    target.max_shmem_bytes = m_max_shmem_bytes;
+    target.waiting         = usage->waiting;
+    target.rejected        = usage->rejected;
+  }
+
+  static Budget& get() {
+    static Budget budget;
+    return budget;
+  }
+
+  Budget() :
+    m_max_workers         (getenv_int("FCDM_MAX_WORKERS", MAX_WORKERS)),
+    m_max_shmem_bytes     (getenv_int("FCDM_MEMORY_BUDGET_MB", MEMORY_BUDGET_MB) * 1024 * 1024),
+    m_admission_timeout_ms(getenv_int("FCDM_ADMISSION_TIMEOUT_MS", ADMISSION_TIMEOUT_MS)) {}
+
+  KJ_DISALLOW_COPY(Budget);
+};
+
+// What the worker told the host about the keys of one instance: the statuses from OnSessionKeysChange, for
+// FcdmGetKeyStatus(), and the answers to GetStatusForPolicy. Those depend on the keys and the outputs, so they are
+// kept until either changes, or for FCDM_POLICY_CACHE_MS at most (0 turns them off). Filled in on the I/O thread,
+// read by host threads.
+class KeyStatusCache {
+
+  struct Key {
+    kj::Array<uint8_t> key_id;
+    cdm::KeyStatus     status;
+  };
+
+  struct PolicyStatus {
+    cdm::KeyStatus status;
+    int64_t        expires;
+  };
+
+  struct State {
+    kj::HashMap<kj::String, kj::Array<Key>> sessions;         // session id -> keys
+    kj::HashMap<uint32_t, PolicyStatus>      policy_statuses;  // min HDCP version -> answer
+    kj::HashMap<uint32_t, uint32_t>          pending_policies; // promise id -> min HDCP version
+  };
+
+  kj::MutexGuarded<State> m_state;
+  int64_t                 m_policy_ttl_ns;
+
+public:
+
+  // I/O thread
+
+  void updateSession(kj::StringPtr session_id, kj::ArrayPtr<const cdm::KeyInformation> keys_info) {
+
+    auto keys = kj::heapArrayBuilder<Key>(keys_info.size());
+    for (auto& key_info: keys_info) {
+      keys.add(Key { kj::heapArray(key_info.key_id, key_info.key_id_size), key_info.status });
+    }
+
+    auto state = m_state.lockExclusive();
+    state->sessions.upsert(kj::str(session_id), keys.finish(), [](kj::Array<Key>& existing, kj::Array<Key>&& replacement) {
+      existing = kj::mv(replacement);
+    });
+    state->policy_statuses.clear();
+  }
+
+  void closeSession(kj::StringPtr session_id) {
+    auto state = m_state.lockExclusive();
+    state->sessions.erase(session_id);
+    state->policy_statuses.clear();
+  }
+
+  void resolvePolicy(uint32_t promise_id, cdm::KeyStatus status) {
+    auto state = m_state.lockExclusive();
+    KJ_IF_MAYBE(min_hdcp_version, state->pending_policies.find(promise_id)) {
+      if (m_policy_ttl_ns > 0) {
+        state->policy_statuses.upsert(*min_hdcp_version, PolicyStatus { status, monotonic_ns() + m_policy_ttl_ns },
+          [](PolicyStatus& existing, PolicyStatus&& replacement) { existing = replacement; });
+      }
+      state->pending_policies.erase(promise_id);
+    }
+  }
+
+  // Also called on host threads, for the promises the shim rejects itself
+  void rejectPolicy(uint32_t promise_id) {
+    m_state.lockExclusive()->pending_policies.erase(promise_id);
+  }
+
+  // host threads
+
+  kj::Maybe<cdm::KeyStatus> findKey(kj::ArrayPtr<const uint8_t> key_id) {
+    kj::Maybe<cdm::KeyStatus> found;
+    auto state = m_state.lockShared();
+    for (auto& session: state->sessions) {
+      for (auto& key: session.value) {
+        // a key usable in any session is usable
+        bool same = key.key_id.size() == key_id.size() && memcmp(key.key_id.begin(), key_id.begin(), key_id.size()) == 0;
+        if (same && (found == nullptr || key.status == cdm::kUsable)) {
+          found = key.status;
+        }
+      }
+    }
+    return found;
+  }
+
+  kj::Maybe<cdm::KeyStatus> findPolicy(cdm::HdcpVersion min_hdcp_version) {
+    auto state = m_state.lockShared();
+    KJ_IF_MAYBE(policy_status, state->policy_statuses.find(static_cast<uint32_t>(min_hdcp_version))) {
+      if (policy_status->expires > monotonic_ns()) {
+        return policy_status->status;
+      }
+    }
+    return nullptr;
+  }
+
+  // Remembers which policy the answer to `promise_id` is for
+  void expectPolicy(uint32_t promise_id, cdm::HdcpVersion min_hdcp_version) {
+    m_state.lockExclusive()->pending_policies.upsert(promise_id, min_hdcp_version);
+  }
+
+  // Drops the answers, and those still to come, which were asked under different outputs
+  void forgetPolicies() {
+    auto state = m_state.lockExclusive();
+    state->policy_statuses.clear();
+    state->pending_policies.clear();
+  }
+
+  KeyStatusCache() : m_policy_ttl_ns(getenv_int("FCDM_POLICY_CACHE_MS", POLICY_CACHE_MS) * 1000000) {}
+
+  KJ_DISALLOW_COPY(KeyStatusCache);
+};
+
+// How long a call to the worker may take, in ms, 0 for no limit. Decrypt and decode calls get
+// FCDM_DATA_DEADLINE_MS, everything else FCDM_CONTROL_DEADLINE_MS. FCDM_DEADLINES_MS overrides single methods, as
+// in "Decrypt=50,UpdateSession=60000".
+static uint32_t get_deadline_ms(uint16_t method) {
+
+  static const kj::Array<uint32_t> deadlines = []() {
+
+    auto data_ms    = getenv_int("FCDM_DATA_DEADLINE_MS",    DATA_DEADLINE_MS);
+    auto control_ms = getenv_int("FCDM_CONTROL_DEADLINE_MS", CONTROL_DEADLINE_MS);
+
+    auto deadlines = kj::heapArray<uint32_t>(kj::size(CDM_PROXY_METHOD_NAMES));
+    for (uint16_t i = 0; i < deadlines.size(); i++) {
+      deadlines[i] = is_data_plane(i) ? data_ms : control_ms;
+    }
+
+    char* overrides = getenv("FCDM_DEADLINES_MS");
+    if (overrides != nullptr) {
+      auto copy = kj::heapString(overrides);
+      char* saveptr;
+      for (char* entry = strtok_r(copy.begin(), ",", &saveptr); entry != nullptr; entry = strtok_r(nullptr, ",", &saveptr)) {
+        bool  found = false;
+        char* value = strchr(entry, '=');
+        if (value != nullptr) {
+          *value++ = '\0';
+          for (size_t i = 0; i < deadlines.size(); i++) {
+            if (strcmp(entry, CDM_PROXY_METHOD_NAMES[i]) == 0) {
+              deadlines[i] = strtoul(value, nullptr, 10);
+              found = true;
+            }
+          }
+        }
+        if (!found) {
+          KJ_LOG(WARNING, "ignoring FCDM_DEADLINES_MS entry", entry);
+        }
+      }
+    }
+
+    return deadlines;
+  }();
+
+  return method < deadlines.size() ? deadlines[method] : 0;
+}
+
+// A cgroup v2 of its own for each worker, created under FCDM_CGROUP, a cgroup delegated to us. One stream's
+// decoding then can't starve the others, and its usage can be told apart. FCDM_CGROUP_CPU_MAX,
+// FCDM_CGROUP_CPU_WEIGHT and FCDM_CGROUP_MEMORY_HIGH go into its cpu.max, cpu.weight and memory.high as they are.
+// The worker moves itself in before it loads the CDM. Where cgroups aren't available, workers run without.
+class WorkerCgroup {
+
+  kj::String m_path;
+
+  static bool writeFile(kj::StringPtr path, kj::StringPtr value) {
+    int fd = open(path.cStr(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    kj::AutoCloseFd file(fd);
+    return write(fd, value.begin(), value.size()) == static_cast<ssize_t>(value.size());
+  }
+
+  static kj::String readFile(kj::StringPtr path) {
+    int fd = open(path.cStr(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return kj::str();
+    }
+    kj::AutoCloseFd file(fd);
+    char    buffer[4096];
+    ssize_t size = read(fd, buffer, sizeof(buffer) - 1);
+    return kj::heapString(buffer, size > 0 ? size : 0);
+  }
+
+  // The value of `key` in a flat keyed file such as cpu.stat
+  static uint64_t readKey(kj::StringPtr contents, kj::StringPtr key) {
+    for (const char* line = contents.begin(); line != nullptr && *line != '\0'; ) {
+      if (strncmp(line, key.cStr(), key.size()) == 0 && line[key.size()] == ' ') {
+        return strtoull(line + key.size() + 1, nullptr, 10);
+      }
+      line = strchr(line, '\n');
+      if (line != nullptr) {
+        line++;
+      }
+    }
+    return 0;
+  }
+
+  // Cgroups whose workers were still running when their instance went, removed once they are empty
+  static kj::MutexGuarded<kj::Vector<kj::String>>& leftovers() {
+    static auto* leftovers = new kj::MutexGuarded<kj::Vector<kj::String>>();
+    return *leftovers;
+  }
+
+  static void removeLeftovers() {
+    auto paths = leftovers().lockExclusive();
+    for (size_t i = paths->size(); i-- > 0; ) {
+      if (rmdir((*paths)[i].cStr()) == 0 || errno == ENOENT) {
+        (*paths)[i] = kj::mv(paths->back());
+        paths->removeLast();
+      }
+    }
+  }
+
+public:
+
+  kj::StringPtr getPath() {
+    return m_path;
+  }
+
+  void getUsage(FcdmWorkerUsage& target) {
+    auto cpu_stat      = readFile(kj::str(m_path, "/cpu.stat"));
+    auto memory_events = readFile(kj::str(m_path, "/memory.events"));
+    target.cpu_usage_us       = readKey(cpu_stat, "usage_usec");
+    target.cpu_throttled_us   = readKey(cpu_stat, "throttled_usec");
+    target.memory_bytes       = strtoull(readFile(kj::str(m_path, "/memory.current")).cStr(), nullptr, 10);
+    target.memory_high_events = readKey(memory_events, "high");
+  }
+
+  static kj::Own<WorkerCgroup> create() {
+
+    char* root = getenv("FCDM_CGROUP");
+    if (root == nullptr) {
+      return nullptr;
+    }
+
+    removeLeftovers();
+
+    static std::atomic<uint32_t> next_id(0);
+    auto path = kj::str(root, "/fcdm-", getpid(), "-", next_id++);
+
+    // usually enabled already, and only root may if it isn't
+    writeFile(kj::str(root, "/cgroup.subtree_control"), "+cpu +memory");
+
+    if (mkdir(path.cStr(), 0755) < 0) {
+      KJ_LOG(WARNING, "unable to create worker cgroup, running without", path, strerror(errno));
+      return nullptr;
+    }
+
+    struct Limit {
+      const char* variable;
+      const char* file;
+    };
+    for (auto limit: { Limit { "FCDM_CGROUP_CPU_MAX", "cpu.max" }, Limit { "FCDM_CGROUP_CPU_WEIGHT", "cpu.weight" },
+                       Limit { "FCDM_CGROUP_MEMORY_HIGH", "memory.high" } }) {
+      char* value = getenv(limit.variable);
+      if (value != nullptr && !writeFile(kj::str(path, "/", limit.file), value)) {
+        KJ_LOG(WARNING, "unable to set worker cgroup limit", limit.file, value, strerror(errno));
+      }
+    }
+
+    return kj::heap<WorkerCgroup>(kj::mv(path));
+  }
+
+  WorkerCgroup(kj::String path) : m_path(kj::mv(path)) {}
+
+  ~WorkerCgroup() noexcept {
+    // dropped once the worker is reaped, so it is empty by now unless the worker left children behind
+    if (rmdir(m_path.cStr()) < 0 && errno != ENOENT) {
+      leftovers().lockExclusive()->add(kj::mv(m_path));
+    }
+  }
+
+  KJ_DISALLOW_COPY(WorkerCgroup);
+};
+
+// Collects the exit status of the workers instances let go of, so that they don't linger as zombies, and removes
+// their cgroups after them. A worker exits once it sees its socket close; until then it is polled for on the I/O
+// thread every REAP_INTERVAL_MS.
+class Reaper {
+
+  struct Worker {
+    pid_t                 pid;
+    kj::Own<WorkerCgroup> cgroup;
+  };
+
+  kj::MutexGuarded<kj::Vector<Worker>> m_workers;
+  bool                                 m_polling = false; // I/O thread
+
+  // Returns true once all workers are reaped
+  bool reap() {
+
+    auto workers = m_workers.lockExclusive();
+    for (size_t i = 0; i < workers->size();) {
+
+      auto& worker = (*workers)[i];
+      int   status;
+      pid_t result = waitpid(worker.pid, &status, WNOHANG);
+      if (result == 0) {
+        i++;
+        continue;
+      }
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (result < 0) {
+        // the host reaped it itself, or ignores SIGCHLD
+        KJ_LOG(INFO, "worker already reaped", worker.pid, strerror(errno));
+      } else if (WIFSIGNALED(status)) {
+        KJ_LOG(WARNING, "worker killed", worker.pid, WTERMSIG(status));
+      } else if (WEXITSTATUS(status) != EXIT_SUCCESS) {
+        KJ_LOG(WARNING, "worker failed", worker.pid, WEXITSTATUS(status));
+      }
+
+      worker = kj::mv(workers->back());
+      workers->removeLast();
+    }
+    return workers->empty();
+  }
+
+  kj::Promise<void> poll(kj::Timer& timer) {
+    if (reap()) {
+      m_polling = false;
+      return kj::READY_NOW;
+    }
+    return timer.afterDelay(REAP_INTERVAL_MS * kj::MILLISECONDS).then([this, &timer]() {
+      return poll(timer);
+    });
+  }
+
+public:
+
+  void add(pid_t pid, kj::Own<WorkerCgroup> cgroup) {
+    m_workers.lockExclusive()->add(Worker { pid, kj::mv(cgroup) });
+    IoThread::get().post([this](kj::AsyncIoContext& io) -> kj::Promise<void> {
+      if (m_polling) {
+        return kj::READY_NOW;
+      }
+      m_polling = true;
+      return poll(io.provider->getTimer());
+    });
+  }
+
+  uint32_t pending() {
+    return m_workers.lockShared()->size();
+  }
+
+  static Reaper& get() {
+    static Reaper* reaper = new Reaper();
+    return *reaper;
+  }
+
+  Reaper() {}
+
+  KJ_DISALLOW_COPY(Reaper);
+};
+
+// encrypted arena + control page + decrypted arena
+static uint64_t instance_shmem_size() {
+  long page_size;
+  KJ_SYSCALL(page_size = sysconf(_SC_PAGESIZE));
+  return SHMEM_ARENA_SIZE * 2 + page_size;
+}
+
+// Hands the fd of a host region to the worker, see FcdmRegisterRegion()
+class HostRegionImpl final: public HostRegion::Server {
+
+  kj::AutoCloseFd m_fd;
+
+public:
+
+  kj::Maybe<int> getFd() override {
+    return m_fd.get();
+  }
+
+  HostRegionImpl(kj::AutoCloseFd fd) : m_fd(kj::mv(fd)) {}
+};
+
+// Host of the extra instances a decrypt-only instance shards its Decrypt calls over, see CdmWrapper::startShards().
+// Output buffers and the clock come from the real host. Of the rest, the shard only tracks which sessions it has
+// loaded; timers and output protection queries are answered with the next call into the shard, as the real host
+// doesn't know about it.
+class ShardHost: public cdm::Host_10 {
+
+  struct Timer {
+    cdm::Time due;
+    void*     context;
+  };
+
+  struct State {
+    kj::Vector<kj::String> sessions; // loaded
+    kj::Vector<Timer>      timers;
+    bool                   output_protection_queried = false;
+  };
+
+  cdm::Host_10*           m_host;
+  std::atomic<uint32_t>   m_next_promise_id;
+  kj::MutexGuarded<State> m_state;
+
+public:
+
+  uint32_t nextPromiseId() {
+    return m_next_promise_id.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  bool hasSession(kj::StringPtr session_id) {
+    for (auto& session: m_state.lockShared()->sessions) {
+      if (session == session_id) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool ready() {
+    return !m_state.lockShared()->sessions.empty();
+  }
+
+  // Delivers the timers that are due and the output protection query, if any, to `shard`
+  void runPending(cdm::ContentDecryptionModule_10* shard) {
+
+    kj::Vector<void*> expired;
+    bool              queried;
+    {
+      auto state = m_state.lockExclusive();
+      auto now   = m_host->GetCurrentWallTime();
+      for (size_t i = 0; i < state->timers.size();) {
+        if (state->timers[i].due <= now) {
+          expired.add(state->timers[i].context);
+          state->timers[i] = state->timers.back();
+          state->timers.removeLast();
+        } else {
+          i++;
+        }
+      }
+      queried = state->output_protection_queried;
+      state->output_protection_queried = false;
+    }
+
+    for (auto context: expired) {
+      shard->TimerExpired(context);
+    }
+    if (queried) {
+      // we can't vouch for the link, CDMs that insist on protection keep their keys from the shard
+      shard->OnQueryOutputProtectionStatus(cdm::kQueryFailed, 0, 0);
+    }
+  }
+
+  cdm::Buffer* Allocate(uint32_t capacity) override {
+    return m_host->Allocate(capacity);
+  }
+
+  void SetTimer(int64_t delay_ms, void* context) override {
+    auto due = m_host->GetCurrentWallTime() + delay_ms / 1000.0;
+    m_state.lockExclusive()->timers.add(Timer { due, context });
+  }
+
+  cdm::Time GetCurrentWallTime() override {
+    return m_host->GetCurrentWallTime();
+  }
+
+  void OnInitialized(bool success) override {
+    if (!success) {
+      KJ_LOG(WARNING, "decrypt shard failed to initialize");
+    }
+  }
+
+  void OnResolveKeyStatusPromise(uint32_t promise_id, cdm::KeyStatus key_status) override {}
+
+  void OnResolveNewSessionPromise(uint32_t promise_id, const char* session_id, uint32_t session_id_size) override {
+    // an empty id means the license isn't there
+    if (session_id_size == 0) {
+      KJ_LOG(WARNING, "decrypt shard didn't find the session", promise_id);
+      return;
+    }
+    m_state.lockExclusive()->sessions.add(kj::heapString(session_id, session_id_size));
+  }
+
+  void OnResolvePromise(uint32_t promise_id) override {}
+
+  void OnRejectPromise(uint32_t promise_id, cdm::Exception exception, uint32_t system_code, const char* error_message, uint32_t error_message_size) override {
+    KJ_LOG(WARNING, "decrypt shard rejected a promise", promise_id, exception, system_code, kj::heapString(error_message, error_message_size));
+  }
+
+  void OnSessionMessage(const char* session_id, uint32_t session_id_size, cdm::MessageType message_type, const char* message, uint32_t message_size) override {}
+
+  void OnSessionKeysChange(const char* session_id, uint32_t session_id_size, bool has_additional_usable_key, const cdm::KeyInformation* keys_info, uint32_t keys_info_count) override {}
+
+  void OnExpirationChange(const char* session_id, uint32_t session_id_size, cdm::Time new_expiry_time) override {}
+
+  void OnSessionClosed(const char* session_id, uint32_t session_id_size) override {
+    auto closed = kj::heapString(session_id, session_id_size);
+    auto state  = m_state.lockExclusive();
+    for (size_t i = 0; i < state->sessions.size(); i++) {
+      if (state->sessions[i] == closed) {
+        state->sessions[i] = kj::mv(state->sessions.back());
+        state->sessions.removeLast();
+        break;
+      }
+    }
+  }
+
+  void SendPlatformChallenge(const char* service_id, uint32_t service_id_size, const char* challenge, uint32_t challenge_size) override {}
+
+  void EnableOutputProtection(uint32_t desired_protection_mask) override {}
+
+  void QueryOutputProtectionStatus() override {
+    m_state.lockExclusive()->output_protection_queried = true;
+  }
+
+  void OnDeferredInitializationDone(cdm::StreamType stream_type, cdm::Status decoder_status) override {}
+
+  cdm::FileIO* CreateFileIO(cdm::FileIOClient* client) override {
+    // storage is served by the worker, from the one of the instance the shard is for
+    return nullptr;
+  }
+
+  void RequestStorageId(uint32_t version) override {}
+
+  ShardHost(cdm::Host_10* host) : m_host(host), m_next_promise_id(1) {}
+
+  KJ_DISALLOW_COPY(ShardHost);
+};
+
+class CdmWrapper: public cdm::ContentDecryptionModule_10 {
+
+  // owned by the I/O thread
+  kj::Own<kj::AsyncCapabilityStream> m_stream;
+  kj::Own<capnp::TwoPartyClient>     m_client;
+  CdmProxy::Client                   m_cdm;
+  kj::Own<CaptureLog>                m_capture;
+
+  cdm::Host_10*                      m_host;
+  kj::AutoCloseFd                    m_memfd;
+  kj::MutexGuarded<XAlloc>           m_allocator; // held for the whole of a decrypt or decode, they share the arenas
+  void*                              m_decrypted_buffers;
+  ArenaControl*                      m_arena_control;
+  kj::Own<Mailbox>                   m_mailbox;
+  kj::Own<KeyStatusCache>            m_key_statuses;
+  pid_t                              m_worker_pid;       // 0 for the daemon
+  std::atomic<bool>                  m_suspect;          // missed a deadline and hasn't answered since
+  bool                               m_watching = false; // I/O thread
+  kj::Canceler                       m_canceler;         // I/O thread, for the work that outlives the call that started it
+  kj::Own<WorkerCgroup>              m_cgroup;           // none for the daemon or without FCDM_CGROUP
+  kj::Own<CallCounters>              m_counters = CallCounters::create(); // nullptr unless FCDM_COUNTERS is set
+  FcdmStartupTimes                   m_startup;
+
+  // host regions registered with the worker, mapped here as well for bounds checks and capture. Held shared for
+  // the whole of a call that reads from one.
+  kj::MutexGuarded<kj::HashMap<uint32_t, kj::Own<MappedRegion>>> m_regions;
+
+  // Instances on workers of their own that load the persistent sessions the host loads here, see
+  // FcdmEnableDecryptShards(). Decrypt calls take turns between them and us. They start with the first Decrypt
+  // while no decoder is initialized, and are fixed from then on.
+  struct Shard {
+    CdmWrapper*        cdm;
+    kj::Own<ShardHost> host;
+  };
+
+  // What shards that start late have to catch up on
+  struct ShardGroup {
+    bool                   initialized                  = false; // Initialize was called, with these
+    bool                   allow_distinctive_identifier = false;
+    bool                   allow_persistent_state       = false;
+    bool                   use_hw_secure_codecs         = false;
+    kj::Vector<kj::String> sessions;                             // persistent sessions loaded here
+  };
+
+  int                          m_cdm_interface_version = 0;
+  kj::String                   m_key_system;
+  kj::Vector<Shard>            m_shards;             // written before m_sharded is set, under m_group
+  std::atomic<bool>            m_sharded { false };
+  std::atomic<uint32_t>        m_shards_wanted { 0 }; // not started yet
+  std::atomic<bool>            m_decoding { false };  // a video decoder is initialized
+  kj::MutexGuarded<ShardGroup> m_group;
+  std::atomic<uint64_t>        m_next_ticket { 0 };
+  kj::MutexGuarded<uint64_t>   m_returned; // Decrypt calls before this ticket have returned
+
+  void startShards();
+
+  template <typename Params>
+  kj::Own<CaptureLog::Record> capture(uint16_t method, Params params) {
+    return capture_call(m_capture.get(), CaptureRecord::Interface::CDM_PROXY, method, params);
+  }
+
+  void run(IoThread::Start start) {
+    IoThread::get().run(*m_mailbox, kj::mv(start));
+  }
+
+  // Like run(), but a failed call (the worker gone, a deadline missed) is logged and returns false instead of
+  // throwing at the host
+  bool tryRun(IoThread::Start start) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { run(kj::mv(start)); })) {
+      KJ_LOG(ERROR, *exception);
+      return false;
+    }
+    return true;
+  }
+
+  // I/O thread. Pings the worker once a call missed its deadline. The ping queues up behind whatever the CDM is
+  // stuck in, so if it isn't answered within FCDM_WATCHDOG_MS the worker is taken to be wedged and killed. Until
+  // it answers, decrypt and decode calls fail right away instead of each waiting out its deadline.
+  void watch(kj::AsyncIoContext& io) {
+
+    static const int64_t watchdog_ms = getenv_int("FCDM_WATCHDOG_MS", WATCHDOG_MS);
+
+    m_suspect.store(true, std::memory_order_release);
+    if (m_watching) {
+      return;
+    }
+    m_watching = true;
+    KJ_LOG(WARNING, "worker missed a deadline", m_worker_pid);
+
+    m_canceler.wrap(m_cdm.pingRequest().send().then([this](auto&&) {
+      KJ_LOG(WARNING, "worker is answering again", m_worker_pid);
+      m_suspect.store(false, std::memory_order_release);
+      m_watching = false;
+    }).exclusiveJoin(io.provider->getTimer().afterDelay(watchdog_ms * kj::MILLISECONDS).then([this]() {
+      // we can't kill the daemon's child serving us, but it kills a child whose client hung up on it
+      if (m_worker_pid == 0) {
+        KJ_LOG(ERROR, "worker is wedged, hanging up on the daemon");
+        m_stream->abortRead();
+        m_stream->shutdownWrite();
+        return;
+      }
+      KJ_LOG(ERROR, "worker is wedged, killing it", m_worker_pid);
+      KJ_SYSCALL(kill(m_worker_pid, SIGKILL));
+    })).then([]() {}, [this](kj::Exception&& exception) {
+      KJ_LOG(ERROR, "lost the worker", m_worker_pid, exception);
+    })).detach([](kj::Exception&&) {
+      // canceled by Destroy()
+    });
+  }
+
+  // I/O thread. Fails `promise` if it isn't done within the deadline of `method`.
+  kj::Promise<void> withDeadline(kj::AsyncIoContext& io, uint16_t method, kj::Promise<void> promise) {
+
+    auto deadline_ms = get_deadline_ms(method);
+    if (deadline_ms == 0) {
+      return promise;
+    }
+
+    return promise.exclusiveJoin(io.provider->getTimer().afterDelay(deadline_ms * kj::MILLISECONDS).then([this, &io, method]() {
+      watch(io);
+      kj::throwFatalException(KJ_EXCEPTION(OVERLOADED, "deadline exceeded", CDM_PROXY_METHOD_NAMES[method], m_worker_pid));
+    }));
+  }
+
+  // Sends the request `build` makes on the I/O thread and waits for the response
+  template <typename Build>
+  void send(uint16_t method, Build&& build) {
+    tryRun([&](kj::AsyncIoContext& io) {
+      auto request = build();
+      auto record  = capture(method, request.asReader());
+      return withDeadline(io, method, request.send().then([record = kj::mv(record)](auto&&) mutable {
+        finish_capture(record);
+      }));
+    });
+  }
+
+  // Like send(), but returns as soon as the request is queued. The CDM reports the outcome through the host's
+  // callbacks; if the request never gets to it, `failed` is delivered to the host instead. `build` runs on the I/O
+  // thread after the caller has returned, so it has to own whatever it puts into the request.
+  template <typename Build>
+  void sendAsync(uint16_t method, Build&& build, kj::Function<void()> failed) {
+    IoThread::get().post([this, method, build = kj::fwd<Build>(build), failed = kj::mv(failed)](kj::AsyncIoContext& io) mutable {
+      auto request = build();
+      auto record  = capture(method, request.asReader());
+      return m_canceler.wrap(withDeadline(io, method, request.send().then([record = kj::mv(record)](auto&&) mutable {
+        finish_capture(record);
+      })).then([]() {}, [this, method, failed = kj::mv(failed)](kj::Exception&& exception) mutable {
+        KJ_LOG(ERROR, "call failed", method, exception);
+        m_mailbox->post(kj::mv(failed));
+      })).then([]() {}, [](kj::Exception&&) {
+        // canceled by Destroy(), the host doesn't expect callbacks anymore
+      });
+    });
+  }
 
-  auto key_id = allocator.allocate(source.key_id_size);
-  memcpy(key_id, source.key_id, source.key_id_size);
+  void closeOnShards(const char* session_id, uint32_t session_id_size) {
+    auto group  = m_group.lockExclusive();
+    auto closed = kj::heapString(session_id, session_id_size);
+    for (size_t i = 0; i < group->sessions.size(); i++) {
+      if (group->sessions[i] == closed) {
+        group->sessions[i] = kj::mv(group->sessions.back());
+        group->sessions.removeLast();
+        break;
+      }
+    }
+    for (auto& shard: m_shards) {
+      if (shard.host->hasSession(kj::heapString(session_id, session_id_size))) {
+        shard.cdm->CloseSession(shard.host->nextPromiseId(), session_id, session_id_size);
+      }
+    }
+  }
 
-  auto iv = allocator.allocate(source.iv_size);
-  memcpy(iv, source.iv, source.iv_size);
+  // Hands samples to the members of the group in turn, us included, and returns once the ones handed out before
+  // have returned, so that they come back in the order they went in. They only run side by side when the host
+  // calls from several threads. A shard without a session loaded, or without the key, leaves the sample to us.
+  cdm::Status decryptSharded(const cdm::InputBuffer_2& encrypted_buffer, cdm::DecryptedBlock* decrypted_buffer) {
+
+    auto ticket = m_next_ticket.fetch_add(1, std::memory_order_relaxed);
+    KJ_DEFER(m_returned.when([ticket](const uint64_t& returned) { return returned == ticket; }, [](uint64_t& returned) { returned++; }));
+
+    auto index = ticket % (m_shards.size() + 1);
+    if (index > 0) {
+      auto& shard = m_shards[index - 1];
+      // the outcome of the session calls is waiting there
+      shard.cdm->getMailbox().dispatch();
+      if (shard.host->ready()) {
+        shard.host->runPending(shard.cdm);
+        auto status = shard.cdm->decrypt(0, encrypted_buffer, decrypted_buffer);
+        if (status != cdm::kNoKey) {
+          return status;
+        }
+      }
+    }
 
-  auto subsamples = allocator.allocate(sizeof(cdm::SubsampleEntry) * source.num_subsamples);
-  memcpy(subsamples, source.subsamples, sizeof(cdm::SubsampleEntry) * source.num_subsamples);
+    return decrypt(0, encrypted_buffer, decrypted_buffer);
+  }
 
-  auto input_buffer = reinterpret_cast<cdm::InputBuffer_2*>(allocator.allocate(sizeof(cdm::InputBuffer_2)));
-  memcpy(input_buffer, &source, sizeof(cdm::InputBuffer_2));
+  kj::Function<void()> rejectPromise(uint32_t promise_id) {
+    return [host = m_host, key_statuses = m_key_statuses.get(), promise_id]() {
+      static const char message[] = "CDM worker failed";
+      key_statuses->rejectPolicy(promise_id);
+      host->OnRejectPromise(promise_id, cdm::kExceptionInvalidStateError, 0, message, sizeof(message) - 1);
+    };
+  }
 
-  input_buffer->data       = reinterpret_cast<uint8_t*>(allocator.getOffset(data));
-  input_buffer->key_id     = reinterpret_cast<uint8_t*>(allocator.getOffset(key_id));
-  input_buffer->iv         = reinterpret_cast<uint8_t*>(allocator.getOffset(iv));
-  input_buffer->subsamples = reinterpret_cast<cdm::SubsampleEntry*>(allocator.getOffset(subsamples));
+  // Stages `encrypted_buffer` in the encrypted arena and returns its offset. With a region, `data` is an offset into
+  // it, and `captured` is set to a copy pointing into our mapping of the region for the capture log. Returns false
+  // if there is no such region, the sample isn't inside it or it doesn't fit into the arena.
+  bool stageInput(XAlloc& allocator, const kj::HashMap<uint32_t, kj::Own<MappedRegion>>& regions, uint32_t region,
+    const cdm::InputBuffer_2& encrypted_buffer, uint32_t& offset, cdm::InputBuffer_2& captured) {
+
+    captured = encrypted_buffer;
+
+    if (region != 0) {
+      auto found = regions.find(region);
+      KJ_IF_MAYBE(mapping, found) {
+        captured.data = (*mapping)->begin() + reinterpret_cast<uintptr_t>(encrypted_buffer.data);
+        if (!(*mapping)->contains(captured.data, captured.data_size)) {
+          KJ_LOG(ERROR, "sample outside of its region", region, reinterpret_cast<uintptr_t>(encrypted_buffer.data), encrypted_buffer.data_size);
+          return false;
+        }
+      } else {
+        KJ_LOG(ERROR, "unknown region", region);
+        return false;
+      }
+    }
 
-  return allocator.getOffset(reinterpret_cast<uint8_t*>(input_buffer));
-}
+    if (!write_input_buffer(encrypted_buffer, allocator, region != 0, offset)) {
+      m_arena_control->overflows.fetch_add(1, std::memory_order_relaxed);
+      KJ_LOG(WARNING, "sample doesn't fit into the encrypted arena", encrypted_buffer.data_size);
+      allocator.forget();
+      return false;
+    }
+    return true;
+  }
 
-class CdmWrapper: public cdm::ContentDecryptionModule_10 {
+  // Runs a decrypt and decode in the worker. The caller holds the allocator and the arena control lock, and has to
+  // be done with the frame in the decrypted arena before it lets go of them.
+  cdm::Status decodeFrame(XAlloc& allocator, uint32_t region, const cdm::InputBuffer_2& encrypted_buffer, DecodedFrame& source) {
 
-  kj::AsyncIoContext&                m_io;
-  kj::Own<kj::AsyncCapabilityStream> m_stream;
-  kj::Own<capnp::TwoPartyClient>     m_client;
-  CdmProxy::Client                   m_cdm;
-  cdm::Host_10*                      m_host;
-  XAlloc                             m_allocator;
-  void*                              m_decrypted_buffers;
+    auto regions = m_regions.lockShared();
+
+    uint32_t           offset;
+    cdm::InputBuffer_2 captured;
+    if (!stageInput(allocator, *regions, region, encrypted_buffer, offset, captured)) {
+      return cdm::kDecodeError;
+    }
+
+    cdm::Status status = cdm::kDecodeError;
+
+    tryRun([&](kj::AsyncIoContext& io) {
+      auto request = m_cdm.decryptAndDecodeFrameRequest(DECRYPT_AND_DECODE_FRAME_PARAMS_SIZE);
+      request.setEncryptedBufferOffset(offset);
+      request.setDataRegion(region);
+
+      auto record = capture(CDM_PROXY_DECRYPT_AND_DECODE_FRAME, request.asReader());
+      capture_input_buffer(record, captured);
+
+      return withDeadline(io, CDM_PROXY_DECRYPT_AND_DECODE_FRAME, request.send().then([&, record = kj::mv(record)](capnp::Response<CdmProxy::DecryptAndDecodeFrameResults>&& response) mutable {
+        status = static_cast<cdm::Status>(response.getStatus());
+        finish_capture(record, status, response);
+        if (status == cdm::kSuccess) {
+          read_decoded_frame(response.getVideoFrame(), source);
+        }
+      }));
+    });
+
+    allocator.forget();
+    return status;
+  }
 
 public:
 
   void Initialize(bool allow_distinctive_identifier, bool allow_persistent_state, bool use_hw_secure_codecs) override {
     KJ_DLOG(INFO, "Initialize", allow_distinctive_identifier, allow_persistent_state, use_hw_secure_codecs);
-    auto request = m_cdm.initializeRequest();
-    request.setAllowDistinctiveIdentifier(allow_distinctive_identifier);
-    request.setAllowPersistentState(allow_persistent_state);
-    request.setUseHwSecureCodecs(use_hw_secure_codecs);
-    request.send().wait(m_io.waitScope);
+    sendAsync(CDM_PROXY_INITIALIZE, [this, allow_distinctive_identifier, allow_persistent_state, use_hw_secure_codecs]() {
+      auto request = m_cdm.initializeRequest();
+      request.setAllowDistinctiveIdentifier(allow_distinctive_identifier);
+      request.setAllowPersistentState(allow_persistent_state);
+      request.setUseHwSecureCodecs(use_hw_secure_codecs);
+      return request;
+    }, [host = m_host]() {
+      host->OnInitialized(false);
+    });
+    {
+      auto group = m_group.lockExclusive();
+      group->initialized                  = true;
+      group->allow_distinctive_identifier = allow_distinctive_identifier;
+      group->allow_persistent_state       = allow_persistent_state;
+      group->use_hw_secure_codecs         = use_hw_secure_codecs;
+      for (auto& shard: m_shards) {
+        shard.cdm->Initialize(allow_distinctive_identifier, allow_persistent_state, use_hw_secure_codecs);
+      }
+    }
     KJ_DLOG(INFO, "exiting Initialize");
   }
 
   void GetStatusForPolicy(uint32_t promise_id, const cdm::Policy& policy) override {
-    KJ_UNIMPLEMENTED("GetStatusForPolicy");
+    KJ_DLOG(INFO, "GetStatusForPolicy", promise_id, policy.min_hdcp_version);
+
+    auto cached = m_key_statuses->findPolicy(policy.min_hdcp_version);
+    KJ_IF_MAYBE(status, cached) {
+      m_host->OnResolveKeyStatusPromise(promise_id, *status);
+      KJ_DLOG(INFO, "exiting GetStatusForPolicy, cached", *status);
+      return;
+    }
+
+    auto min_hdcp_version = policy.min_hdcp_version;
+    m_key_statuses->expectPolicy(promise_id, min_hdcp_version);
+    sendAsync(CDM_PROXY_GET_STATUS_FOR_POLICY, [this, promise_id, min_hdcp_version]() {
+      auto request = m_cdm.getStatusForPolicyRequest();
+      request.setPromiseId(promise_id);
+      request.setMinHdcpVersion(min_hdcp_version);
+      return request;
+    }, rejectPromise(promise_id));
+    KJ_DLOG(INFO, "exiting GetStatusForPolicy");
   }
 
   void SetServerCertificate(uint32_t promise_id, const uint8_t* server_certificate_data, uint32_t server_certificate_data_size) override {
     KJ_DLOG(INFO, "SetServerCertificate", promise_id, server_certificate_data, server_certificate_data_size);
-    auto request = m_cdm.setServerCertificateRequest();
-    request.setPromiseId(promise_id);
-    request.setServerCertificateData(kj::arrayPtr(server_certificate_data, server_certificate_data_size));
-    request.send().wait(m_io.waitScope);
+    sendAsync(CDM_PROXY_SET_SERVER_CERTIFICATE, [this, promise_id,
+                                                 server_certificate_data = kj::heapArray(server_certificate_data, server_certificate_data_size)]() {
+      auto request = m_cdm.setServerCertificateRequest();
+      request.setPromiseId(promise_id);
+      request.setServerCertificateData(server_certificate_data.asPtr());
+      return request;
+    }, rejectPromise(promise_id));
     KJ_DLOG(INFO, "exiting SetServerCertificate");
   }
 
   void CreateSessionAndGenerateRequest(
     uint32_t promise_id, cdm::SessionType session_type, cdm::InitDataType init_data_type, const uint8_t* init_data, uint32_t init_data_size) override {
     KJ_DLOG(INFO, "CreateSessionAndGenerateRequest", promise_id, session_type, init_data_type, init_data, init_data_size);
-    auto request = m_cdm.createSessionAndGenerateRequestRequest();
-    request.setPromiseId(promise_id);
-    request.setSessionType(session_type);
-    request.setInitDataType(init_data_type);
-    request.setInitData(kj::arrayPtr(init_data, init_data_size));
-    request.send().wait(m_io.waitScope);
+    sendAsync(CDM_PROXY_CREATE_SESSION_AND_GENERATE_REQUEST, [this, promise_id, session_type, init_data_type,
+                                                              init_data = kj::heapArray(init_data, init_data_size)]() {
+      auto request = m_cdm.createSessionAndGenerateRequestRequest();
+      request.setPromiseId(promise_id);
+      request.setSessionType(session_type);
+      request.setInitDataType(init_data_type);
+      request.setInitData(init_data.asPtr());
+      return request;
+    }, rejectPromise(promise_id));
     KJ_DLOG(INFO, "exiting CreateSessionAndGenerateRequest");
   }
 
   void LoadSession(uint32_t promise_id, cdm::SessionType session_type, const char* session_id, uint32_t session_id_size) override {
-    KJ_UNIMPLEMENTED("LoadSession");
+    KJ_DLOG(INFO, "LoadSession", promise_id, session_type, session_id, session_id_size);
+    sendAsync(CDM_PROXY_LOAD_SESSION, [this, promise_id, session_type, session_id = kj::heapString(session_id, session_id_size)]() {
+      auto request = m_cdm.loadSessionRequest();
+      request.setPromiseId(promise_id);
+      request.setSessionType(session_type);
+      request.setSessionId(kj::StringPtr(session_id));
+      return request;
+    }, rejectPromise(promise_id));
+    // the shards' workers read the license from ours, see HostProxyImpl::readFile()
+    if (session_type == cdm::kPersistentLicense) {
+      auto group = m_group.lockExclusive();
+      group->sessions.add(kj::heapString(session_id, session_id_size));
+      for (auto& shard: m_shards) {
+        shard.cdm->LoadSession(shard.host->nextPromiseId(), session_type, session_id, session_id_size);
+      }
+    }
+    KJ_DLOG(INFO, "exiting LoadSession");
   }
 
   void UpdateSession(uint32_t promise_id, const char* session_id, uint32_t session_id_size, const uint8_t* response, uint32_t response_size) override {
     KJ_DLOG(INFO, "UpdateSession", promise_id, session_id, session_id_size, response, response_size);
-    auto request = m_cdm.updateSessionRequest();
-    request.setPromiseId(promise_id);
-    request.setSessionId(kj::StringPtr(session_id, session_id_size));
-    request.setResponse(kj::arrayPtr(response, response_size));
-    request.send().wait(m_io.waitScope);
+    sendAsync(CDM_PROXY_UPDATE_SESSION, [this, promise_id, session_id = kj::heapString(session_id, session_id_size),
+                                         response = kj::heapArray(response, response_size)]() {
+      auto request = m_cdm.updateSessionRequest();
+      request.setPromiseId(promise_id);
+      request.setSessionId(kj::StringPtr(session_id));
+      request.setResponse(response.asPtr());
+      return request;
+    }, rejectPromise(promise_id));
     KJ_DLOG(INFO, "exiting UpdateSession");
   }
 
   void CloseSession(uint32_t promise_id, const char* session_id, uint32_t session_id_size) override {
     KJ_DLOG(INFO, "CloseSession", promise_id, session_id, session_id_size);
-    auto request = m_cdm.closeSessionRequest();
-    request.setPromiseId(promise_id);
-    request.setSessionId(kj::StringPtr(session_id, session_id_size));
-    request.send().wait(m_io.waitScope);
+    sendAsync(CDM_PROXY_CLOSE_SESSION, [this, promise_id, session_id = kj::heapString(session_id, session_id_size)]() {
+      auto request = m_cdm.closeSessionRequest();
+      request.setPromiseId(promise_id);
+      request.setSessionId(kj::StringPtr(session_id));
+      return request;
+    }, rejectPromise(promise_id));
+    closeOnShards(session_id, session_id_size);
     KJ_DLOG(INFO, "exiting CloseSession");
   }
 
   void RemoveSession(uint32_t promise_id, const char* session_id, uint32_t session_id_size) override {
-    KJ_UNIMPLEMENTED("RemoveSession");
+    KJ_DLOG(INFO, "RemoveSession", promise_id, session_id, session_id_size);
+    sendAsync(CDM_PROXY_REMOVE_SESSION, [this, promise_id, session_id = kj::heapString(session_id, session_id_size)]() {
+      auto request = m_cdm.removeSessionRequest();
+      request.setPromiseId(promise_id);
+      request.setSessionId(kj::StringPtr(session_id));
+      return request;
+    }, rejectPromise(promise_id));
+    closeOnShards(session_id, session_id_size);
+    KJ_DLOG(INFO, "exiting RemoveSession");
   }
 
   void TimerExpired(void* context) override {
     KJ_DLOG(INFO, "TimerExpired", context);
-    auto request = m_cdm.timerExpiredRequest();
-    request.setContext(reinterpret_cast<uint64_t>(context));
-    request.send().wait(m_io.waitScope);
+    send(CDM_PROXY_TIMER_EXPIRED, [&]() {
+      auto request = m_cdm.timerExpiredRequest();
+      request.setContext(reinterpret_cast<uint64_t>(context));
+      return request;
+    });
     KJ_DLOG(INFO, "exiting TimerExpired");
   }
 
   cdm::Status Decrypt(const cdm::InputBuffer_2& encrypted_buffer, cdm::DecryptedBlock* decrypted_buffer) override {
-    KJ_DLOG(INFO, "Decrypt");
+    if (m_shards_wanted.load(std::memory_order_relaxed) > 0 && !m_decoding.load(std::memory_order_relaxed)) {
+      startShards();
+    }
+    if (m_sharded.load(std::memory_order_acquire)) {
+      return decryptSharded(encrypted_buffer, decrypted_buffer);
+    }
+    return decrypt(0, encrypted_buffer, decrypted_buffer);
+  }
+
+  // Decrypt, with the sample data in `region` if that isn't 0
+  cdm::Status decrypt(uint32_t region, const cdm::InputBuffer_2& encrypted_buffer, cdm::DecryptedBlock* decrypted_buffer) {
+    KJ_DLOG(INFO, "Decrypt", region);
     KJ_ASSERT(decrypted_buffer->DecryptedBuffer() == nullptr);
+    CallCounters::Scope counting(m_counters.get(), CDM_PROXY_DECRYPT);
 
-    auto request = m_cdm.decryptRequest();
+    auto allocator = m_allocator.lockExclusive();
+    auto regions   = m_regions.lockShared();
 
-    uint32_t offset = write_input_buffer(encrypted_buffer, m_allocator);
-    request.setEncryptedBufferOffset(offset);
+    // Checked with the allocator locked: a call that missed its deadline marks us suspect before it lets go of
+    // the lock, and is still queued in the worker, which fixes up the pointers of whatever is staged at its offset.
+    if (m_suspect.load(std::memory_order_acquire)) {
+      KJ_DLOG(INFO, "exiting Decrypt, the worker isn't answering");
+      return cdm::kDecryptError;
+    }
 
-    auto response = request.send().wait(m_io.waitScope);
-    auto status   = static_cast<cdm::Status>(response.getStatus());
+    // keeps the worker from dropping the arena pages while we are using them
+    m_arena_control->lock();
+    KJ_DEFER(m_arena_control->unlock());
 
-    m_allocator.forget();
+    uint32_t           offset;
+    cdm::InputBuffer_2 captured;
+    if (!stageInput(*allocator, *regions, region, encrypted_buffer, offset, captured)) {
+      KJ_DLOG(INFO, "exiting Decrypt, unable to stage the sample");
+      return cdm::kDecryptError;
+    }
 
-    if (status == cdm::kSuccess) {
+    cdm::Status   status = cdm::kDecryptError;
+    DecryptedData source;
+
+    tryRun([&](kj::AsyncIoContext& io) {
+      auto request = m_cdm.decryptRequest(DECRYPT_PARAMS_SIZE);
+      request.setEncryptedBufferOffset(offset);
+      request.setDataRegion(region);
+
+      auto record = capture(CDM_PROXY_DECRYPT, request.asReader());
+      capture_input_buffer(record, captured);
+
+      return withDeadline(io, CDM_PROXY_DECRYPT, request.send().then([&, record = kj::mv(record)](capnp::Response<CdmProxy::DecryptResults>&& response) mutable {
+        status = static_cast<cdm::Status>(response.getStatus());
+        finish_capture(record, status, response);
+        if (status == cdm::kSuccess) {
+          read_decrypted_data(response.getDecryptedBuffer(), source);
+        }
+      }));
+    });
+
+    allocator->forget();
 
-      auto source = response.getDecryptedBuffer();
+    if (status == cdm::kSuccess) {
 
-      auto buffer = m_host->Allocate(source.getBuffer().getSize());
-      buffer->SetSize(source.getBuffer().getSize());
-      memcpy(buffer->Data(), reinterpret_cast<uint8_t*>(m_decrypted_buffers) + source.getBuffer().getOffset(), source.getBuffer().getSize());
+      auto buffer = m_host->Allocate(source.size);
+      buffer->SetSize(source.size);
+      memcpy(buffer->Data(), reinterpret_cast<uint8_t*>(m_decrypted_buffers) + source.offset, source.size);
       decrypted_buffer->SetDecryptedBuffer(buffer);
 
-      decrypted_buffer->SetTimestamp(source.getTimestamp());
+      decrypted_buffer->SetTimestamp(source.timestamp);
     }
 
     KJ_DLOG(INFO, "exiting Decrypt", status);
@@ -158,23 +1686,31 @@ public:
 
   cdm::Status InitializeVideoDecoder(const cdm::VideoDecoderConfig_2& video_decoder_config) override {
     KJ_DLOG(INFO, "InitializeVideoDecoder");
+    m_decoding.store(true, std::memory_order_relaxed);
 
-    auto request = m_cdm.initializeVideoDecoderRequest();
-    {
-      auto req_video_decoder_config = request.getVideoDecoderConfig();
-      req_video_decoder_config.setCodec  (video_decoder_config.codec);
-      req_video_decoder_config.setProfile(video_decoder_config.profile);
-      req_video_decoder_config.setFormat (video_decoder_config.format);
+    cdm::Status status = cdm::kInitializationError;
+
+    tryRun([&](kj::AsyncIoContext& io) {
+      auto request = m_cdm.initializeVideoDecoderRequest();
       {
-        auto req_coded_size = req_video_decoder_config.getCodedSize();
-        req_coded_size.setWidth (video_decoder_config.coded_size.width);
-        req_coded_size.setHeight(video_decoder_config.coded_size.height);
+        auto req_video_decoder_config = request.getVideoDecoderConfig();
+        req_video_decoder_config.setCodec  (video_decoder_config.codec);
+        req_video_decoder_config.setProfile(video_decoder_config.profile);
+        req_video_decoder_config.setFormat (video_decoder_config.format);
+        {
+          auto req_coded_size = req_video_decoder_config.getCodedSize();
+          req_coded_size.setWidth (video_decoder_config.coded_size.width);
+          req_coded_size.setHeight(video_decoder_config.coded_size.height);
+        }
+        req_video_decoder_config.setExtraData(kj::arrayPtr(video_decoder_config.extra_data, video_decoder_config.extra_data_size));
+        req_video_decoder_config.setEncryptionScheme(static_cast<uint32_t>(video_decoder_config.encryption_scheme));
       }
-      req_video_decoder_config.setExtraData(kj::arrayPtr(video_decoder_config.extra_data, video_decoder_config.extra_data_size));
-      req_video_decoder_config.setEncryptionScheme(static_cast<uint32_t>(video_decoder_config.encryption_scheme));
-    }
-    auto response = request.send().wait(m_io.waitScope);
-    auto status   = static_cast<cdm::Status>(response.getStatus());
+      auto record = capture(CDM_PROXY_INITIALIZE_VIDEO_DECODER, request.asReader());
+      return withDeadline(io, CDM_PROXY_INITIALIZE_VIDEO_DECODER, request.send().then([&, record = kj::mv(record)](capnp::Response<CdmProxy::InitializeVideoDecoderResults>&& response) mutable {
+        status = static_cast<cdm::Status>(response.getStatus());
+        finish_capture(record, status, response);
+      }));
+    });
 
     KJ_DLOG(INFO, "exiting InitializeVideoDecoder", status);
     return status;
@@ -182,61 +1718,261 @@ public:
 
   void DeinitializeDecoder(cdm::StreamType decoder_type) override {
     KJ_DLOG(INFO, "DeinitializeDecoder", decoder_type);
-    auto request = m_cdm.deinitializeDecoderRequest();
-    request.setDecoderType(decoder_type);
-    request.send().wait(m_io.waitScope);
+    if (decoder_type == cdm::kStreamTypeVideo) {
+      m_decoding.store(false, std::memory_order_relaxed);
+    }
+    send(CDM_PROXY_DEINITIALIZE_DECODER, [&]() {
+      auto request = m_cdm.deinitializeDecoderRequest();
+      request.setDecoderType(decoder_type);
+      return request;
+    });
     KJ_DLOG(INFO, "exiting DeinitializeDecoder");
   }
 
   void ResetDecoder(cdm::StreamType decoder_type) override {
     KJ_DLOG(INFO, "ResetDecoder", decoder_type);
-    auto request = m_cdm.resetDecoderRequest();
-    request.setDecoderType(decoder_type);
-    request.send().wait(m_io.waitScope);
+    send(CDM_PROXY_RESET_DECODER, [&]() {
+      auto request = m_cdm.resetDecoderRequest();
+      request.setDecoderType(decoder_type);
+      return request;
+    });
     KJ_DLOG(INFO, "exiting ResetDecoder");
   }
 
   cdm::Status DecryptAndDecodeFrame(const cdm::InputBuffer_2& encrypted_buffer, cdm::VideoFrame* video_frame) override {
-    KJ_DLOG(INFO, "DecryptAndDecodeFrame");
+    return decryptAndDecodeFrame(0, encrypted_buffer, video_frame);
+  }
+
+  // DecryptAndDecodeFrame, with the sample data in `region` if that isn't 0
+  cdm::Status decryptAndDecodeFrame(uint32_t region, const cdm::InputBuffer_2& encrypted_buffer, cdm::VideoFrame* video_frame) {
+    KJ_DLOG(INFO, "DecryptAndDecodeFrame", region);
     KJ_ASSERT(video_frame->FrameBuffer() == nullptr);
+    CallCounters::Scope counting(m_counters.get(), CDM_PROXY_DECRYPT_AND_DECODE_FRAME);
 
-    auto request = m_cdm.decryptAndDecodeFrameRequest();
+    auto allocator = m_allocator.lockExclusive();
 
-    uint32_t offset = write_input_buffer(encrypted_buffer, m_allocator);
-    request.setEncryptedBufferOffset(offset);
+    // with the allocator locked, see decrypt()
+    if (m_suspect.load(std::memory_order_acquire)) {
+      KJ_DLOG(INFO, "exiting DecryptAndDecodeFrame, the worker isn't answering");
+      return cdm::kDecodeError;
+    }
 
-    auto response = request.send().wait(m_io.waitScope);
-    auto status   = static_cast<cdm::Status>(response.getStatus());
+    m_arena_control->lock();
+    KJ_DEFER(m_arena_control->unlock());
 
-    m_allocator.forget();
+    DecodedFrame source;
+    auto status = decodeFrame(*allocator, region, encrypted_buffer, source);
 
     if (status == cdm::kSuccess) {
 
-      auto source = response.getVideoFrame();
+      video_frame->SetFormat(source.format);
+      video_frame->SetSize(source.size);
 
-      video_frame->SetFormat(static_cast<cdm::VideoFormat>(source.getFormat()));
-      video_frame->SetSize(cdm::Size { .width = source.getSize().getWidth(), .height = source.getSize().getHeight() });
+      auto source_data = reinterpret_cast<uint8_t*>(m_decrypted_buffers) + source.offset;
 
-      auto framebuffer = m_host->Allocate(source.getFrameBuffer().getSize());
-      framebuffer->SetSize(source.getFrameBuffer().getSize());
-      memcpy(framebuffer->Data(), reinterpret_cast<uint8_t*>(m_decrypted_buffers) + source.getFrameBuffer().getOffset(), source.getFrameBuffer().getSize());
-      video_frame->SetFrameBuffer(framebuffer);
+      if (!COMPACT_VIDEO_FRAMES || !copy_compacted_frame(source_data, source, m_host, video_frame)) {
 
-      video_frame->SetPlaneOffset(cdm::kYPlane, source.getKYPlaneOffset());
-      video_frame->SetPlaneOffset(cdm::kUPlane, source.getKUPlaneOffset());
-      video_frame->SetPlaneOffset(cdm::kVPlane, source.getKVPlaneOffset());
+        auto framebuffer = m_host->Allocate(source.buffer_size);
+        framebuffer->SetSize(source.buffer_size);
+        memcpy(framebuffer->Data(), source_data, source.buffer_size);
+        video_frame->SetFrameBuffer(framebuffer);
 
-      video_frame->SetStride(cdm::kYPlane, source.getKYPlaneStride());
-      video_frame->SetStride(cdm::kUPlane, source.getKUPlaneStride());
-      video_frame->SetStride(cdm::kVPlane, source.getKVPlaneStride());
+        video_frame->SetPlaneOffset(cdm::kYPlane, source.plane_offsets[0]);
+        video_frame->SetPlaneOffset(cdm::kUPlane, source.plane_offsets[1]);
+        video_frame->SetPlaneOffset(cdm::kVPlane, source.plane_offsets[2]);
 
-      video_frame->SetTimestamp(source.getTimestamp());
+        video_frame->SetStride(cdm::kYPlane, source.strides[0]);
+        video_frame->SetStride(cdm::kUPlane, source.strides[1]);
+        video_frame->SetStride(cdm::kVPlane, source.strides[2]);
+      }
+
+      video_frame->SetTimestamp(source.timestamp);
     }
 
     KJ_DLOG(INFO, "exiting DecryptAndDecodeFrame", status);
     return status;
   }
 
+  // Like DecryptAndDecodeFrame, but leaves the frame in the decrypted arena for the host to read from its own
+  // mapping, held there until releaseFrame()
+  kj::Maybe<uint32_t> findFreeSlot() {
+    for (uint32_t i = 0; i < EXPORTED_FRAMES; i++) {
+      if (m_arena_control->held[i].size.load(std::memory_order_acquire) == 0) {
+        return i;
+      }
+    }
+    return nullptr;
+  }
+
+  cdm::Status exportFrame(uint32_t region, const cdm::InputBuffer_2& encrypted_buffer, FcdmFrame* frame) {
+    KJ_DLOG(INFO, "exportFrame", region);
+    CallCounters::Scope counting(m_counters.get(), CDM_PROXY_DECRYPT_AND_DECODE_FRAME);
+
+    static const int64_t wait_ns = getenv_int("FCDM_EXPORT_WAIT_MS", EXPORT_WAIT_MS) * 1000000;
+
+    // with all of them held, give the host's renderer a moment to let go of one. Without the allocator, so that
+    // Decrypt calls from other host threads go on meanwhile.
+    auto deadline = monotonic_ns() + wait_ns;
+    while (findFreeSlot() == nullptr && monotonic_ns() < deadline) {
+      sched_yield();
+    }
+
+    // slots are only taken with the allocator locked, the host may release them any time
+    auto allocator = m_allocator.lockExclusive();
+
+    // with the allocator locked, see decrypt()
+    if (m_suspect.load(std::memory_order_acquire)) {
+      KJ_DLOG(INFO, "exiting exportFrame, the worker isn't answering");
+      return cdm::kDecodeError;
+    }
+
+    // another export may have taken the one we waited for
+    uint32_t slot;
+    KJ_IF_MAYBE(i, findFreeSlot()) {
+      slot = *i;
+    } else {
+      KJ_DLOG(INFO, "exiting exportFrame, all frames are held");
+      m_arena_control->overflows.fetch_add(1, std::memory_order_relaxed);
+      return cdm::kDecodeError;
+    }
+
+    m_arena_control->lock();
+    KJ_DEFER(m_arena_control->unlock());
+
+    DecodedFrame source;
+    auto status = decodeFrame(*allocator, region, encrypted_buffer, source);
+
+    if (status == cdm::kSuccess) {
+
+      auto& held = m_arena_control->held[slot];
+      held.offset.store(source.offset, std::memory_order_relaxed);
+      held.size.store(kj::max(source.buffer_size, 1u), std::memory_order_release);
+
+      frame->slot      = slot;
+      frame->format    = source.format;
+      frame->width     = source.size.width;
+      frame->height    = source.size.height;
+      frame->offset    = source.offset;
+      frame->size      = source.buffer_size;
+      frame->timestamp = source.timestamp;
+      for (int i = 0; i < 3; i++) {
+        frame->plane_offsets[i] = source.plane_offsets[i];
+        frame->strides[i]       = source.strides[i];
+      }
+    }
+
+    KJ_DLOG(INFO, "exiting exportFrame", status);
+    return status;
+  }
+
+  void releaseFrame(uint32_t slot) {
+    KJ_REQUIRE(slot < EXPORTED_FRAMES, slot);
+    m_arena_control->held[slot].size.store(0, std::memory_order_release);
+  }
+
+  // The decrypted arena's place in the memfd returned
+  int getFrameArena(uint64_t* offset, uint64_t* size) {
+    long page_size;
+    KJ_SYSCALL(page_size = sysconf(_SC_PAGESIZE));
+    *offset = SHMEM_ARENA_SIZE + page_size;
+    *size   = SHMEM_ARENA_MAX_SIZE;
+    return m_memfd.get();
+  }
+
+  bool getWorkerUsage(FcdmWorkerUsage& target) {
+    if (m_cgroup.get() == nullptr) {
+      return false;
+    }
+    m_cgroup->getUsage(target);
+    return true;
+  }
+
+  // Returns false if counters are off or the worker didn't answer
+  bool getCallCounters(uint16_t method, FcdmCallCounters& target) {
+    KJ_DLOG(INFO, "getCallCounters", method);
+    static_assert(FCDM_COUNTER_COUNT == COUNTER_COUNT, "counters out of sync with fcdm.h");
+
+    if (m_counters.get() == nullptr) {
+      return false;
+    }
+
+    memset(&target, 0, sizeof(target));
+    CounterValues sums;
+    m_counters->get(method, target.calls, sums);
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+      target.shim[i] = sums.values[i];
+    }
+
+    uint32_t worker_available = 0;
+    bool answered = tryRun([&](kj::AsyncIoContext&) {
+      return m_cdm.getCountersRequest().send().then([&](capnp::Response<CdmProxy::GetCountersResults>&& response) {
+        worker_available = response.getAvailable();
+        for (auto counters: response.getCounters()) {
+          if (counters.getMethod() != method) {
+            continue;
+          }
+          target.worker_calls = counters.getCalls();
+          for (uint32_t i = 0; i < COUNTER_COUNT && i < counters.getValues().size(); i++) {
+            target.worker[i] = counters.getValues()[i];
+          }
+        }
+      });
+    });
+    target.available = CallCounters::available() & worker_available;
+
+    KJ_DLOG(INFO, "exiting getCallCounters", answered);
+    return answered;
+  }
+
+  void getArenaStats(FcdmArenaStats& target) {
+    target.grown     = m_arena_control->grown.load(std::memory_order_relaxed);
+    target.overflows = m_arena_control->overflows.load(std::memory_order_relaxed);
+  }
+
+  // Maps the memfd `fd` and has the worker map it too. Returns the id samples in it are submitted with, 0 if it
+  // can't be registered. `fd` stays the caller's.
+  uint32_t registerRegion(int fd) {
+    KJ_DLOG(INFO, "registerRegion", fd);
+
+    kj::Own<MappedRegion> mapping;
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { mapping = kj::heap<MappedRegion>(fd); })) {
+      KJ_LOG(ERROR, "unable to map region", fd, *exception);
+      return 0;
+    }
+
+    int copy;
+    KJ_SYSCALL(copy = fcntl(fd, F_DUPFD_CLOEXEC, 0));
+
+    uint32_t id = 0;
+    tryRun([&](kj::AsyncIoContext& io) {
+      auto request = m_cdm.registerRegionRequest();
+      request.setRegion(kj::heap<HostRegionImpl>(kj::AutoCloseFd(copy)));
+      return withDeadline(io, CDM_PROXY_REGISTER_REGION, request.send().then([&](capnp::Response<CdmProxy::RegisterRegionResults>&& response) {
+        id = response.getId();
+      }));
+    });
+
+    if (id != 0) {
+      m_regions.lockExclusive()->insert(id, kj::mv(mapping));
+    }
+
+    KJ_DLOG(INFO, "exiting registerRegion", id);
+    return id;
+  }
+
+  void unregisterRegion(uint32_t region) {
+    KJ_DLOG(INFO, "unregisterRegion", region);
+    // waits for the calls reading from it, later ones fail here instead of reaching the worker
+    if (m_regions.lockExclusive()->erase(region)) {
+      send(CDM_PROXY_UNREGISTER_REGION, [&]() {
+        auto request = m_cdm.unregisterRegionRequest();
+        request.setId(region);
+        return request;
+      });
+    }
+    KJ_DLOG(INFO, "exiting unregisterRegion");
+  }
+
   cdm::Status DecryptAndDecodeSamples(const cdm::InputBuffer_2& encrypted_buffer, cdm::AudioFrames* audio_frames) override {
     KJ_UNIMPLEMENTED("DecryptAndDecodeSamples");
   }
@@ -247,11 +1983,15 @@ public:
 
   void OnQueryOutputProtectionStatus(cdm::QueryResult result, uint32_t link_mask, uint32_t output_protection_mask) override {
     KJ_DLOG(INFO, "OnQueryOutputProtectionStatus", result, link_mask, output_protection_mask);
-    auto request = m_cdm.onQueryOutputProtectionStatusRequest();
-    request.setResult(result);
-    request.setLinkMask(link_mask);
-    request.setOutputProtectionMask(output_protection_mask);
-    request.send().wait(m_io.waitScope);
+    // the outputs may have changed under earlier answers
+    m_key_statuses->forgetPolicies();
+    send(CDM_PROXY_ON_QUERY_OUTPUT_PROTECTION_STATUS, [&]() {
+      auto request = m_cdm.onQueryOutputProtectionStatusRequest();
+      request.setResult(result);
+      request.setLinkMask(link_mask);
+      request.setOutputProtectionMask(output_protection_mask);
+      return request;
+    });
     KJ_DLOG(INFO, "exiting OnQueryOutputProtectionStatus");
   }
 
@@ -261,88 +2001,208 @@ public:
 
   void Destroy() override {
     KJ_DLOG(INFO, "Destroy");
-    //TODO: we can't just use `delete this` because m_cdm.~Client() apparently gives us
-    // "Fatal uncaught kj::Exception: kj/io.c++:331: failed: close: Bad file descriptor"
-    KJ_SYSCALL(munmap(m_decrypted_buffers, SHMEM_ARENA_SIZE));
-    m_client.~Own();
-    m_stream.~Own();
+    // the shards go first, they hand out our host's buffers
+    for (auto& shard: m_shards) {
+      shard.cdm->Destroy();
+    }
+    m_shards.clear();
+    m_mailbox->stop();
+    // Nothing may touch us on the I/O thread once we're gone. Closing the connection tells the worker to destroy
+    // its instance, and a worker of our own to exit.
+    run([this](kj::AsyncIoContext&) -> kj::Promise<void> {
+      m_canceler.cancel("CDM instance destroyed");
+      m_cdm    = nullptr;
+      m_client = nullptr;
+      m_stream = nullptr;
+      return kj::READY_NOW;
+    });
+    if (m_worker_pid != 0) {
+      Reaper::get().add(m_worker_pid, kj::mv(m_cgroup));
+    }
+    Budget::get().release(instance_shmem_size());
+    delete this;
+  }
+
+  Mailbox& getMailbox() {
+    return *m_mailbox;
+  }
+
+  const FcdmStartupTimes& getStartupTimes() {
+    return m_startup;
+  }
+
+  void setStartupTimes(const FcdmStartupTimes& startup) {
+    m_startup = startup;
+  }
+
+  void setKeySystem(int cdm_interface_version, kj::String key_system) {
+    m_cdm_interface_version = cdm_interface_version;
+    m_key_system            = kj::mv(key_system);
   }
 
-  CdmWrapper(kj::AsyncIoContext& io, kj::Own<kj::AsyncCapabilityStream> stream, kj::Own<capnp::TwoPartyClient> client,
-    CdmProxy::Client cdm, cdm::Host_10* host, XAlloc allocator, void* decrypted_buffers) :
-      m_io(io), m_stream(kj::mv(stream)), m_client(kj::mv(client)),
-        m_cdm(kj::mv(cdm)), m_host(host), m_allocator(kj::mv(allocator)), m_decrypted_buffers(decrypted_buffers) {}
+  // `shards` counts us in, see FcdmEnableDecryptShards()
+  void enableShards(uint32_t shards) {
+    auto group = m_group.lockExclusive();
+    if (m_sharded.load(std::memory_order_relaxed)) {
+      KJ_LOG(WARNING, "decrypt shards already started", shards);
+      return;
+    }
+    m_shards_wanted.store(shards > 1 ? shards - 1 : 0, std::memory_order_relaxed);
+  }
+
+  // the connection to our worker, for the shards to read our files through. I/O thread.
+  CdmProxy::Client getProxy() {
+    return m_cdm;
+  }
+
+  KeyStatusCache& getKeyStatuses() {
+    return *m_key_statuses;
+  }
+
+  CdmWrapper(kj::Own<kj::AsyncCapabilityStream> stream, kj::Own<capnp::TwoPartyClient> client, CdmProxy::Client cdm,
+    kj::Own<CaptureLog> capture, cdm::Host_10* host, kj::AutoCloseFd memfd, XAlloc allocator, void* decrypted_buffers, ArenaControl* arena_control,
+    kj::Own<Mailbox> mailbox, kj::Own<KeyStatusCache> key_statuses, pid_t worker_pid, kj::Own<WorkerCgroup> cgroup) :
+      m_stream(kj::mv(stream)), m_client(kj::mv(client)), m_cdm(kj::mv(cdm)), m_capture(kj::mv(capture)),
+        m_host(host), m_memfd(kj::mv(memfd)), m_allocator(kj::mv(allocator)), m_decrypted_buffers(decrypted_buffers), m_arena_control(arena_control),
+          m_mailbox(kj::mv(mailbox)), m_key_statuses(kj::mv(key_statuses)), m_worker_pid(worker_pid), m_suspect(false),
+            m_cgroup(kj::mv(cgroup)) {}
 
   ~CdmWrapper() noexcept {
-    //KJ_SYSCALL(munmap(m_decrypted_buffers, SHMEM_ARENA_SIZE));
+    KJ_SYSCALL(munmap(m_decrypted_buffers, SHMEM_ARENA_MAX_SIZE));
+    unmap_arena_control(m_arena_control);
   }
 };
 
+// Runs on the I/O thread. Callbacks are copied out of the request and left in the instance's Mailbox, to be
+// delivered on the host thread that calls into the instance next or is waiting on it now.
 class HostProxyImpl final: public HostProxy::Server {
 
-  cdm::Host_10* m_host;
+  cdm::Host_10*   m_host;
+  CaptureLog*     m_capture;
+  Mailbox&        m_mailbox;
+  KeyStatusCache& m_key_statuses;
+  uint64_t        m_arena_growth = 0; // charged to the Budget on top of instance_shmem_size()
+
+  kj::Maybe<CdmProxy::Client> m_storage; // for a shard, the instance it shards for
+
+  template <typename Params>
+  void capture(uint16_t method, Params params) {
+    auto record = capture_call(m_capture, CaptureRecord::Interface::HOST_PROXY, method, params);
+    finish_capture(record);
+  }
 
 public:
 
   kj::Promise<void> setTimer(SetTimerContext context) override {
     KJ_DLOG(INFO, "setTimer");
+    capture(HOST_PROXY_SET_TIMER, context.getParams());
     auto delay_ms = context.getParams().getDelayMs();
     auto context_ = reinterpret_cast<void*>(context.getParams().getContext());
-    m_host->SetTimer(delay_ms, context_);
+    m_mailbox.post([host = m_host, delay_ms, context_]() {
+      host->SetTimer(delay_ms, context_);
+    });
     KJ_DLOG(INFO, "exiting setTimer");
     return kj::READY_NOW;
   }
 
   kj::Promise<void> onInitialized(OnInitializedContext context) override {
     KJ_DLOG(INFO, "onInitialized");
+    capture(HOST_PROXY_ON_INITIALIZED, context.getParams());
     auto success = context.getParams().getSuccess();
-    m_host->OnInitialized(success);
+    m_mailbox.post([host = m_host, success]() {
+      host->OnInitialized(success);
+    });
     KJ_DLOG(INFO, "exiting onInitialized");
     return kj::READY_NOW;
   }
 
   kj::Promise<void> onResolveNewSessionPromise(OnResolveNewSessionPromiseContext context) override {
     KJ_DLOG(INFO, "onResolveNewSessionPromise");
+    capture(HOST_PROXY_ON_RESOLVE_NEW_SESSION_PROMISE, context.getParams());
     auto promise_id = context.getParams().getPromiseId();
-    auto session_id = context.getParams().getSessionId();
-    m_host->OnResolveNewSessionPromise(promise_id, session_id.begin(), session_id.size());
+    auto session_id = kj::str(context.getParams().getSessionId());
+    m_mailbox.post([host = m_host, promise_id, session_id = kj::mv(session_id)]() {
+      host->OnResolveNewSessionPromise(promise_id, session_id.begin(), session_id.size());
+    });
     KJ_DLOG(INFO, "exiting onResolveNewSessionPromise");
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> onResolveKeyStatusPromise(OnResolveKeyStatusPromiseContext context) override {
+    KJ_DLOG(INFO, "onResolveKeyStatusPromise");
+    capture(HOST_PROXY_ON_RESOLVE_KEY_STATUS_PROMISE, context.getParams());
+    auto promise_id = context.getParams().getPromiseId();
+    auto key_status = static_cast<cdm::KeyStatus>(context.getParams().getKeyStatus());
+    m_key_statuses.resolvePolicy(promise_id, key_status);
+    m_mailbox.post([host = m_host, promise_id, key_status]() {
+      host->OnResolveKeyStatusPromise(promise_id, key_status);
+    });
+    KJ_DLOG(INFO, "exiting onResolveKeyStatusPromise");
+    return kj::READY_NOW;
+  }
+
   kj::Promise<void> onResolvePromise(OnResolvePromiseContext context) override {
     KJ_DLOG(INFO, "onResolvePromise");
+    capture(HOST_PROXY_ON_RESOLVE_PROMISE, context.getParams());
     auto promise_id = context.getParams().getPromiseId();
-    m_host->OnResolvePromise(promise_id);
+    m_mailbox.post([host = m_host, promise_id]() {
+      host->OnResolvePromise(promise_id);
+    });
     KJ_DLOG(INFO, "exiting onResolvePromise");
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> onRejectPromise(OnRejectPromiseContext context) override {
+    KJ_DLOG(INFO, "onRejectPromise");
+    capture(HOST_PROXY_ON_REJECT_PROMISE, context.getParams());
+    auto promise_id    = context.getParams().getPromiseId();
+    auto exception     = context.getParams().getException();
+    auto system_code   = context.getParams().getSystemCode();
+    auto error_message = kj::str(context.getParams().getErrorMessage());
+    m_key_statuses.rejectPolicy(promise_id);
+    m_mailbox.post([host = m_host, promise_id, exception, system_code, error_message = kj::mv(error_message)]() {
+      host->OnRejectPromise(promise_id, static_cast<cdm::Exception>(exception), system_code, error_message.begin(), error_message.size());
+    });
+    KJ_DLOG(INFO, "exiting onRejectPromise");
+    return kj::READY_NOW;
+  }
+
   kj::Promise<void> onSessionMessage(OnSessionMessageContext context) override {
     KJ_DLOG(INFO, "onSessionMessage");
-    auto session_id   = context.getParams().getSessionId();
+    capture(HOST_PROXY_ON_SESSION_MESSAGE, context.getParams());
+    auto session_id   = kj::str(context.getParams().getSessionId());
     auto message_type = context.getParams().getMessageType();
-    auto message      = context.getParams().getMessage();
-    m_host->OnSessionMessage(session_id.begin(), session_id.size(), static_cast<cdm::MessageType>(message_type), message.begin(), message.size());
+    auto message      = kj::str(context.getParams().getMessage());
+    m_mailbox.post([host = m_host, session_id = kj::mv(session_id), message_type, message = kj::mv(message)]() {
+      host->OnSessionMessage(session_id.begin(), session_id.size(), static_cast<cdm::MessageType>(message_type), message.begin(), message.size());
+    });
     KJ_DLOG(INFO, "exiting onSessionMessage");
     return kj::READY_NOW;
   }
 
   kj::Promise<void> onSessionKeysChange(OnSessionKeysChangeContext context) override {
     KJ_DLOG(INFO, "onSessionKeysChange");
+    capture(HOST_PROXY_ON_SESSION_KEYS_CHANGE, context.getParams());
 
-    auto session_id                = context.getParams().getSessionId();
+    auto session_id                = kj::str(context.getParams().getSessionId());
     auto has_additional_usable_key = context.getParams().getHasAdditionalUsableKey();
 
+    auto key_ids   = kj::heapArrayBuilder<kj::Array<uint8_t>>(context.getParams().getKeysInfo().size());
     auto keys_info = kj::heapArray<cdm::KeyInformation>(context.getParams().getKeysInfo().size());
     for (uint32_t i = 0; i < keys_info.size(); i++) {
-      keys_info[i].key_id      = context.getParams().getKeysInfo()[i].getKeyId().begin();
-      keys_info[i].key_id_size = context.getParams().getKeysInfo()[i].getKeyId().size();
+      key_ids.add(kj::heapArray(context.getParams().getKeysInfo()[i].getKeyId()));
+      keys_info[i].key_id      = key_ids[i].begin();
+      keys_info[i].key_id_size = key_ids[i].size();
       keys_info[i].status      = static_cast<cdm::KeyStatus>(context.getParams().getKeysInfo()[i].getStatus());
       keys_info[i].system_code = context.getParams().getKeysInfo()[i].getSystemCode();
     }
 
-    m_host->OnSessionKeysChange(session_id.begin(), session_id.size(), has_additional_usable_key, keys_info.begin(), keys_info.size());
+    m_key_statuses.updateSession(session_id, keys_info);
+
+    m_mailbox.post([host = m_host, session_id = kj::mv(session_id), has_additional_usable_key,
+                    key_ids = key_ids.finish(), keys_info = kj::mv(keys_info)]() {
+      host->OnSessionKeysChange(session_id.begin(), session_id.size(), has_additional_usable_key, keys_info.begin(), keys_info.size());
+    });
 
     KJ_DLOG(INFO, "exiting onSessionKeysChange");
     return kj::READY_NOW;
@@ -350,39 +2210,86 @@ public:
 
   kj::Promise<void> onExpirationChange(OnExpirationChangeContext context) override {
     KJ_DLOG(INFO, "onExpirationChange");
-    auto session_id      = context.getParams().getSessionId();
+    capture(HOST_PROXY_ON_EXPIRATION_CHANGE, context.getParams());
+    auto session_id      = kj::str(context.getParams().getSessionId());
     auto new_expiry_time = context.getParams().getNewExpiryTime();
-    m_host->OnExpirationChange(session_id.begin(), session_id.size(), new_expiry_time);
+    m_mailbox.post([host = m_host, session_id = kj::mv(session_id), new_expiry_time]() {
+      host->OnExpirationChange(session_id.begin(), session_id.size(), new_expiry_time);
+    });
     KJ_DLOG(INFO, "exiting onExpirationChange");
     return kj::READY_NOW;
   }
 
   kj::Promise<void> onSessionClosed(OnSessionClosedContext context) override {
     KJ_DLOG(INFO, "onSessionClosed");
-    auto session_id = context.getParams().getSessionId();
-    m_host->OnSessionClosed(session_id.begin(), session_id.size());
+    capture(HOST_PROXY_ON_SESSION_CLOSED, context.getParams());
+    auto session_id = kj::str(context.getParams().getSessionId());
+    m_key_statuses.closeSession(session_id);
+    m_mailbox.post([host = m_host, session_id = kj::mv(session_id)]() {
+      host->OnSessionClosed(session_id.begin(), session_id.size());
+    });
     KJ_DLOG(INFO, "exiting onSessionClosed");
     return kj::READY_NOW;
   }
 
   kj::Promise<void> queryOutputProtectionStatus(QueryOutputProtectionStatusContext context) override {
     KJ_DLOG(INFO, "queryOutputProtectionStatus");
-    m_host->QueryOutputProtectionStatus();
+    capture(HOST_PROXY_QUERY_OUTPUT_PROTECTION_STATUS, context.getParams());
+    m_mailbox.post([host = m_host]() {
+      host->QueryOutputProtectionStatus();
+    });
     KJ_DLOG(INFO, "exiting queryOutputProtectionStatus");
     return kj::READY_NOW;
   }
 
-  HostProxyImpl(cdm::Host_10* host) : m_host(host) {}
+  // The worker asks before it grows the decrypted arena, and tells us when it shrinks it back
+  kj::Promise<void> resizeArena(ResizeArenaContext context) override {
+    KJ_DLOG(INFO, "resizeArena");
+    auto bytes   = context.getParams().getBytes();
+    bool granted = true;
+    if (bytes > 0) {
+      granted = Budget::get().reserve(bytes);
+      if (granted) {
+        m_arena_growth += bytes;
+      }
+    } else {
+      auto returned = kj::min(static_cast<uint64_t>(-bytes), m_arena_growth);
+      Budget::get().unreserve(returned);
+      m_arena_growth -= returned;
+    }
+    context.getResults().setGranted(granted);
+    KJ_DLOG(INFO, "exiting resizeArena", granted);
+    return kj::READY_NOW;
+  }
+
+  // A shard's files are the ones of the instance it shards for, read from that one's worker
+  kj::Promise<void> readFile(ReadFileContext context) override {
+    KJ_DLOG(INFO, "readFile");
+    KJ_IF_MAYBE(storage, m_storage) {
+      auto request = storage->readFileRequest();
+      request.setName(context.getParams().getName());
+      return context.tailCall(kj::mv(request));
+    }
+    context.getResults().setSuccess(false);
+    KJ_DLOG(INFO, "exiting readFile, not a shard");
+    return kj::READY_NOW;
+  }
+
+  HostProxyImpl(cdm::Host_10* host, CaptureLog* capture, Mailbox& mailbox, KeyStatusCache& key_statuses, kj::Maybe<CdmProxy::Client> storage) :
+    m_host(host), m_capture(capture), m_mailbox(mailbox), m_key_statuses(key_statuses), m_storage(kj::mv(storage)) {}
+
+  // dropped along with the connection, the worker's arenas go with it
+  ~HostProxyImpl() {
+    Budget::get().unreserve(m_arena_growth);
+  }
 };
 
 __attribute__((constructor))
 static void init() {
   kj::TopLevelProcessContext context("");
-  context.increaseLoggingVerbosity();
+  setup_logging();
 }
 
-static thread_local kj::AsyncIoContext io = kj::setupAsyncIo();
-
 CDM_API void INITIALIZE_CDM_MODULE() {
   // do nothing
 }
@@ -391,8 +2298,64 @@ CDM_API void DeinitializeCdmModule() {
   // do nothing
 }
 
-static bool spawn_worker(int sockets[2]) {
+static bool connect_daemon(const char* path, int& fd) {
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    KJ_LOG(FATAL, "FCDM_DAEMON_SOCKET is too long", path);
+    return false;
+  }
+  strcpy(address.sun_path, path);
+
+  // The daemon keeps the files of the CDM under our uid and this scope, it gives us no storage without one
+  const char* scope = getenv("FCDM_STORAGE_SCOPE");
+  if (scope == nullptr) {
+    scope = "";
+  }
+  if (strlen(scope) > 255) {
+    KJ_LOG(FATAL, "FCDM_STORAGE_SCOPE is too long", scope);
+    return false;
+  }
+
+  KJ_SYSCALL(fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0) {
+    KJ_LOG(FATAL, "unable to connect to the daemon", path, strerror(errno));
+    KJ_SYSCALL(close(fd));
+    return false;
+  }
+
+  // the scope goes first, a length byte and the text, see Daemon::readScope() in the worker
+  uint8_t length = strlen(scope);
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    kj::ArrayPtr<const kj::byte> pieces[] = { kj::arrayPtr(&length, 1), kj::StringPtr(scope).asBytes() };
+    kj::FdOutputStream(fd).write(pieces);
+  })) {
+    KJ_LOG(FATAL, "unable to connect to the daemon", path, *exception);
+    KJ_SYSCALL(close(fd));
+    return false;
+  }
+
+  int flags;
+  KJ_SYSCALL(flags = fcntl(fd, F_GETFL));
+  KJ_SYSCALL(fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+
+  KJ_LOG(INFO, "connected to the daemon", path);
+  return true;
+}
+
+// Connects to the daemon if FCDM_DAEMON_SOCKET is set, spawns a worker of our own otherwise, which joins `cgroup`
+// if there is one. `fd` is our end of the connection, `pid` is 0 for the daemon.
+static bool spawn_worker(int& fd, pid_t& pid, const char* cgroup = nullptr) {
 
+  char* daemon_socket = getenv("FCDM_DAEMON_SOCKET");
+  if (daemon_socket != nullptr) {
+    pid = 0;
+    return connect_daemon(daemon_socket, fd);
+  }
+
+  int sockets[2];
   KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sockets));
   KJ_SYSCALL(fcntl(sockets[0], F_SETFD, FD_CLOEXEC));
 
@@ -410,12 +2373,13 @@ static bool spawn_worker(int sockets[2]) {
   const char* const args[] = {
     worker_path,
     socket_fd_str,
+    cgroup,
     nullptr
   };
 
   extern char** environ;
 
-  pid_t pid = 0;
+  pid = 0;
   int err = posix_spawnp(&pid, worker_path, nullptr, nullptr, (char* const*)args, environ);
   if (err == 0) {
     KJ_LOG(INFO, "started worker process", pid);
@@ -426,79 +2390,323 @@ static bool spawn_worker(int sockets[2]) {
     return false;
   }
 
+  // the worker has its copy
+  KJ_SYSCALL(close(sockets[1]));
+  fd = sockets[0];
   return true;
 }
 
-//TODO: is it safe to throw exceptions here?
-CDM_API void* CreateCdmInstance(int cdm_interface_version, const char* key_system, uint32_t key_system_size, GetCdmHostFunc get_cdm_host_func, void* user_data) {
-
-  KJ_DLOG(INFO, "CreateCdmInstance", cdm_interface_version, key_system, key_system_size, reinterpret_cast<void*>(get_cdm_host_func), user_data);
+// Starts a worker, or connects to the daemon, and creates an instance there. Returns nullptr if there is no room or
+// no worker. A shard of `primary` gets no storage of its own and reads that of `primary`.
+static CdmWrapper* create_instance(int cdm_interface_version, const char* key_system, uint32_t key_system_size, cdm::Host_10* host,
+  CdmWrapper* primary = nullptr) {
 
-  int sockets[2];
-  if (!spawn_worker(sockets)) {
+  if (!Budget::get().acquire(instance_shmem_size())) {
     return nullptr;
   }
+  KJ_ON_SCOPE_FAILURE(Budget::get().release(instance_shmem_size()));
 
-  //TODO: who is supposed to close sockets[0]?
-  KJ_SYSCALL(close(sockets[1]));
+  // daemon clients are served by its children, in its cgroup
+  auto cgroup = getenv("FCDM_DAEMON_SOCKET") == nullptr ? WorkerCgroup::create() : nullptr;
 
-  auto stream = io.lowLevelProvider->wrapUnixSocketFd(sockets[0]);
-  auto client = kj::heap<capnp::TwoPartyClient>(*stream, 1 /* maxFdsPerMessage */);
-  auto worker = client.get()->bootstrap().castAs<CdmWorker>();
+  FcdmStartupTimes startup;
+  memset(&startup, 0, sizeof(startup));
 
-  auto host = reinterpret_cast<cdm::Host_10*>(get_cdm_host_func(cdm_interface_version, user_data));
-  KJ_ASSERT(host != nullptr);
+  int   worker_fd;
+  pid_t worker_pid;
+  auto  spawn_start = monotonic_ns();
+  if (!spawn_worker(worker_fd, worker_pid, cgroup.get() != nullptr ? cgroup->getPath().cStr() : nullptr)) {
+    Budget::get().release(instance_shmem_size());
+    return nullptr;
+  }
+  startup.spawn_ns = monotonic_ns() - spawn_start;
 
-  auto request = worker.createCdmInstanceRequest();
-  request.setCdmInterfaceVersion(cdm_interface_version);
-  request.setKeySystem(kj::StringPtr(key_system, key_system_size));
-  request.setHostProxy(kj::heap<HostProxyImpl>(host));
+  // a worker that never became an instance still needs reaping once the connection is gone
+  KJ_ON_SCOPE_FAILURE({
+    if (worker_pid != 0) {
+      Reaper::get().add(worker_pid, kj::mv(cgroup));
+    }
+  });
 
-  auto response = request.send().wait(io.waitScope);
+  auto mailbox      = kj::heap<Mailbox>();
+  auto key_statuses = kj::heap<KeyStatusCache>();
+  auto capture = CaptureLog::open();
 
-  auto cdm = response.getCdmProxy();
+  if (getenv("FCDM_CALLBACK_THREAD") != nullptr) {
+    mailbox->startDeliveryThread();
+  }
 
-  int memfd = KJ_ASSERT_NONNULL(cdm.getFd().wait(io.waitScope));
-  KJ_DEFER(KJ_SYSCALL(close(memfd)));
+  kj::Own<kj::AsyncCapabilityStream> stream;
+  kj::Own<capnp::TwoPartyClient>     client;
+  CdmProxy::Client                   cdm = nullptr;
+  int                                memfd = -1;
+
+  // The connection belongs to the I/O thread, and is dropped there if anything fails before the instance takes it
+  // over. That also drops the HostProxyImpl, before the mailbox and the host it points to go.
+  auto drop_connection = [&]() {
+    cdm    = nullptr;
+    client = nullptr;
+    stream = nullptr;
+  };
+  KJ_ON_SCOPE_FAILURE({
+    mailbox->stop();
+    IoThread::get().run(*mailbox, [&](kj::AsyncIoContext&) -> kj::Promise<void> {
+      drop_connection();
+      return kj::READY_NOW;
+    });
+  });
+
+  auto create_start = monotonic_ns();
+  IoThread::get().run(*mailbox, [&](kj::AsyncIoContext& io) {
+    return kj::evalNow([&]() {
+      stream = io.lowLevelProvider->wrapUnixSocketFd(worker_fd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+      client = kj::heap<capnp::TwoPartyClient>(*stream, 1 /* maxFdsPerMessage */);
+      auto worker = client->bootstrap().castAs<CdmWorker>();
+
+      auto request = worker.createCdmInstanceRequest();
+      request.setCdmInterfaceVersion(cdm_interface_version);
+      request.setKeySystem(kj::StringPtr(key_system, key_system_size));
+      request.setShard(primary != nullptr);
+      kj::Maybe<CdmProxy::Client> storage;
+      if (primary != nullptr) {
+        storage = primary->getProxy();
+      }
+      request.setHostProxy(kj::heap<HostProxyImpl>(host, capture.get(), *mailbox, *key_statuses, kj::mv(storage)));
+
+      return request.send().then([&](capnp::Response<CdmWorker::CreateCdmInstanceResults>&& response) {
+        cdm = response.getCdmProxy();
+        startup.load_ns              = response.getStartup().getLoadNs();
+        startup.initialize_module_ns = response.getStartup().getInitializeModuleNs();
+        startup.create_instance_ns   = response.getStartup().getCreateInstanceNs();
+        return cdm.getFd();
+      }).then([&](kj::Maybe<int> fd) {
+        memfd = KJ_ASSERT_NONNULL(fd);
+      });
+    }).catch_([&](kj::Exception&& exception) {
+      drop_connection();
+      kj::throwFatalException(kj::mv(exception));
+    });
+  });
+
+  auto map_start = monotonic_ns();
+  auto worker_ns = startup.load_ns + startup.initialize_module_ns + startup.create_instance_ns;
+  startup.bootstrap_ns = kj::max(map_start - create_start - static_cast<int64_t>(worker_ns), int64_t(0));
+
+  // the fd that came with the capability is closed along with it
+  int fd;
+  KJ_SYSCALL(fd = fcntl(memfd, F_DUPFD_CLOEXEC, 0));
+  kj::AutoCloseFd shmem(fd);
+  memfd = fd;
+  KJ_REQUIRE(is_shrink_sealed(memfd), "the worker's memfd isn't sealed against shrinking");
 
   XAlloc allocator(memfd, SHMEM_ARENA_SIZE, 0);
 
   long page_size;
   KJ_SYSCALL(page_size = sysconf(_SC_PAGESIZE));
 
-  void* decrypted_buffers = mmap(nullptr, SHMEM_ARENA_SIZE, PROT_READ, MAP_SHARED, memfd, SHMEM_ARENA_SIZE + page_size);
+  // covers what the worker may grow the arena to
+  void* decrypted_buffers = mmap(nullptr, SHMEM_ARENA_MAX_SIZE, PROT_READ, MAP_SHARED, memfd, SHMEM_ARENA_SIZE + page_size);
   if (decrypted_buffers == MAP_FAILED) {
     KJ_FAIL_SYSCALL("mmap", errno);
   }
+  KJ_ON_SCOPE_FAILURE(munmap(decrypted_buffers, SHMEM_ARENA_MAX_SIZE));
+
+  auto arena_control = map_arena_control(memfd);
+
+  startup.map_ns = monotonic_ns() - map_start;
+
+  auto instance = new CdmWrapper(kj::mv(stream), kj::mv(client), kj::mv(cdm), kj::mv(capture), host, kj::mv(shmem), kj::mv(allocator),
+    decrypted_buffers, arena_control, kj::mv(mailbox), kj::mv(key_statuses), worker_pid, kj::mv(cgroup));
+  instance->setStartupTimes(startup);
+  instance->setKeySystem(cdm_interface_version, kj::heapString(key_system, key_system_size));
+  return instance;
+}
+
+// Creates the shards asked for with FcdmEnableDecryptShards(), and catches them up on Initialize and the persistent
+// sessions loaded so far. The first Decrypt of a decrypt-only instance waits for them.
+void CdmWrapper::startShards() {
+
+  auto group  = m_group.lockExclusive();
+  auto wanted = m_shards_wanted.exchange(0, std::memory_order_relaxed);
+  if (wanted == 0) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < wanted; i++) {
+    auto shard_host = kj::heap<ShardHost>(m_host);
+    auto shard      = create_instance(m_cdm_interface_version, m_key_system.cStr(), m_key_system.size(), shard_host.get(), this);
+    if (shard == nullptr) {
+      KJ_LOG(WARNING, "unable to create a decrypt shard, going on with fewer", i);
+      break;
+    }
+    if (group->initialized) {
+      shard->Initialize(group->allow_distinctive_identifier, group->allow_persistent_state, group->use_hw_secure_codecs);
+    }
+    for (auto& session: group->sessions) {
+      shard->LoadSession(shard_host->nextPromiseId(), cdm::kPersistentLicense, session.cStr(), session.size());
+    }
+    m_shards.add(Shard { shard, kj::mv(shard_host) });
+  }
+
+  KJ_LOG(INFO, "decrypt shards started", m_shards.size());
+  m_sharded.store(!m_shards.empty(), std::memory_order_release);
+}
+
+//TODO: is it safe to throw exceptions here?
+CDM_API void* CreateCdmInstance(int cdm_interface_version, const char* key_system, uint32_t key_system_size, GetCdmHostFunc get_cdm_host_func, void* user_data) {
+
+  KJ_DLOG(INFO, "CreateCdmInstance", cdm_interface_version, key_system, key_system_size, reinterpret_cast<void*>(get_cdm_host_func), user_data);
+
+  auto host = reinterpret_cast<cdm::Host_10*>(get_cdm_host_func(cdm_interface_version, user_data));
+  KJ_ASSERT(host != nullptr);
+
+  auto instance = create_instance(cdm_interface_version, key_system, key_system_size, host);
+  if (instance == nullptr) {
+    return nullptr;
+  }
+
+  return reinterpret_cast<void*>(static_cast<cdm::ContentDecryptionModule_10*>(instance));
+}
+
+CDM_API int FcdmGetCallbackFd(void* cdm_instance) {
+  KJ_DLOG(INFO, "FcdmGetCallbackFd", cdm_instance);
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  return cdm->getMailbox().getCallbackFd();
+}
+
+CDM_API void FcdmDispatchCallbacks(void* cdm_instance) {
+  KJ_DLOG(INFO, "FcdmDispatchCallbacks", cdm_instance);
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  cdm->getMailbox().dispatch();
+  KJ_DLOG(INFO, "exiting FcdmDispatchCallbacks");
+}
+
+CDM_API int FcdmGetFrameArena(void* cdm_instance, uint64_t* offset, uint64_t* size) {
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  return cdm->getFrameArena(offset, size);
+}
+
+CDM_API cdm::Status FcdmDecryptAndDecodeFrameExport(void* cdm_instance, uint32_t region, const cdm::InputBuffer_2* encrypted_buffer, FcdmFrame* frame) {
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  return cdm->exportFrame(region, *encrypted_buffer, frame);
+}
+
+CDM_API void FcdmReleaseFrame(void* cdm_instance, uint32_t slot) {
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  cdm->releaseFrame(slot);
+}
+
+CDM_API uint32_t FcdmRegisterRegion(void* cdm_instance, int fd) {
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  return cdm->registerRegion(fd);
+}
+
+CDM_API void FcdmUnregisterRegion(void* cdm_instance, uint32_t region) {
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  cdm->unregisterRegion(region);
+}
+
+CDM_API cdm::Status FcdmDecryptFromRegion(void* cdm_instance, uint32_t region, const cdm::InputBuffer_2* encrypted_buffer, cdm::DecryptedBlock* decrypted_buffer) {
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  return cdm->decrypt(region, *encrypted_buffer, decrypted_buffer);
+}
+
+CDM_API cdm::Status FcdmDecryptAndDecodeFrameFromRegion(void* cdm_instance, uint32_t region, const cdm::InputBuffer_2* encrypted_buffer, cdm::VideoFrame* video_frame) {
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  return cdm->decryptAndDecodeFrame(region, *encrypted_buffer, video_frame);
+}
+
+CDM_API bool FcdmGetCallCounters(void* cdm_instance, uint32_t method, FcdmCallCounters* counters) {
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  return cdm->getCallCounters(method, *counters);
+}
+
+CDM_API void FcdmGetStartupTimes(void* cdm_instance, FcdmStartupTimes* times) {
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  *times = cdm->getStartupTimes();
+}
+
+CDM_API void FcdmGetArenaStats(void* cdm_instance, FcdmArenaStats* stats) {
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  cdm->getArenaStats(*stats);
+}
+
+CDM_API bool FcdmGetWorkerUsage(void* cdm_instance, FcdmWorkerUsage* usage) {
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  return cdm->getWorkerUsage(*usage);
+}
+
+CDM_API bool FcdmGetKeyStatus(void* cdm_instance, const uint8_t* key_id, uint32_t key_id_size, cdm::KeyStatus* status) {
+  auto cdm   = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  auto found = cdm->getKeyStatuses().findKey(kj::arrayPtr(key_id, key_id_size));
+  KJ_IF_MAYBE(key_status, found) {
+    *status = *key_status;
+    return true;
+  }
+  return false;
+}
+
+CDM_API void FcdmEnableDecryptShards(void* cdm_instance, uint32_t shards) {
+  KJ_DLOG(INFO, "FcdmEnableDecryptShards", cdm_instance, shards);
+  auto cdm = static_cast<CdmWrapper*>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm_instance));
+  cdm->enableShards(shards);
+}
 
-  return reinterpret_cast<void*>(new CdmWrapper(io, kj::mv(stream), kj::mv(client), kj::mv(cdm), host, kj::mv(allocator), decrypted_buffers));
+CDM_API void FcdmGetUsage(FcdmUsage* usage) {
+  Budget::get().getUsage(*usage);
+  usage->unreaped = Reaper::get().pending();
 }
 
 CDM_API const char* GetCdmVersion() {
 
   KJ_DLOG(INFO, "GetCdmVersion");
 
-  static thread_local char* version = nullptr;
-  if (version == nullptr) {
+  // asked once per process, by whichever host thread comes first; a failed attempt is retried on the next call
+  static auto version = new kj::MutexGuarded<char*>(nullptr);
+  auto lock = version->lockExclusive();
+  if (*lock == nullptr) {
 
-    int sockets[2];
-    if (!spawn_worker(sockets)) {
+    if (!Budget::get().acquire(0)) {
       return nullptr;
     }
+    KJ_DEFER(Budget::get().release(0));
 
-    KJ_DEFER(KJ_SYSCALL(close(sockets[0])));
-    KJ_DEFER(KJ_SYSCALL(close(sockets[1])));
-
-    auto stream = io.lowLevelProvider->wrapUnixSocketFd(sockets[0]);
-    capnp::TwoPartyClient client(*stream, 1 /* maxFdsPerMessage */);
-
-    auto worker   = client.bootstrap().castAs<CdmWorker>();
-    auto request  = worker.getCdmVersionRequest();
-    auto response = request.send().wait(io.waitScope);
+    int   worker_fd;
+    pid_t worker_pid;
+    if (!spawn_worker(worker_fd, worker_pid)) {
+      return nullptr;
+    }
 
-    version = strdup(response.getVersion().cStr());
+    KJ_DEFER(if (worker_pid != 0) Reaper::get().add(worker_pid, nullptr));
+
+    // created and dropped on the I/O thread, before the call completes
+    kj::Own<kj::AsyncCapabilityStream> stream;
+    kj::Own<capnp::TwoPartyClient>     client;
+    auto drop_connection = [&]() {
+      client = nullptr; // runs on the stream
+      stream = nullptr;
+    };
+
+    Mailbox mailbox;
+    IoThread::get().run(mailbox, [&](kj::AsyncIoContext& io) {
+      return kj::evalNow([&]() {
+        stream = io.lowLevelProvider->wrapUnixSocketFd(worker_fd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+        client = kj::heap<capnp::TwoPartyClient>(*stream, 1 /* maxFdsPerMessage */);
+
+        auto worker  = client->bootstrap().castAs<CdmWorker>();
+        auto request = worker.getCdmVersionRequest();
+        return request.send().then([&](capnp::Response<CdmWorker::GetCdmVersionResults>&& response) {
+          *lock = strdup(response.getVersion().cStr());
+        });
+      }).then([&]() {
+        drop_connection();
+      }, [&](kj::Exception&& exception) {
+        drop_connection();
+        kj::throwFatalException(kj::mv(exception));
+      });
+    });
   }
-  KJ_LOG(INFO, version);
+  KJ_LOG(INFO, *lock);
 
-  return version;
+  return *lock;
 }
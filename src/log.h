@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <kj/debug.h>
+#include <kj/exception.h>
+#include <kj/map.h>
+#include <kj/mutex.h>
+#include <kj/string.h>
+#include <kj/thread.h>
+#include <kj/vector.h>
+#include "config.h"
+#include "util.h"
+
+// Logging shared by the shim and the worker, on top of kj's.
+//
+// FCDM_LOG_LEVEL sets what gets logged at run time: info, warning (the default), error or fatal. Messages below
+// it aren't even formatted. KJ_DLOG, which traces every call, is compiled in only with DEBUG_FLAGS=-DKJ_DEBUG
+// (see the Makefile); release builds leave it out altogether.
+//
+// On the threads that install a LogCallback, each log statement may write FCDM_LOG_RATE lines a second
+// (LOG_RATE, 0 for no limit). Lines are written to stderr by a thread of their own.
+
+inline void setup_logging() {
+
+  char* level = getenv("FCDM_LOG_LEVEL");
+  if (level == nullptr) {
+    return;
+  }
+
+  if (strcmp(level, "info") == 0) {
+    kj::_::Debug::setLogLevel(kj::LogSeverity::INFO);
+  } else if (strcmp(level, "warning") == 0) {
+    kj::_::Debug::setLogLevel(kj::LogSeverity::WARNING);
+  } else if (strcmp(level, "error") == 0) {
+    kj::_::Debug::setLogLevel(kj::LogSeverity::ERROR);
+  } else if (strcmp(level, "fatal") == 0) {
+    kj::_::Debug::setLogLevel(kj::LogSeverity::FATAL);
+  } else {
+    KJ_LOG(WARNING, "unknown FCDM_LOG_LEVEL", level);
+  }
+}
+
+// Collects log lines and writes them out on its own thread, so that a thread that logs doesn't wait for
+// whoever reads our stderr. Lines that don't fit into LOG_BUFFER_SIZE are dropped and counted.
+class LogWriter {
+
+  struct State {
+    kj::Vector<char> pending;
+    uint64_t         dropped = 0;
+  };
+
+  kj::MutexGuarded<State> m_state;
+  kj::Thread*             m_thread; // never destroyed either, see get()
+
+  static void writeAll(const char* data, size_t size) {
+    while (size > 0) {
+      ssize_t n = ::write(STDERR_FILENO, data, size);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // nowhere left to complain to
+        return;
+      }
+      data += n;
+      size -= n;
+    }
+  }
+
+  static void writeOut(State& state) {
+    writeAll(state.pending.begin(), state.pending.size());
+    state.pending.clear();
+    if (state.dropped > 0) {
+      auto line = kj::str("fcdm: dropped ", state.dropped, " log lines\n");
+      writeAll(line.begin(), line.size());
+      state.dropped = 0;
+    }
+  }
+
+  void loop() {
+    for (;;) {
+      State taken;
+      m_state.when([](const State& state) { return !state.pending.empty() || state.dropped > 0; }, [&](State& state) {
+        taken.pending = kj::mv(state.pending);
+        taken.dropped = state.dropped;
+        state.pending = kj::Vector<char>();
+        state.dropped = 0;
+      });
+      writeOut(taken);
+    }
+  }
+
+public:
+
+  void write(kj::StringPtr line) {
+    auto state = m_state.lockExclusive();
+    if (state->pending.size() + line.size() > LOG_BUFFER_SIZE) {
+      state->dropped++;
+      return;
+    }
+    state->pending.addAll(line);
+  }
+
+  // Writes out whatever is pending on the calling thread
+  void flush() {
+    writeOut(*m_state.lockExclusive());
+  }
+
+  // fork(), with the lines pending left to the parent. The lock is held across it, so that the child doesn't start
+  // out with it taken by a thread it doesn't have, and the child gets a writer thread of its own.
+  pid_t fork() {
+    pid_t pid;
+    {
+      auto state = m_state.lockExclusive();
+      pid = ::fork();
+      if (pid == 0) {
+        state->pending.clear();
+        state->dropped = 0;
+      }
+    }
+    if (pid == 0) {
+      m_thread = new kj::Thread([this]() { loop(); });
+    }
+    return pid;
+  }
+
+  static LogWriter& get() {
+    // never destroyed, threads may log while static destructors run
+    static LogWriter* writer = new LogWriter();
+    return *writer;
+  }
+
+  LogWriter() {
+    m_thread = new kj::Thread([this]() { loop(); });
+  }
+
+  KJ_DISALLOW_COPY(LogWriter);
+};
+
+// Counts the lines of each log statement, identified by file and line, over one second windows
+class LogLimiter {
+
+  struct Site {
+    int64_t  window_start;
+    uint32_t count;
+    uint64_t suppressed;
+  };
+
+  kj::MutexGuarded<kj::HashMap<uint64_t, Site>> m_sites;
+  int64_t                                       m_rate;
+
+public:
+
+  // Returns false if the line is over its statement's budget. Otherwise `suppressed` is set to the number of
+  // lines dropped since the last one that got through.
+  bool admit(const char* file, int line, uint64_t& suppressed) {
+
+    suppressed = 0;
+    if (m_rate <= 0) {
+      return true;
+    }
+
+    auto key = (static_cast<uint64_t>(reinterpret_cast<uintptr_t>(file)) << 16) ^ static_cast<uint64_t>(line);
+    auto now = monotonic_ns();
+
+    auto  sites = m_sites.lockExclusive();
+    auto& site  = sites->findOrCreate(key, [&]() {
+      return kj::HashMap<uint64_t, Site>::Entry { key, Site { now, 0, 0 } };
+    });
+
+    if (now - site.window_start >= 1000000000) {
+      site.window_start = now;
+      site.count        = 0;
+    }
+    if (site.count >= m_rate) {
+      site.suppressed++;
+      return false;
+    }
+
+    site.count++;
+    suppressed      = site.suppressed;
+    site.suppressed = 0;
+    return true;
+  }
+
+  static LogLimiter& get() {
+    static LogLimiter* limiter = new LogLimiter();
+    return *limiter;
+  }
+
+  LogLimiter() : m_rate(getenv_int("FCDM_LOG_RATE", LOG_RATE)) {}
+
+  KJ_DISALLOW_COPY(LogLimiter);
+};
+
+// Routes the log lines of the thread it is installed on, which must be one of ours: host threads calling into
+// the shim keep kj's default of writing to stderr right away. Fatal messages are written right away as well,
+// after what's pending, since the process is usually about to go.
+class LogCallback: public kj::ExceptionCallback {
+
+public:
+
+  void logMessage(kj::LogSeverity severity, const char* file, int line, int context_depth, kj::String&& text) override {
+
+    if (severity == kj::LogSeverity::FATAL) {
+      LogWriter::get().flush();
+      next.logMessage(severity, file, line, context_depth, kj::mv(text));
+      return;
+    }
+
+    uint64_t suppressed;
+    if (!LogLimiter::get().admit(file, line, suppressed)) {
+      return;
+    }
+
+    if (suppressed > 0) {
+      LogWriter::get().write(kj::str(kj::repeat('_', context_depth), file, ":", line, ": ", severity, ": ", text,
+        " (", suppressed, " similar lines dropped)\n"));
+    } else {
+      LogWriter::get().write(kj::str(kj::repeat('_', context_depth), file, ":", line, ": ", severity, ": ", text, '\n'));
+    }
+  }
+
+  LogCallback() {}
+
+  KJ_DISALLOW_COPY(LogCallback);
+};
@@ -0,0 +1,358 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <capnp/serialize-packed.h>
+#include <kj/main.h>
+#include <cdm/content_decryption_module.h>
+#include "cdm.capnp.h"
+#include "capture.h"
+#include "host.h"
+
+// Drives a worker through a shim from a log written in capture mode, either at the recorded pace or as fast
+// as possible, and reports per-method call times.
+//
+// usage: fcdm-replay <shim.so> <key system> <capture file> [--max-speed]
+
+#define REPLAY_TIMEOUT_MS 10000 // for the live CDM to resolve a session a later call uses
+
+struct ReplayInput {
+  cdm::InputBuffer_2             buffer;
+  kj::Array<cdm::SubsampleEntry> subsamples;
+};
+
+static void read_input_buffer(InputBuffer::Reader source, ReplayInput& target) {
+
+  target.subsamples = kj::heapArray<cdm::SubsampleEntry>(source.getSubsamples().size());
+  for (uint32_t i = 0; i < target.subsamples.size(); i++) {
+    target.subsamples[i].clear_bytes  = source.getSubsamples()[i].getClearBytes();
+    target.subsamples[i].cipher_bytes = source.getSubsamples()[i].getCipherBytes();
+  }
+
+  target.buffer.data                     = source.getData().begin();
+  target.buffer.data_size                = source.getData().size();
+  target.buffer.encryption_scheme        = static_cast<cdm::EncryptionScheme>(source.getEncryptionScheme());
+  target.buffer.key_id                   = source.getKeyId().begin();
+  target.buffer.key_id_size              = source.getKeyId().size();
+  target.buffer.iv                       = source.getIv().begin();
+  target.buffer.iv_size                  = source.getIv().size();
+  target.buffer.subsamples               = target.subsamples.begin();
+  target.buffer.num_subsamples           = target.subsamples.size();
+  target.buffer.pattern.crypt_byte_block = source.getPatternCryptByteBlock();
+  target.buffer.pattern.skip_byte_block  = source.getPatternSkipByteBlock();
+  target.buffer.timestamp                = source.getTimestamp();
+}
+
+struct MethodStats {
+  uint64_t calls          = 0;
+  int64_t  total_ns       = 0;
+  int64_t  max_ns         = 0;
+  int64_t  recorded_ns    = 0;
+  uint64_t status_changes = 0;
+};
+
+class Replay {
+
+  Shim&                               m_shim;
+  ToolHost                            m_host;
+  cdm::ContentDecryptionModule_10*    m_cdm;
+  bool                                m_max_speed;
+  kj::HashMap<kj::String, kj::String> m_session_ids;      // recorded -> live
+  kj::HashMap<kj::String, uint32_t>   m_pending_sessions; // recorded -> promise id, until the live CDM resolves it
+  MethodStats                         m_stats[kj::size(CDM_PROXY_METHOD_NAMES)];
+
+  void dispatchCallbacks() {
+    if (m_shim.dispatch_callbacks != nullptr) {
+      m_shim.dispatch_callbacks(m_cdm);
+    }
+  }
+
+  // Delivers callbacks as they come in until `done`. Other CDMs call the host before they return.
+  template <typename Done>
+  void waitFor(Done&& done, kj::StringPtr what) {
+
+    if (m_shim.get_callback_fd == nullptr) {
+      return;
+    }
+
+    struct pollfd fd;
+    fd.fd     = m_shim.get_callback_fd(m_cdm);
+    fd.events = POLLIN;
+
+    auto deadline = monotonic_ns() + REPLAY_TIMEOUT_MS * 1000000ll;
+    for (;;) {
+      dispatchCallbacks();
+      if (done()) {
+        return;
+      }
+      auto remaining_ms = (deadline - monotonic_ns()) / 1000000;
+      KJ_ASSERT(remaining_ms > 0, "timed out waiting", what);
+      if (poll(&fd, 1, remaining_ms) < 0 && errno != EINTR) {
+        KJ_FAIL_SYSCALL("poll", errno);
+      }
+    }
+  }
+
+  // The session id the live CDM handed out for `recorded`, which is passed as is if it didn't come from a session
+  // created in the capture. The live CDM may not have resolved its session yet, even when the capture has the
+  // resolve before the call that created it, so this waits for it.
+  kj::StringPtr liveSessionId(kj::StringPtr recorded) {
+
+    dispatchCallbacks();
+
+    KJ_IF_MAYBE(pending, m_pending_sessions.find(recorded)) {
+      auto promise_id = *pending;
+      auto rejected   = m_host.rejected;
+      waitFor([&]() { return m_host.new_sessions.find(promise_id) != nullptr || m_host.rejected > rejected; }, recorded);
+      KJ_IF_MAYBE(live, m_host.new_sessions.find(promise_id)) {
+        m_session_ids.upsert(kj::str(recorded), kj::str(*live));
+      }
+      m_pending_sessions.erase(recorded);
+    }
+
+    KJ_IF_MAYBE(live, m_session_ids.find(recorded)) {
+      return *live;
+    }
+    return recorded;
+  }
+
+  // returns the status of calls that have one, -1 otherwise
+  int64_t call(CaptureRecord::Reader record) {
+
+    auto params = record.getParams();
+
+    switch (record.getMethod()) {
+
+      case CDM_PROXY_INITIALIZE: {
+        auto p = params.getAs<CdmProxy::InitializeParams>();
+        m_cdm->Initialize(p.getAllowDistinctiveIdentifier(), p.getAllowPersistentState(), p.getUseHwSecureCodecs());
+        return -1;
+      }
+
+      case CDM_PROXY_GET_STATUS_FOR_POLICY: {
+        auto p = params.getAs<CdmProxy::GetStatusForPolicyParams>();
+        cdm::Policy policy;
+        policy.min_hdcp_version = static_cast<cdm::HdcpVersion>(p.getMinHdcpVersion());
+        m_cdm->GetStatusForPolicy(p.getPromiseId(), policy);
+        return -1;
+      }
+
+      case CDM_PROXY_SET_SERVER_CERTIFICATE: {
+        auto p = params.getAs<CdmProxy::SetServerCertificateParams>();
+        m_cdm->SetServerCertificate(p.getPromiseId(), p.getServerCertificateData().begin(), p.getServerCertificateData().size());
+        return -1;
+      }
+
+      case CDM_PROXY_CREATE_SESSION_AND_GENERATE_REQUEST: {
+        auto p = params.getAs<CdmProxy::CreateSessionAndGenerateRequestParams>();
+        // promise ids may be reused, the live session is the one this call resolves
+        m_host.new_sessions.erase(p.getPromiseId());
+        m_cdm->CreateSessionAndGenerateRequest(p.getPromiseId(), static_cast<cdm::SessionType>(p.getSessionType()),
+          static_cast<cdm::InitDataType>(p.getInitDataType()), p.getInitData().begin(), p.getInitData().size());
+        return -1;
+      }
+
+      case CDM_PROXY_LOAD_SESSION: {
+        auto p = params.getAs<CdmProxy::LoadSessionParams>();
+        // sessions stored before the capture started are loaded as recorded
+        auto session_id = liveSessionId(p.getSessionId());
+        m_host.new_sessions.erase(p.getPromiseId());
+        m_cdm->LoadSession(p.getPromiseId(), static_cast<cdm::SessionType>(p.getSessionType()), session_id.begin(), session_id.size());
+        return -1;
+      }
+
+      case CDM_PROXY_UPDATE_SESSION: {
+        auto p = params.getAs<CdmProxy::UpdateSessionParams>();
+        auto session_id = liveSessionId(p.getSessionId());
+        m_cdm->UpdateSession(p.getPromiseId(), session_id.begin(), session_id.size(), p.getResponse().begin(), p.getResponse().size());
+        return -1;
+      }
+
+      case CDM_PROXY_CLOSE_SESSION: {
+        auto p = params.getAs<CdmProxy::CloseSessionParams>();
+        auto session_id = liveSessionId(p.getSessionId());
+        m_cdm->CloseSession(p.getPromiseId(), session_id.begin(), session_id.size());
+        return -1;
+      }
+
+      case CDM_PROXY_REMOVE_SESSION: {
+        auto p = params.getAs<CdmProxy::RemoveSessionParams>();
+        auto session_id = liveSessionId(p.getSessionId());
+        m_cdm->RemoveSession(p.getPromiseId(), session_id.begin(), session_id.size());
+        return -1;
+      }
+
+      case CDM_PROXY_DECRYPT: {
+        ReplayInput input;
+        read_input_buffer(record.getInput(), input);
+        HostDecryptedBlock block;
+        return m_cdm->Decrypt(input.buffer, &block);
+      }
+
+      case CDM_PROXY_INITIALIZE_VIDEO_DECODER: {
+        auto p = params.getAs<CdmProxy::InitializeVideoDecoderParams>().getVideoDecoderConfig();
+        cdm::VideoDecoderConfig_2 config;
+        config.codec             = static_cast<cdm::VideoCodec>(p.getCodec());
+        config.profile           = static_cast<cdm::VideoCodecProfile>(p.getProfile());
+        config.format            = static_cast<cdm::VideoFormat>(p.getFormat());
+        config.coded_size.width  = p.getCodedSize().getWidth();
+        config.coded_size.height = p.getCodedSize().getHeight();
+        config.extra_data        = const_cast<uint8_t*>(p.getExtraData().begin());
+        config.extra_data_size   = p.getExtraData().size();
+        config.encryption_scheme = static_cast<cdm::EncryptionScheme>(p.getEncryptionScheme());
+        return m_cdm->InitializeVideoDecoder(config);
+      }
+
+      case CDM_PROXY_DEINITIALIZE_DECODER: {
+        auto p = params.getAs<CdmProxy::DeinitializeDecoderParams>();
+        m_cdm->DeinitializeDecoder(static_cast<cdm::StreamType>(p.getDecoderType()));
+        return -1;
+      }
+
+      case CDM_PROXY_RESET_DECODER: {
+        auto p = params.getAs<CdmProxy::ResetDecoderParams>();
+        m_cdm->ResetDecoder(static_cast<cdm::StreamType>(p.getDecoderType()));
+        return -1;
+      }
+
+      case CDM_PROXY_DECRYPT_AND_DECODE_FRAME: {
+        ReplayInput input;
+        read_input_buffer(record.getInput(), input);
+        HostVideoFrame frame;
+        return m_cdm->DecryptAndDecodeFrame(input.buffer, &frame);
+      }
+
+      default:
+        KJ_FAIL_ASSERT("unexpected method in capture", record.getMethod());
+    }
+  }
+
+  void hostCall(CaptureRecord::Reader record) {
+    // Host calls are recorded as they come in, calls to the CDM once they return. So the live CDM may not even have
+    // been asked for the session yet: its id is looked up once a call uses the recorded one, see liveSessionId().
+    if (record.getMethod() == HOST_PROXY_ON_RESOLVE_NEW_SESSION_PROMISE) {
+      auto p = record.getParams().getAs<HostProxy::OnResolveNewSessionPromiseParams>();
+      m_pending_sessions.upsert(kj::str(p.getSessionId()), p.getPromiseId());
+    }
+  }
+
+public:
+
+  void run(int fd) {
+
+    kj::FdInputStream              raw_input(fd);
+    kj::BufferedInputStreamWrapper input(raw_input);
+
+    capnp::ReaderOptions options;
+    options.traversalLimitInWords = 1024 * 1024 * 1024;
+
+    auto start = monotonic_ns();
+
+    while (input.tryGetReadBuffer().size() > 0) {
+
+      capnp::PackedMessageReader message(input, options);
+      auto record = message.getRoot<CaptureRecord>();
+
+      if (!m_max_speed) {
+        auto delay = start + record.getTimestamp() - monotonic_ns();
+        if (delay > 0) {
+          usleep(delay / 1000);
+        }
+      }
+      m_host.runPending(m_max_speed);
+
+      if (record.getInterface() == CaptureRecord::Interface::HOST_PROXY) {
+        hostCall(record);
+        continue;
+      }
+
+      // timers and output protection queries are answered as the live CDM makes them. Samples from host regions
+      // are recorded with their data and replayed as ordinary ones.
+      if (record.getMethod() == CDM_PROXY_TIMER_EXPIRED || record.getMethod() == CDM_PROXY_ON_QUERY_OUTPUT_PROTECTION_STATUS ||
+          record.getMethod() == CDM_PROXY_UNREGISTER_REGION) {
+        continue;
+      }
+
+      auto call_start = monotonic_ns();
+      auto status     = call(record);
+      auto duration   = monotonic_ns() - call_start;
+
+      auto& stats = m_stats[record.getMethod()];
+      stats.calls++;
+      stats.total_ns    += duration;
+      stats.max_ns       = kj::max(stats.max_ns, duration);
+      stats.recorded_ns += record.getDuration();
+      if (status >= 0 && status != record.getStatus()) {
+        stats.status_changes++;
+      }
+    }
+  }
+
+  void report() {
+    printf("%-32s %8s %12s %12s %12s %8s\n", "method", "calls", "mean us", "max us", "recorded us", "status");
+    for (size_t i = 0; i < kj::size(m_stats); i++) {
+      auto& stats = m_stats[i];
+      if (stats.calls == 0) {
+        continue;
+      }
+      printf("%-32s %8lu %12.1f %12.1f %12.1f %8lu\n", CDM_PROXY_METHOD_NAMES[i], stats.calls,
+        stats.total_ns / 1000.0 / stats.calls, stats.max_ns / 1000.0, stats.recorded_ns / 1000.0 / stats.calls, stats.status_changes);
+    }
+    reportCounters();
+  }
+
+  // per-call means of the resource counters, with FCDM_COUNTERS=1
+  void reportCounters() {
+
+    for (auto method: { CDM_PROXY_DECRYPT, CDM_PROXY_DECRYPT_AND_DECODE_FRAME }) {
+      FcdmCallCounters counters;
+      if (m_shim.get_call_counters == nullptr || !m_shim.get_call_counters(m_cdm, method, &counters) || counters.calls == 0) {
+        continue;
+      }
+
+      printf("\n%-32s %14s %14s\n", CDM_PROXY_METHOD_NAMES[method], "shim/call", "worker/call");
+      for (int i = 0; i < FCDM_COUNTER_COUNT; i++) {
+        if ((counters.available & (1 << i)) == 0) {
+          printf("%-32s %14s %14s\n", FCDM_COUNTER_NAMES[i], "-", "-");
+          continue;
+        }
+        printf("%-32s %14.1f %14.1f\n", FCDM_COUNTER_NAMES[i], static_cast<double>(counters.shim[i]) / counters.calls,
+          counters.worker_calls > 0 ? static_cast<double>(counters.worker[i]) / counters.worker_calls : 0.0);
+      }
+    }
+  }
+
+  Replay(Shim& shim, kj::StringPtr key_system, bool max_speed) : m_shim(shim), m_max_speed(max_speed) {
+    m_cdm = shim.createInstance(key_system, m_host);
+  }
+
+  ~Replay() {
+    m_cdm->Destroy();
+  }
+};
+
+int main(int argc, char* argv[]) {
+
+  kj::TopLevelProcessContext context(argv[0]);
+
+  if (argc != 4 && !(argc == 5 && kj::StringPtr(argv[4]) == "--max-speed")) {
+    fprintf(stderr, "usage: %s <shim.so> <key system> <capture file> [--max-speed]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  int fd;
+  KJ_SYSCALL(fd = open(argv[3], O_RDONLY | O_CLOEXEC), argv[3]);
+  kj::AutoCloseFd capture(fd);
+
+  auto shim = Shim::load(argv[1]);
+  {
+    Replay replay(shim, argv[2], argc == 5);
+    replay.run(capture.get());
+    replay.report();
+  }
+  shim.deinitialize();
+
+  return EXIT_SUCCESS;
+}
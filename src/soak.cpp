@@ -0,0 +1,160 @@
+#include <cstdlib>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#include <sys/user.h>
+#endif
+#include <kj/main.h>
+#include <cdm/content_decryption_module.h>
+#include "host.h"
+#include "util.h"
+
+// Creates and destroys instances through a shim over and over, and fails if that leaves anything behind: memory,
+// fds, or workers that haven't exited and been reaped. Every other instance is destroyed right after Initialize,
+// while the call is still in flight; the rest once the CDM has reported back. Memory is the resident set after the
+// warm-up against the one at the end, which may only grow by so much per instance.
+//
+// usage: fcdm-soak <shim.so> <key system> [iterations]
+
+#define SOAK_WARMUP                  20
+#define SOAK_SETTLE_MS               5000
+#define SOAK_RSS_PER_ITERATION_BYTES 1024
+
+struct Footprint {
+  long     rss_kb;
+  uint32_t fds;
+  uint32_t workers;  // 0 if the shim doesn't tell
+  uint32_t unreaped;
+};
+
+static uint32_t count_fds() {
+  uint32_t fds = 0;
+  for (int fd = 0; fd < getdtablesize(); fd++) {
+    if (fcntl(fd, F_GETFD) >= 0) {
+      fds++;
+    }
+  }
+  return fds;
+}
+
+// The resident set as it is now. getrusage() only knows its peak, which stays put while memory leaks into pages
+// freed earlier.
+static long current_rss_kb() {
+  long page_size;
+  KJ_SYSCALL(page_size = sysconf(_SC_PAGESIZE));
+#ifdef __FreeBSD__
+  struct kinfo_proc info;
+  size_t            size  = sizeof(info);
+  int               mib[] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, getpid() };
+  KJ_SYSCALL(sysctl(mib, 4, &info, &size, nullptr, 0));
+  return info.ki_rssize * (page_size / 1024);
+#else
+  FILE* file = fopen("/proc/self/statm", "re");
+  KJ_REQUIRE(file != nullptr, "unable to open /proc/self/statm", strerror(errno));
+  long size = 0, resident = 0;
+  int  fields = fscanf(file, "%ld %ld", &size, &resident);
+  fclose(file);
+  KJ_REQUIRE(fields == 2, "unable to read /proc/self/statm");
+  return resident * (page_size / 1024);
+#endif
+}
+
+static Footprint measure(Shim& shim) {
+
+  Footprint footprint = {};
+  footprint.rss_kb = current_rss_kb();
+  footprint.fds    = count_fds();
+  if (shim.get_usage != nullptr) {
+    FcdmUsage fcdm_usage;
+    shim.get_usage(&fcdm_usage);
+    footprint.workers  = fcdm_usage.workers;
+    footprint.unreaped = fcdm_usage.unreaped;
+  }
+  return footprint;
+}
+
+static void cycle(Shim& shim, kj::StringPtr key_system, bool wait_initialized) {
+
+  ToolHost host;
+  auto cdm = shim.createInstance(key_system, host);
+  cdm->Initialize(false, false, false);
+
+  if (wait_initialized && shim.dispatch_callbacks != nullptr) {
+    auto deadline = monotonic_ns() + SOAK_SETTLE_MS * 1000000ll;
+    while (!host.initialized && monotonic_ns() < deadline) {
+      usleep(1000);
+      shim.dispatch_callbacks(cdm);
+    }
+    KJ_ASSERT(host.initialized, "instance didn't initialize");
+  }
+
+  cdm->Destroy();
+}
+
+// Workers exit and get reaped in the background, give them time to
+static Footprint settle(Shim& shim) {
+  auto deadline  = monotonic_ns() + SOAK_SETTLE_MS * 1000000ll;
+  auto footprint = measure(shim);
+  while ((footprint.workers > 0 || footprint.unreaped > 0) && monotonic_ns() < deadline) {
+    usleep(10000);
+    footprint = measure(shim);
+  }
+  return footprint;
+}
+
+int main(int argc, char* argv[]) {
+
+  kj::TopLevelProcessContext context(argv[0]);
+
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "usage: %s <shim.so> <key system> [iterations]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  uint32_t iterations = argc == 4 ? strtoul(argv[3], nullptr, 10) : 1000;
+  kj::StringPtr key_system = argv[2];
+
+  auto shim = Shim::load(argv[1]);
+
+  // the first instances start the I/O thread, the log writer and the like, which stay
+  for (uint32_t i = 0; i < SOAK_WARMUP; i++) {
+    cycle(shim, key_system, i % 2 == 0);
+  }
+  auto baseline = settle(shim);
+  printf("baseline: rss %ld kB, %u fds, %u workers, %u unreaped\n", baseline.rss_kb, baseline.fds, baseline.workers, baseline.unreaped);
+
+  auto start = monotonic_ns();
+  for (uint32_t i = 1; i <= iterations; i++) {
+    cycle(shim, key_system, i % 2 == 0);
+    if (i % 100 == 0) {
+      auto footprint = measure(shim);
+      printf("%8u: rss %ld kB, %u fds, %u workers, %u unreaped, %.1f ms per instance\n", i, footprint.rss_kb,
+        footprint.fds, footprint.workers, footprint.unreaped, (monotonic_ns() - start) / 1000000.0 / i);
+    }
+  }
+
+  auto last = settle(shim);
+  printf("after %u: rss %ld kB, %u fds, %u workers, %u unreaped\n", iterations, last.rss_kb, last.fds, last.workers, last.unreaped);
+
+  shim.deinitialize();
+
+  bool leaked = false;
+  if (last.fds != baseline.fds) {
+    fprintf(stderr, "leaked %d fds\n", static_cast<int>(last.fds - baseline.fds));
+    leaked = true;
+  }
+  long growth_kb = last.rss_kb - baseline.rss_kb;
+  if (growth_kb > 0 && growth_kb * 1024 > static_cast<int64_t>(iterations) * SOAK_RSS_PER_ITERATION_BYTES) {
+    fprintf(stderr, "rss grew by %ld kB, %.0f bytes per instance\n", growth_kb, growth_kb * 1024.0 / kj::max(iterations, 1u));
+    leaked = true;
+  }
+  if (last.workers > 0 || last.unreaped > 0) {
+    fprintf(stderr, "%u workers still accounted, %u not reaped\n", last.workers, last.unreaped);
+    leaked = true;
+  }
+
+  return leaked ? EXIT_FAILURE : EXIT_SUCCESS;
+}
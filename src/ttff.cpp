@@ -0,0 +1,328 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstdio>
+#include <poll.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <kj/main.h>
+#include <cdm/content_decryption_module.h>
+#include "host.h"
+#include "util.h"
+
+// Measures the time to the first decoded frame of a new instance, phase by phase, over many instances, against
+// the stand-in CDM (fakecdm.cpp, see FCDM_CDM_SO_PATH). Every instance gets a worker of its own unless --warm is
+// given, which starts a daemon first and has all instances created there. The first instance is reported on its
+// own, as nothing is in the page cache or loaded yet.
+//
+// With --load, a persistent-license session is stored once up front, and every instance resumes it with
+// LoadSession instead of going through a license request and response. That needs FCDM_STORAGE_PATH.
+//
+// usage: fcdm-ttff <shim.so> <key system> [iterations] [--warm] [--load]
+
+#define TTFF_TIMEOUT_MS  10000
+#define TTFF_WIDTH       1920
+#define TTFF_HEIGHT      1080
+#define TTFF_SAMPLE_SIZE (64 * 1024)
+#define FAKE_KEY_ID      "fcdm fake key id" // the one key of the stand-in CDM
+
+enum Phase {
+  PHASE_CREATE,
+  PHASE_SPAWN,
+  PHASE_BOOTSTRAP,
+  PHASE_LOAD,
+  PHASE_INITIALIZE_MODULE,
+  PHASE_CREATE_INSTANCE,
+  PHASE_MAP,
+  PHASE_INITIALIZE,
+  PHASE_SESSION,
+  PHASE_LICENSE,
+  PHASE_LOAD_SESSION,
+  PHASE_DECODER,
+  PHASE_FIRST_FRAME,
+  PHASE_TOTAL,
+  PHASE_COUNT,
+};
+
+static const char* const PHASE_NAMES[] = {
+  "CreateCdmInstance", "  spawn", "  bootstrap", "  load CDM", "  initialize module", "  create instance", "  map arenas",
+  "Initialize", "session", "license", "LoadSession", "InitializeVideoDecoder", "first frame", "total",
+};
+
+class Ttff {
+
+  Shim&                     m_shim;
+  kj::StringPtr             m_key_system;
+  kj::Maybe<kj::String>     m_stored_session; // resumed by every instance, see --load
+  kj::Vector<int64_t>       m_times[PHASE_COUNT];
+  bool                      m_measured[PHASE_COUNT] = {};
+  kj::Array<uint8_t>        m_sample;
+  cdm::SubsampleEntry       m_subsample;
+
+  // Delivers callbacks as they come in until `done`
+  template <typename Done>
+  void waitFor(void* instance, Done&& done, const char* what) {
+
+    struct pollfd fd;
+    fd.fd     = m_shim.get_callback_fd(instance);
+    fd.events = POLLIN;
+
+    auto deadline = monotonic_ns() + TTFF_TIMEOUT_MS * 1000000ll;
+    for (;;) {
+      m_shim.dispatch_callbacks(instance);
+      if (done()) {
+        return;
+      }
+      auto remaining_ms = (deadline - monotonic_ns()) / 1000000;
+      KJ_ASSERT(remaining_ms > 0, "timed out waiting", what);
+      if (poll(&fd, 1, remaining_ms) < 0 && errno != EINTR) {
+        KJ_FAIL_SYSCALL("poll", errno);
+      }
+    }
+  }
+
+  // Creates a session of `type` and licenses it with its own license request. Returns its id.
+  kj::String license(cdm::ContentDecryptionModule_10* cdm, ToolHost& host, cdm::SessionType type, int64_t* times) {
+
+    // the stand-in takes its own license request for a license
+    static const uint8_t init_data[] = "fcdm-ttff";
+    auto phase_start = monotonic_ns();
+    cdm->CreateSessionAndGenerateRequest(1, type, cdm::InitDataType::kCenc, init_data, sizeof(init_data));
+    waitFor(cdm, [&]() { return host.last_message.size() > 0 || host.rejected > 0; }, "license request");
+    times[PHASE_SESSION] = monotonic_ns() - phase_start;
+    KJ_ASSERT(host.rejected == 0, "session refused");
+
+    auto session_id = kj::str(KJ_ASSERT_NONNULL(host.new_sessions.find(1)));
+    auto resolved   = host.resolved;
+    phase_start = monotonic_ns();
+    cdm->UpdateSession(2, session_id.begin(), session_id.size(), host.last_message.begin(), host.last_message.size());
+    waitFor(cdm, [&]() { return host.resolved > resolved || host.rejected > 0; }, "license");
+    times[PHASE_LICENSE] = monotonic_ns() - phase_start;
+    KJ_ASSERT(host.rejected == 0, "license refused");
+
+    return session_id;
+  }
+
+public:
+
+  // Stores the persistent-license session the instances resume from here on
+  void storeSession() {
+    int64_t  times[PHASE_COUNT];
+    ToolHost host;
+    auto cdm = m_shim.createInstance(m_key_system, host);
+    cdm->Initialize(false, true, false);
+    waitFor(cdm, [&]() { return host.initialized; }, "OnInitialized");
+    m_stored_session = license(cdm, host, cdm::kPersistentLicense, times);
+    cdm->Destroy();
+  }
+
+  void run() {
+
+    int64_t times[PHASE_COUNT] = {};
+    bool    measured[PHASE_COUNT];
+    ToolHost host;
+
+    for (int i = 0; i < PHASE_COUNT; i++) {
+      measured[i] = true;
+    }
+
+    auto start = monotonic_ns();
+    auto cdm   = m_shim.createInstance(m_key_system, host);
+    times[PHASE_CREATE] = monotonic_ns() - start;
+
+    FcdmStartupTimes startup;
+    m_shim.get_startup_times(cdm, &startup);
+    times[PHASE_SPAWN]             = startup.spawn_ns;
+    times[PHASE_BOOTSTRAP]         = startup.bootstrap_ns;
+    times[PHASE_LOAD]              = startup.load_ns;
+    times[PHASE_INITIALIZE_MODULE] = startup.initialize_module_ns;
+    times[PHASE_CREATE_INSTANCE]   = startup.create_instance_ns;
+    times[PHASE_MAP]               = startup.map_ns;
+
+    auto phase_start = monotonic_ns();
+    cdm->Initialize(false, m_stored_session != nullptr, false);
+    waitFor(cdm, [&]() { return host.initialized; }, "OnInitialized");
+    times[PHASE_INITIALIZE] = monotonic_ns() - phase_start;
+
+    KJ_IF_MAYBE(session_id, m_stored_session) {
+      phase_start = monotonic_ns();
+      cdm->LoadSession(3, cdm::kPersistentLicense, session_id->begin(), session_id->size());
+      waitFor(cdm, [&]() { return host.new_sessions.find(3) != nullptr || host.rejected > 0; }, "LoadSession");
+      times[PHASE_LOAD_SESSION] = monotonic_ns() - phase_start;
+      KJ_ASSERT(host.rejected == 0, "LoadSession refused");
+      KJ_ASSERT(KJ_ASSERT_NONNULL(host.new_sessions.find(3)).size() > 0, "stored session not found", *session_id);
+      measured[PHASE_SESSION] = measured[PHASE_LICENSE] = false;
+    } else {
+      license(cdm, host, cdm::kTemporary, times);
+      measured[PHASE_LOAD_SESSION] = false;
+    }
+
+    cdm::VideoDecoderConfig_2 config;
+    memset(&config, 0, sizeof(config));
+    config.codec             = cdm::kCodecH264;
+    config.profile           = cdm::kH264ProfileMain;
+    config.format            = cdm::kI420;
+    config.coded_size.width  = TTFF_WIDTH;
+    config.coded_size.height = TTFF_HEIGHT;
+    config.encryption_scheme = cdm::EncryptionScheme::kCenc;
+
+    phase_start = monotonic_ns();
+    KJ_ASSERT(cdm->InitializeVideoDecoder(config) == cdm::kSuccess);
+    times[PHASE_DECODER] = monotonic_ns() - phase_start;
+
+    static const uint8_t iv[16] = {};
+    cdm::InputBuffer_2 input;
+    memset(&input, 0, sizeof(input));
+    input.data              = m_sample.begin();
+    input.data_size         = m_sample.size();
+    input.encryption_scheme = cdm::EncryptionScheme::kCenc;
+    input.key_id            = reinterpret_cast<const uint8_t*>(FAKE_KEY_ID);
+    input.key_id_size       = strlen(FAKE_KEY_ID);
+    input.iv                = iv;
+    input.iv_size           = sizeof(iv);
+    input.subsamples        = &m_subsample;
+    input.num_subsamples    = 1;
+
+    phase_start = monotonic_ns();
+    {
+      HostVideoFrame frame;
+      KJ_ASSERT(cdm->DecryptAndDecodeFrame(input, &frame) == cdm::kSuccess);
+    }
+    times[PHASE_FIRST_FRAME] = monotonic_ns() - phase_start;
+    times[PHASE_TOTAL]       = monotonic_ns() - start;
+
+    cdm->Destroy();
+
+    for (int i = 0; i < PHASE_COUNT; i++) {
+      m_times[i].add(times[i]);
+      m_measured[i] = measured[i];
+    }
+  }
+
+  void report(bool warm) {
+
+    auto ms = [](int64_t ns) { return ns / 1000000.0; };
+
+    printf("%u instances, %s workers, %s sessions, ms\n", static_cast<uint32_t>(m_times[0].size()),
+      warm ? "warm (daemon)" : "cold (own)", m_stored_session != nullptr ? "loaded" : "licensed");
+    printf("%-24s %9s %9s %9s %9s %9s %9s\n", "phase", "first", "min", "p50", "p90", "p99", "max");
+
+    for (int i = 0; i < PHASE_COUNT; i++) {
+      if (!m_measured[i]) {
+        continue;
+      }
+      auto first  = m_times[i][0];
+      auto sorted = kj::heapArray<int64_t>(m_times[i].asPtr());
+      std::sort(sorted.begin(), sorted.end());
+      auto at = [&](double quantile) { return sorted[static_cast<size_t>(quantile * (sorted.size() - 1))]; };
+      printf("%-24s %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", PHASE_NAMES[i], ms(first), ms(sorted[0]), ms(at(0.5)),
+        ms(at(0.9)), ms(at(0.99)), ms(sorted.back()));
+    }
+  }
+
+  Ttff(Shim& shim, kj::StringPtr key_system) : m_shim(shim), m_key_system(key_system), m_sample(kj::heapArray<uint8_t>(TTFF_SAMPLE_SIZE)) {
+    for (size_t i = 0; i < m_sample.size(); i++) {
+      m_sample[i] = i;
+    }
+    m_subsample.clear_bytes  = 16;
+    m_subsample.cipher_bytes = TTFF_SAMPLE_SIZE - 16;
+  }
+};
+
+// Starts `fcdm-worker --listen` and points the shim at it. Returns its pid.
+static pid_t start_daemon(kj::StringPtr path) {
+
+  char* worker_path = getenv("FCDM_WORKER_PATH");
+  KJ_REQUIRE(worker_path != nullptr, "FCDM_WORKER_PATH is not set");
+
+  const char* const args[] = { worker_path, "--listen", path.cStr(), nullptr };
+  extern char** environ;
+
+  pid_t pid;
+  int   err = posix_spawnp(&pid, worker_path, nullptr, nullptr, (char* const*)args, environ);
+  KJ_REQUIRE(err == 0, "unable to start the daemon", strerror(err));
+
+  // wait for it to listen
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  KJ_REQUIRE(path.size() < sizeof(address.sun_path), "socket path is too long", path);
+  strcpy(address.sun_path, path.cStr());
+
+  auto deadline = monotonic_ns() + TTFF_TIMEOUT_MS * 1000000ll;
+  for (;;) {
+    int fd;
+    KJ_SYSCALL(fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    bool listening = connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0;
+    close(fd);
+    if (listening) {
+      break;
+    }
+    KJ_ASSERT(monotonic_ns() < deadline, "daemon didn't come up", path);
+    usleep(10000);
+  }
+
+  setenv("FCDM_DAEMON_SOCKET", path.cStr(), 1);
+  // the daemon gives clients without one no storage, and --load needs it
+  setenv("FCDM_STORAGE_SCOPE", "fcdm-ttff", 0);
+  return pid;
+}
+
+int main(int argc, char* argv[]) {
+
+  kj::TopLevelProcessContext context(argv[0]);
+
+  bool warm = false;
+  bool load = false;
+  int  args = argc;
+  while (args > 3) {
+    if (kj::StringPtr(argv[args - 1]) == "--warm") {
+      warm = true;
+    } else if (kj::StringPtr(argv[args - 1]) == "--load") {
+      load = true;
+    } else {
+      break;
+    }
+    args--;
+  }
+  if (args != 3 && args != 4) {
+    fprintf(stderr, "usage: %s <shim.so> <key system> [iterations] [--warm] [--load]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  uint32_t iterations = args == 4 ? strtoul(argv[3], nullptr, 10) : 100;
+  KJ_REQUIRE(iterations > 0);
+
+  auto shim = Shim::load(argv[1]);
+  KJ_REQUIRE(shim.dispatch_callbacks != nullptr && shim.get_callback_fd != nullptr && shim.get_startup_times != nullptr,
+    "not a foreign-cdm shim", argv[1]);
+
+  pid_t daemon      = 0;
+  auto  socket_path = kj::str("/tmp/fcdm-ttff-", getpid(), ".sock");
+  if (warm) {
+    daemon = start_daemon(socket_path);
+  }
+
+  {
+    Ttff ttff(shim, argv[2]);
+    if (load) {
+      ttff.storeSession();
+    }
+    for (uint32_t i = 0; i < iterations; i++) {
+      ttff.run();
+    }
+    ttff.report(warm);
+  }
+  shim.deinitialize();
+
+  if (daemon != 0) {
+    kill(daemon, SIGTERM);
+    KJ_SYSCALL(waitpid(daemon, nullptr, 0));
+    unlink(socket_path.cStr());
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -1,22 +1,273 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <kj/common.h>
+#include <kj/debug.h>
+#include <kj/function.h>
+#include "config.h"
+
+inline int64_t monotonic_ns() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+inline int64_t getenv_int(const char* name, int64_t default_value) {
+  char* value = getenv(name);
+  return value != nullptr ? strtoll(value, nullptr, 10) : default_value;
+}
+
+// How long to busy-poll for a message before going to sleep, from FCDM_SPIN_US or SPIN_US. Spinning trades a core
+// for the two scheduler wakeups each request and response otherwise cost.
+inline int64_t get_spin_ns() {
+  static const int64_t spin_ns = []() {
+    char* spin_us = getenv("FCDM_SPIN_US");
+    return (spin_us != nullptr ? strtoll(spin_us, nullptr, 10) : SPIN_US) * 1000;
+  }();
+  return spin_ns;
+}
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Whether `fd` is sealed against shrinking. Pages of a mapping past the end of the file fault with SIGBUS, so every
+// memfd mapped from the other side of the connection must be.
+inline bool is_shrink_sealed(int fd) {
+#ifdef F_SEAL_SHRINK
+  int seals = fcntl(fd, F_GET_SEALS);
+  return seals >= 0 && (seals & F_SEAL_SHRINK) != 0;
+#else
+  return true;
+#endif
+}
+
+// Lives in the page between the two arenas. The shim holds the arenas for the length of a decrypt or decode, the
+// worker only drops their pages when it can take them over.
+struct ArenaControl {
+
+  static constexpr uint32_t FREE   = 0;
+  static constexpr uint32_t SHIM   = 1;
+  static constexpr uint32_t WORKER = 2;
+
+  // A frame of the decrypted arena the host was given by FcdmDecryptAndDecodeFrameExport(), kept there until it
+  // releases it. Set by the shim, skipped by the worker when it allocates. A size of 0 marks a free slot.
+  struct HeldFrame {
+    std::atomic<uint32_t> offset;
+    std::atomic<uint32_t> size;
+  };
+
+  std::atomic<uint32_t> owner;
+  HeldFrame             held[EXPORTED_FRAMES];
+  std::atomic<uint64_t> grown;     // times the decrypted arena had to grow
+  std::atomic<uint64_t> overflows; // allocations that didn't fit either arena, and failed
+
+  // the worker only holds them for a couple of syscalls
+  void lock() {
+    uint32_t expected = FREE;
+    while (!owner.compare_exchange_weak(expected, SHIM, std::memory_order_acquire)) {
+      expected = FREE;
+      sched_yield();
+    }
+  }
+
+  bool tryLock() {
+    uint32_t expected = FREE;
+    return owner.compare_exchange_strong(expected, WORKER, std::memory_order_acquire);
+  }
+
+  void unlock() {
+    owner.store(FREE, std::memory_order_release);
+  }
 
+  bool anyHeld() const {
+    for (auto& frame: held) {
+      if (frame.size.load(std::memory_order_acquire) != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// Bump allocator over an arena in the memfd. An arena that ends the memfd may grow into address space reserved
+// behind it, up to `max_size`, by extending the memfd. The memfd is sealed against shrinking, so the pages it grew
+// by are punched out again instead.
 class XAlloc {
 
-  uint8_t* m_arena_start;
-  uint32_t m_arena_size;
-  uint8_t* m_position;
+  uint8_t*      m_arena_start;
+  uint32_t      m_arena_size;
+  uint8_t*      m_position;
+  ArenaControl* m_control = nullptr;
+  int           m_fd;            // not owned, -1 if the arena can't grow
+  uint32_t      m_offset;        // of the arena in the memfd
+  uint32_t      m_base_size;
+  uint32_t      m_mapped_size;
+
+  kj::Maybe<kj::Function<bool(int64_t)>> m_reserve;
+
+  // Extends the arena to at least `needed` bytes. The pages only become valid once the memfd covers them.
+  bool grow(uint64_t needed) {
+
+    if (m_fd < 0 || needed > m_mapped_size) {
+      return false;
+    }
+
+    uint64_t size = m_arena_size;
+    while (size < needed) {
+      size *= 2;
+    }
+    size = kj::min(size, static_cast<uint64_t>(m_mapped_size));
+
+    int64_t growth = size - m_arena_size;
+    KJ_IF_MAYBE(reserve, m_reserve) {
+      if (!(*reserve)(growth)) {
+        KJ_LOG(WARNING, "arena growth refused", size);
+        return false;
+      }
+    }
+
+    // still covered if it grew this far before
+    struct stat st;
+    if (fstat(m_fd, &st) != 0 || (st.st_size < static_cast<off_t>(m_offset + size) && ftruncate(m_fd, m_offset + size) != 0)) {
+      KJ_LOG(ERROR, "unable to grow arena", size, strerror(errno));
+      KJ_IF_MAYBE(reserve, m_reserve) {
+        (*reserve)(-growth);
+      }
+      return false;
+    }
+
+    KJ_LOG(WARNING, "arena grown", size);
+    m_arena_size = size;
+    if (m_control != nullptr) {
+      m_control->grown.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  // Drops the pages of [offset, offset + size) of the arena, they come back zeroed on the next touch
+  void punch(uint32_t offset, uint32_t size) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, m_offset + offset, size) == 0) {
+      return;
+    }
+#endif
+#ifdef MADV_REMOVE
+    if (madvise(m_arena_start + offset, size, MADV_REMOVE) == 0) {
+      return;
+    }
+#endif
+    KJ_LOG(WARNING, "unable to give back arena pages", size, strerror(errno));
+  }
+
+  // Moves `position` past the held frames that [position, position + size) would overlap
+  uint8_t* skipHeld(uint8_t* position, uint64_t size) const {
+    for (bool moved = true; moved; ) {
+      moved = false;
+      for (auto& frame: m_control->held) {
+        uint32_t held_size = frame.size.load(std::memory_order_acquire);
+        if (held_size == 0) {
+          continue;
+        }
+        auto held_start = m_arena_start + frame.offset.load(std::memory_order_relaxed);
+        auto held_end   = held_start + ((held_size + 7) & ~7);
+        if (position < held_end && held_start < position + size) {
+          position = held_end;
+          moved    = true;
+        }
+      }
+    }
+    return position;
+  }
 
 public:
 
+  // Returns nullptr if `nbytes` don't fit, even after growing the arena as far as it goes
   uint8_t* allocate(uint32_t nbytes) {
-    auto cur_pos = m_position;
-    auto new_pos = m_position + ((nbytes + 7) & ~7);
-    KJ_ASSERT(new_pos < m_arena_start + m_arena_size, "out of mem");
-    m_position = new_pos;
+    uint64_t size    = (static_cast<uint64_t>(nbytes) + 7) & ~7ull;
+    auto     cur_pos = m_control != nullptr ? skipHeld(m_position, size) : m_position;
+    uint64_t end     = (cur_pos - m_arena_start) + size;
+    if (end > m_arena_size && !grow(end)) {
+      if (m_control != nullptr) {
+        m_control->overflows.fetch_add(1, std::memory_order_relaxed);
+      }
+      return nullptr;
+    }
+    m_position = cur_pos + size;
     return cur_pos;
   }
 
+  // Makes allocations leave the frames held in `control` alone, and counts growth and overflows there
+  void setControl(ArenaControl* control) {
+    m_control = control;
+  }
+
+  // `reserve` is asked for the bytes the arena is about to grow by, and growth is refused if it returns false.
+  // It's told about what the arena gives back with the negative of that.
+  void setReserve(kj::Function<bool(int64_t)> reserve) {
+    m_reserve = kj::mv(reserve);
+  }
+
+  uint32_t getSize() const {
+    return m_arena_size;
+  }
+
+  uint8_t* begin() const {
+    return m_arena_start;
+  }
+
+  uint8_t* getPosition() const {
+    return m_position;
+  }
+
+  // Hands out [position, current position) again
+  void rewind(uint8_t* position) {
+    KJ_ASSERT(position >= m_arena_start && position <= m_position);
+    m_position = position;
+  }
+
+  // Whether [start, start + size) overlaps a held frame
+  bool isHeld(const uint8_t* start, uint64_t size) const {
+    if (m_control == nullptr) {
+      return false;
+    }
+    for (auto& frame: m_control->held) {
+      uint32_t held_size = frame.size.load(std::memory_order_acquire);
+      if (held_size == 0) {
+        continue;
+      }
+      auto held_start = m_arena_start + frame.offset.load(std::memory_order_relaxed);
+      if (start < held_start + held_size && held_start < start + size) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Gives back what the arena grew by
+  void shrink() {
+    if (m_arena_size > m_base_size) {
+      punch(m_base_size, m_arena_size - m_base_size);
+      KJ_IF_MAYBE(reserve, m_reserve) {
+        (*reserve)(-static_cast<int64_t>(m_arena_size - m_base_size));
+      }
+      m_arena_size = m_base_size;
+    }
+  }
+
   uint32_t getOffset(uint8_t* position) {
     KJ_ASSERT(position >= m_arena_start && position < m_arena_start + m_arena_size, "out of bounds");
     return reinterpret_cast<uintptr_t>(position) - reinterpret_cast<uintptr_t>(m_arena_start);
@@ -26,26 +277,49 @@ public:
     m_position = m_arena_start;
   }
 
-  XAlloc(int fd, uint32_t arena_size, uint32_t offset) {
-    void* p = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+  // Drops the arena's pages, shared ones included. They come back zeroed on the next touch.
+  bool release() {
+    forget();
+    shrink();
+#ifdef MADV_REMOVE
+    return madvise(m_arena_start, m_arena_size, MADV_REMOVE) == 0;
+#else
+    errno = EOPNOTSUPP;
+    return false;
+#endif
+  }
+
+  XAlloc(int fd, uint32_t arena_size, uint32_t offset, uint32_t max_size = 0) {
+    uint32_t mapped_size = kj::max(arena_size, max_size);
+    void* p = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
     if (p == MAP_FAILED) {
       KJ_FAIL_SYSCALL("mmap", errno);
     }
     m_arena_start = reinterpret_cast<uint8_t*>(p);
     m_arena_size  = arena_size;
     m_position    = m_arena_start;
+    m_fd          = mapped_size > arena_size ? fd : -1;
+    m_offset      = offset;
+    m_base_size   = arena_size;
+    m_mapped_size = mapped_size;
   }
 
   ~XAlloc() {
     if (m_arena_start != nullptr) {
-      KJ_SYSCALL(munmap(m_arena_start, m_arena_size));
+      KJ_SYSCALL(munmap(m_arena_start, m_mapped_size));
     }
   }
 
   XAlloc(XAlloc&& other) :
     m_arena_start(other.m_arena_start),
     m_arena_size (other.m_arena_size),
-    m_position   (other.m_position)
+    m_position   (other.m_position),
+    m_control    (other.m_control),
+    m_fd         (other.m_fd),
+    m_offset     (other.m_offset),
+    m_base_size  (other.m_base_size),
+    m_mapped_size(other.m_mapped_size),
+    m_reserve    (kj::mv(other.m_reserve))
   {
     other.m_arena_start = nullptr;
     other.m_arena_size  = 0;
@@ -53,3 +327,60 @@ public:
 
   KJ_DISALLOW_COPY(XAlloc);
 };
+
+inline ArenaControl* map_arena_control(int memfd) {
+  long page_size;
+  KJ_SYSCALL(page_size = sysconf(_SC_PAGESIZE));
+  void* p = mmap(nullptr, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, SHMEM_ARENA_SIZE);
+  if (p == MAP_FAILED) {
+    KJ_FAIL_SYSCALL("mmap", errno);
+  }
+  // the page starts out zeroed, which is FREE
+  return reinterpret_cast<ArenaControl*>(p);
+}
+
+inline void unmap_arena_control(ArenaControl* control) {
+  long page_size;
+  KJ_SYSCALL(page_size = sysconf(_SC_PAGESIZE));
+  KJ_SYSCALL(munmap(control, page_size));
+}
+
+// A read-only mapping of a whole memfd the host writes samples into, see FcdmRegisterRegion()
+class MappedRegion {
+
+  const uint8_t* m_start;
+  size_t         m_size;
+
+public:
+
+  const uint8_t* begin() const {
+    return m_start;
+  }
+
+  size_t size() const {
+    return m_size;
+  }
+
+  bool contains(const uint8_t* start, size_t size) const {
+    return start >= m_start && size <= m_size && static_cast<size_t>(start - m_start) <= m_size - size;
+  }
+
+  MappedRegion(int fd) {
+    struct stat st;
+    KJ_SYSCALL(fstat(fd, &st));
+    KJ_REQUIRE(st.st_size > 0, "empty region");
+    KJ_REQUIRE(is_shrink_sealed(fd), "region not sealed against shrinking");
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      KJ_FAIL_SYSCALL("mmap", errno);
+    }
+    m_start = reinterpret_cast<const uint8_t*>(p);
+    m_size  = st.st_size;
+  }
+
+  ~MappedRegion() {
+    KJ_SYSCALL(munmap(const_cast<uint8_t*>(m_start), m_size));
+  }
+
+  KJ_DISALLOW_COPY(MappedRegion);
+};
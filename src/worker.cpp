@@ -1,28 +1,46 @@
+#include <cctype>
 #include <cerrno>
 #include <cstdlib>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <malloc.h>
 #include <kj/main.h>
+#include <kj/map.h>
+#include <kj/mutex.h>
+#include <kj/refcount.h>
+#include <kj/thread.h>
 #include <capnp/rpc-twoparty.h>
 #include <cdm/content_decryption_module.h>
 #include "cdm.capnp.h"
+#include "capture.h"
 #include "config.h"
+#include "counters.h"
+#include "log.h"
 #include "util.h"
 
+class BufferPool;
+
 class XBuffer: public cdm::Buffer {
 
-  uint8_t* m_data;
-  uint32_t m_capacity;
-  uint32_t m_size;
+  BufferPool* m_pool;
+  uint8_t*    m_data = nullptr;
+  uint32_t    m_capacity;
+  uint32_t    m_size;
+  uint32_t    m_size_class;
 
  public:
 
-  void Destroy() override {
-    delete this;
-  }
+  void Destroy() override;
 
   uint32_t Capacity() const override {
     return m_capacity;
@@ -41,12 +59,168 @@ class XBuffer: public cdm::Buffer {
     return m_size;
   }
 
-  XBuffer(uint32_t capacity, void* data) :
-    m_data(static_cast<uint8_t*>(data)), m_capacity(capacity), m_size(capacity) {}
+  // nullptr while the buffer waits in the pool
+  const uint8_t* Block() const {
+    return m_data;
+  }
+
+  uint32_t SizeClass() const {
+    return m_size_class;
+  }
+
+  void Reset(uint8_t* data, uint32_t capacity, uint32_t size_class) {
+    m_data       = data;
+    m_capacity   = capacity;
+    m_size       = capacity;
+    m_size_class = size_class;
+  }
+
+  XBuffer(BufferPool* pool) : m_pool(pool) {}
 
   ~XBuffer() {}
 };
 
+// Size classes over the decrypted arena for Host_10::Allocate. A destroyed buffer goes back to its class right away
+// and is handed out again before the arena is bumped any further, so frames and the CDM's own scratch buffers keep
+// reusing the same few blocks. There are four classes to each power of two, wasting at most a fifth of a block.
+// The XBuffer objects are recycled as well.
+class BufferPool {
+
+  static constexpr uint32_t MIN_CLASS_SHIFT = 8;
+  static constexpr uint32_t SIZE_CLASSES    = (32 - MIN_CLASS_SHIFT) * 4 + 1;
+
+  XAlloc                       m_arena;
+  kj::Vector<uint8_t*>         m_free[SIZE_CLASSES];
+  kj::Vector<kj::Own<XBuffer>> m_buffers; // every one made
+  kj::Vector<XBuffer*>         m_spare;
+  uint32_t                     m_live = 0;
+
+  static uint64_t classSize(uint32_t size_class) {
+    if (size_class == 0) {
+      return 1u << MIN_CLASS_SHIFT;
+    }
+    uint32_t shift = MIN_CLASS_SHIFT + (size_class - 1) / 4;
+    uint32_t sub   = (size_class - 1) % 4;
+    return (1ull << shift) + (sub + 1) * (1ull << (shift - 2));
+  }
+
+  static uint32_t sizeClass(uint32_t size) {
+    if (size <= (1u << MIN_CLASS_SHIFT)) {
+      return 0;
+    }
+    uint32_t shift = 31 - __builtin_clz(size - 1);
+    uint32_t sub   = ((size - 1) >> (shift - 2)) - 4;
+    return (shift - MIN_CLASS_SHIFT) * 4 + sub + 1;
+  }
+
+  // Most recently freed first, skipping blocks that overlap frames the host holds
+  uint8_t* takeFree(uint32_t size_class) {
+    auto& free = m_free[size_class];
+    for (size_t i = free.size(); i-- > 0; ) {
+      auto block = free[i];
+      if (!m_arena.isHeld(block, classSize(size_class))) {
+        free[i] = free.back();
+        free.removeLast();
+        return block;
+      }
+    }
+    return nullptr;
+  }
+
+  // Gives the free blocks past the last live buffer back to the bump allocator. Returns false if there are none.
+  bool trim() {
+
+    const uint8_t* end = m_arena.begin();
+    for (auto& buffer: m_buffers) {
+      if (buffer->Block() != nullptr) {
+        end = kj::max(end, buffer->Block() + classSize(buffer->SizeClass()));
+      }
+    }
+    if (end >= m_arena.getPosition()) {
+      return false;
+    }
+
+    for (auto& free: m_free) {
+      for (size_t i = free.size(); i-- > 0; ) {
+        if (free[i] >= end) {
+          free[i] = free.back();
+          free.removeLast();
+        }
+      }
+    }
+    m_arena.rewind(const_cast<uint8_t*>(end));
+    return true;
+  }
+
+public:
+
+  // Returns nullptr if there's no room even after growing the arena
+  cdm::Buffer* allocate(uint32_t capacity) {
+
+    auto size_class = sizeClass(capacity);
+    auto size       = classSize(size_class);
+    if (size > UINT32_MAX) {
+      return nullptr;
+    }
+
+    auto block = takeFree(size_class);
+    if (block == nullptr) {
+      block = m_arena.allocate(size);
+    }
+    if (block == nullptr && trim()) {
+      block = m_arena.allocate(size);
+    }
+    if (block == nullptr) {
+      return nullptr;
+    }
+
+    XBuffer* buffer;
+    if (m_spare.empty()) {
+      m_buffers.add(kj::heap<XBuffer>(this));
+      buffer = m_buffers.back().get();
+    } else {
+      buffer = m_spare.back();
+      m_spare.removeLast();
+    }
+
+    buffer->Reset(block, capacity, size_class);
+    m_live++;
+    return buffer;
+  }
+
+  void recycle(XBuffer* buffer) {
+    m_free[buffer->SizeClass()].add(buffer->Data());
+    buffer->Reset(nullptr, 0, 0);
+    m_spare.add(buffer);
+    m_live--;
+  }
+
+  uint32_t live() const {
+    return m_live;
+  }
+
+  // Forgets all blocks, only while no buffer is live
+  void reset() {
+    KJ_ASSERT(m_live == 0);
+    for (auto& free: m_free) {
+      free.clear();
+    }
+    m_arena.forget();
+  }
+
+  XAlloc& arena() {
+    return m_arena;
+  }
+
+  BufferPool(XAlloc arena) : m_arena(kj::mv(arena)) {}
+
+  KJ_DISALLOW_COPY(BufferPool);
+};
+
+void XBuffer::Destroy() {
+  m_pool->recycle(this);
+}
+
 class XDecryptedBlock: public cdm::DecryptedBlock {
 
   cdm::Buffer* m_buffer    = nullptr;
@@ -163,11 +337,12 @@ public:
   ~XVideoFrame() {}
 };
 
-static cdm::InputBuffer_2* get_input_buffer_and_fix_pointers(uint8_t* shared_mem_start, uint32_t offset) {
+// `data_start` is where the offset in `data` is relative to, the arena itself unless the sample is in a host region
+static cdm::InputBuffer_2* get_input_buffer_and_fix_pointers(uint8_t* shared_mem_start, const uint8_t* data_start, uint32_t offset) {
 
   auto buffer = reinterpret_cast<cdm::InputBuffer_2*>(reinterpret_cast<uint8_t*>(shared_mem_start) + offset);
 
-  buffer->data       = shared_mem_start + reinterpret_cast<uintptr_t>(buffer->data);
+  buffer->data       = data_start + reinterpret_cast<uintptr_t>(buffer->data);
   buffer->key_id     = shared_mem_start + reinterpret_cast<uintptr_t>(buffer->key_id);
   buffer->iv         = shared_mem_start + reinterpret_cast<uintptr_t>(buffer->iv);
   buffer->subsamples = reinterpret_cast<cdm::SubsampleEntry*>(
@@ -178,14 +353,14 @@ static cdm::InputBuffer_2* get_input_buffer_and_fix_pointers(uint8_t* shared_mem
 
 struct HostContext {
   kj::WaitScope* scope;
-  XAlloc*        arena;
+  BufferPool*    arena;
 };
 
 static thread_local struct HostContext host_ctx = HostContext { .scope = nullptr, .arena = nullptr };
 
-static void set_host_context(kj::WaitScope* scope, XAlloc* arena) {
-  KJ_ASSERT(host_ctx.scope == nullptr);
-  KJ_ASSERT(host_ctx.arena == nullptr);
+// The context of a fiber suspended in wait_host() may still be installed when another fiber starts,
+// so this doesn't check that the previous context was cleared.
+static void set_host_context(kj::WaitScope* scope, BufferPool* arena) {
   host_ctx.scope = scope;
   host_ctx.arena = arena;
 }
@@ -197,23 +372,337 @@ static void clear_host_context() {
   host_ctx.arena = nullptr;
 }
 
+// Waits for a host call made from inside the CDM. Other fibers may run and install their own host context while
+// this one is suspended, so ours is restored before returning to the CDM.
+template <typename Promise>
+static auto wait_host(Promise&& promise) {
+  auto ctx = host_ctx;
+  KJ_DEFER(host_ctx = ctx);
+  return promise.wait(*ctx.scope);
+}
+
+// fiber stacks are recycled between calls instead of being mapped and unmapped for every frame. The pool, and
+// the stacks it holds on to, are dropped when the worker goes idle.
+static kj::Own<kj::FiberPool> fiber_pool    = kj::heap<kj::FiberPool>(FIBER_STACK_SIZE);
+static uint32_t               active_fibers = 0;
+
+template <typename Func>
+static auto start_fiber(Func&& func) {
+  active_fibers++;
+  return fiber_pool->startFiber(kj::fwd<Func>(func)).attach(kj::defer([]() { active_fibers--; }));
+}
+
+// Lets the calls into one CDM instance in one at a time. Each call has its own fiber and yields to the event loop
+// whenever it waits on the host; the CDM must not be re-entered meanwhile. Since the shim no longer waits for
+// session calls to complete, several of them may be in flight at once.
+//
+// Calls wait in one of two queues, each in the order they arrived. Decrypt and decode calls may go ahead of the
+// timers, policy queries and posted host callbacks that arrived before them, so those don't hold up frames, but
+// never ahead of an earlier session or decoder call: a Decrypt sent after an UpdateSession sees its keys. After
+// DATA_PLANE_BURST data calls in a row a waiting control call goes in, so busy streams don't starve it. For CDMs
+// that cope with a decode while a session call is blocked on the host, FCDM_CONCURRENT_DATA_PLANE lets each
+// queue have a call inside at the same time instead.
+class CallGate {
+
+public:
+
+  enum Lane {
+    CONTROL,    // not passed by later data calls
+    DATA,
+    BACKGROUND, // shares the CONTROL queue, but data calls may pass it
+  };
+
+private:
+
+  struct Waiter {
+    uint64_t                            seq;
+    bool                                ordered;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  };
+
+  struct Queue {
+    kj::Vector<Waiter> waiting;
+    size_t             next = 0;
+
+    // The longest waiting call, skipping calls that were cancelled while waiting. nullptr if there is none.
+    Waiter* front() {
+      while (next < waiting.size() && !waiting[next].fulfiller->isWaiting()) {
+        next++;
+      }
+      if (next == waiting.size()) {
+        waiting.clear();
+        next = 0;
+        return nullptr;
+      }
+      return &waiting[next];
+    }
+
+    void wakeFront() {
+      waiting[next++].fulfiller->fulfill();
+    }
+
+    // Whether a call that must not be passed arrived before `seq` and is still waiting
+    bool orderedBefore(uint64_t seq) {
+      for (size_t i = next; i < waiting.size() && waiting[i].seq < seq; i++) {
+        if (waiting[i].ordered && waiting[i].fulfiller->isWaiting()) {
+          return true;
+        }
+      }
+      return false;
+    }
+  };
+
+  bool     m_busy[2]    = { false, false }; // per queue if concurrent, otherwise only [CONTROL] is used
+  Queue    m_queues[2];
+  uint64_t m_next_seq   = 0;
+  uint32_t m_data_burst = 0; // data calls let in in a row while a control call was waiting
+
+  static bool concurrent() {
+    static const bool concurrent = getenv("FCDM_CONCURRENT_DATA_PLANE") != nullptr;
+    return concurrent;
+  }
+
+  static Lane queueOf(Lane lane) {
+    return lane == DATA ? DATA : CONTROL;
+  }
+
+  bool& busy(Lane lane) {
+    return m_busy[concurrent() ? queueOf(lane) : CONTROL];
+  }
+
+  bool dataMayGo(Waiter* data) {
+    return data != nullptr && !m_queues[CONTROL].orderedBefore(data->seq);
+  }
+
+  // Lets in whatever may go now that a call has left or arrived
+  void admit() {
+
+    auto& control = m_queues[CONTROL];
+    auto& data    = m_queues[DATA];
+
+    if (concurrent()) {
+      if (!m_busy[CONTROL] && control.front() != nullptr) {
+        control.wakeFront();
+        m_busy[CONTROL] = true;
+      }
+      if (!m_busy[DATA] && dataMayGo(data.front())) {
+        data.wakeFront();
+        m_busy[DATA] = true;
+      }
+      return;
+    }
+
+    if (m_busy[CONTROL]) {
+      return;
+    }
+
+    bool control_waiting = control.front() != nullptr;
+    if (dataMayGo(data.front()) && (!control_waiting || m_data_burst < DATA_PLANE_BURST)) {
+      data.wakeFront();
+      m_data_burst = control_waiting ? m_data_burst + 1 : 0;
+      m_busy[CONTROL] = true;
+    } else if (control_waiting) {
+      control.wakeFront();
+      m_data_burst = 0;
+      m_busy[CONTROL] = true;
+    }
+  }
+
+  kj::Promise<void> enter(Lane lane) {
+    auto seq = m_next_seq++;
+    if (!busy(lane) && m_queues[CONTROL].front() == nullptr && m_queues[DATA].front() == nullptr) {
+      busy(lane) = true;
+      return kj::READY_NOW;
+    }
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    m_queues[queueOf(lane)].waiting.add(Waiter { seq, lane == CONTROL, kj::mv(paf.fulfiller) });
+    admit();
+    return kj::mv(paf.promise);
+  }
+
+  void leave(Lane lane) {
+    busy(lane) = false;
+    admit();
+  }
+
+public:
+
+  // No call inside, none waiting
+  bool idle() {
+    return !m_busy[CONTROL] && !m_busy[DATA] && m_queues[CONTROL].front() == nullptr && m_queues[DATA].front() == nullptr;
+  }
+
+  template <typename Func>
+  kj::Promise<void> run(Lane lane, Func&& func) {
+    return enter(lane).then([this, lane, func = kj::fwd<Func>(func)]() mutable {
+      return start_fiber(kj::mv(func)).then([this, lane]() {
+        leave(lane);
+      }, [this, lane](kj::Exception&& exception) {
+        leave(lane);
+        kj::throwFatalException(kj::mv(exception));
+      });
+    });
+  }
+};
+
+// decrypt and decode requests received, watched by the busy-poll loop in main()
+static uint64_t data_plane_calls = 0;
+
+// size hints so that hot-path results fit into the first segment of the response message
+static const capnp::MessageSize DECRYPT_RESULTS_SIZE = {
+  capnp::sizeInWords<CdmProxy::DecryptResults>() + capnp::sizeInWords<DecryptedBlock>() + capnp::sizeInWords<Buffer>(), 0
+};
+
+static const capnp::MessageSize DECRYPT_AND_DECODE_FRAME_RESULTS_SIZE = {
+  capnp::sizeInWords<CdmProxy::DecryptAndDecodeFrameResults>() + capnp::sizeInWords<VideoFrame>() +
+    capnp::sizeInWords<VideoFrameSize>() + capnp::sizeInWords<Buffer>(), 0
+};
+
+class HostWrapper;
+static void destroy_instance(cdm::ContentDecryptionModule_10* cdm, kj::Own<BufferPool> pool, HostWrapper* host);
+
 class CdmProxyImpl final: public CdmProxy::Server {
 
   cdm::ContentDecryptionModule_10* m_cdm;
   kj::AutoCloseFd m_memfd;
-  XAlloc m_allocator;
+  kj::Own<BufferPool> m_pool;
+  cdm::Buffer* m_returned = nullptr; // last result, read by the shim until it makes its next call
   void* m_encrypted_buffers;
+  ArenaControl* m_control;
+  CallGate& m_gate;
+  HostWrapper* m_host;
+  kj::HashMap<uint32_t, kj::Own<MappedRegion>> m_regions;
+  uint32_t m_next_region_id = 1;
+  kj::Own<CallCounters> m_counters = CallCounters::create(); // nullptr unless FCDM_COUNTERS is set
+  uint64_t m_data_calls = 0; // decrypts and decodes received
+  uint64_t m_idle_seen = 0;  // m_data_calls at the last idle check, see releaseIfIdle()
+  bool m_released = false;   // arenas given back since the last decrypt or decode
+
+  static kj::Vector<CdmProxyImpl*> s_instances;
+  static bool                      s_release_unsupported;
+
+  void recycleReturned() {
+    if (m_returned != nullptr) {
+      m_returned->Destroy();
+      m_returned = nullptr;
+    }
+  }
+
+  // Keeps a result buffer until the shim is done with it, failed calls don't need theirs
+  void keepReturned(cdm::Buffer* buffer, cdm::Status status) {
+    if (buffer == nullptr) {
+      return;
+    }
+    if (status == cdm::kSuccess) {
+      m_returned = buffer;
+    } else {
+      buffer->Destroy();
+    }
+  }
+
+  cdm::InputBuffer_2* getInputBuffer(uint32_t offset, uint32_t region_id) {
+
+    auto arena = reinterpret_cast<uint8_t*>(m_encrypted_buffers);
+    if (region_id == 0) {
+      return get_input_buffer_and_fix_pointers(arena, arena, offset);
+    }
+
+    KJ_IF_MAYBE(region, m_regions.find(region_id)) {
+      auto buffer = get_input_buffer_and_fix_pointers(arena, (*region)->begin(), offset);
+      KJ_REQUIRE((*region)->contains(buffer->data, buffer->data_size), "sample outside of its region", region_id);
+      return buffer;
+    }
+    KJ_FAIL_REQUIRE("unknown region", region_id);
+  }
 
 public:
 
+  // Gives the pages of both arenas back to the kernel, in the shim's mapping as well. They come back zeroed on
+  // the next touch. Returns false if the shim is using them right now.
+  bool releaseArenas() {
+
+    if (s_release_unsupported) {
+      return true;
+    }
+
+    if (!m_control->tryLock()) {
+      return false;
+    }
+    KJ_DEFER(m_control->unlock());
+
+    long page_size;
+    KJ_SYSCALL(page_size = sysconf(_SC_PAGESIZE));
+
+    // the shim is between calls, so it's done with the last result
+    recycleReturned();
+
+    // the control page between the arenas stays, and so does the decrypted arena while the host holds frames in it
+    // or the CDM keeps buffers of its own
+    bool keep_decrypted = m_control->anyHeld() || m_pool->live() > 0;
+    if (!keep_decrypted) {
+      m_pool->reset();
+    }
+
+    if (fallocate(m_memfd.get(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, SHMEM_ARENA_SIZE) == 0 &&
+        (keep_decrypted || fallocate(m_memfd.get(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, SHMEM_ARENA_SIZE + page_size, SHMEM_ARENA_SIZE) == 0)) {
+      if (!keep_decrypted) {
+        m_pool->arena().shrink();
+      }
+      return true;
+    }
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
+      KJ_FAIL_SYSCALL("fallocate", errno);
+    }
+
+    if (madvise(m_encrypted_buffers, SHMEM_ARENA_SIZE, MADV_REMOVE) == 0 && (keep_decrypted || m_pool->arena().release())) {
+      return true;
+    }
+
+    KJ_LOG(WARNING, "unable to release arenas, not trying again", strerror(errno));
+    s_release_unsupported = true;
+    return true;
+  }
+
+  // Called once every idle period. Gives back the arenas of this instance once no decrypt or decode came in for a
+  // whole period and no call is inside, whatever the other instances of the worker are doing.
+  void releaseIfIdle() {
+    if (m_data_calls != m_idle_seen || !m_gate.idle()) {
+      m_idle_seen = m_data_calls;
+      m_released  = false;
+      return;
+    }
+    if (!m_released) {
+      KJ_LOG(INFO, "instance idle, releasing its arenas", this);
+      m_released = releaseArenas();
+    }
+  }
+
+  static void releaseIdleArenas() {
+    for (auto instance: s_instances) {
+      instance->releaseIfIdle();
+    }
+  }
+
   kj::Maybe<int> getFd() override {
     return m_memfd.get();
   }
 
+  kj::Promise<void> getStatusForPolicy(GetStatusForPolicyContext context) override {
+    return m_gate.run(CallGate::BACKGROUND, [context, this](kj::WaitScope& scope) mutable {
+      KJ_DLOG(INFO, "getStatusForPolicy");
+      set_host_context(&scope, m_pool.get());
+      cdm::Policy policy;
+      policy.min_hdcp_version = static_cast<cdm::HdcpVersion>(context.getParams().getMinHdcpVersion());
+      m_cdm->GetStatusForPolicy(context.getParams().getPromiseId(), policy);
+      clear_host_context();
+      KJ_DLOG(INFO, "exiting getStatusForPolicy");
+    });
+  }
+
   kj::Promise<void> initialize(InitializeContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    return m_gate.run(CallGate::CONTROL, [context, this](kj::WaitScope& scope) mutable {
       KJ_DLOG(INFO, "initialize");
-      set_host_context(&scope, &m_allocator);
+      set_host_context(&scope, m_pool.get());
       auto allow_distinctive_identifier = context.getParams().getAllowDistinctiveIdentifier();
       auto allow_persistent_state       = context.getParams().getAllowPersistentState();
       auto use_hw_secure_codecs         = context.getParams().getUseHwSecureCodecs();
@@ -224,9 +713,9 @@ public:
   }
 
   kj::Promise<void> setServerCertificate(SetServerCertificateContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    return m_gate.run(CallGate::CONTROL, [context, this](kj::WaitScope& scope) mutable {
       KJ_DLOG(INFO, "setServerCertificate");
-      set_host_context(&scope, &m_allocator);
+      set_host_context(&scope, m_pool.get());
       auto promise_id              = context.getParams().getPromiseId();
       auto server_certificate_data = context.getParams().getServerCertificateData();
       m_cdm->SetServerCertificate(promise_id, server_certificate_data.begin(), server_certificate_data.size());
@@ -236,9 +725,9 @@ public:
   }
 
   kj::Promise<void> createSessionAndGenerateRequest(CreateSessionAndGenerateRequestContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    return m_gate.run(CallGate::CONTROL, [context, this](kj::WaitScope& scope) mutable {
       KJ_DLOG(INFO, "createSessionAndGenerateRequest");
-      set_host_context(&scope, &m_allocator);
+      set_host_context(&scope, m_pool.get());
       auto promise_id     = context.getParams().getPromiseId();
       auto session_type   = context.getParams().getSessionType();
       auto init_data_type = context.getParams().getInitDataType();
@@ -249,10 +738,23 @@ public:
     });
   }
 
+  kj::Promise<void> loadSession(LoadSessionContext context) override {
+    return m_gate.run(CallGate::CONTROL, [context, this](kj::WaitScope& scope) mutable {
+      KJ_DLOG(INFO, "loadSession");
+      set_host_context(&scope, m_pool.get());
+      auto promise_id   = context.getParams().getPromiseId();
+      auto session_type = context.getParams().getSessionType();
+      auto session_id   = context.getParams().getSessionId();
+      m_cdm->LoadSession(promise_id, static_cast<cdm::SessionType>(session_type), session_id.begin(), session_id.size());
+      clear_host_context();
+      KJ_DLOG(INFO, "exiting loadSession");
+    });
+  }
+
   kj::Promise<void> updateSession(UpdateSessionContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    return m_gate.run(CallGate::CONTROL, [context, this](kj::WaitScope& scope) mutable {
       KJ_DLOG(INFO, "updateSession");
-      set_host_context(&scope, &m_allocator);
+      set_host_context(&scope, m_pool.get());
       auto promise_id = context.getParams().getPromiseId();
       auto session_id = context.getParams().getSessionId();
       auto response   = context.getParams().getResponse();
@@ -263,9 +765,9 @@ public:
   }
 
   kj::Promise<void> closeSession(CloseSessionContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    return m_gate.run(CallGate::CONTROL, [context, this](kj::WaitScope& scope) mutable {
       KJ_DLOG(INFO, "closeSession");
-      set_host_context(&scope, &m_allocator);
+      set_host_context(&scope, m_pool.get());
       auto promise_id = context.getParams().getPromiseId();
       auto session_id = context.getParams().getSessionId();
       m_cdm->CloseSession(promise_id, session_id.begin(), session_id.size());
@@ -274,10 +776,22 @@ public:
     });
   }
 
+  kj::Promise<void> removeSession(RemoveSessionContext context) override {
+    return m_gate.run(CallGate::CONTROL, [context, this](kj::WaitScope& scope) mutable {
+      KJ_DLOG(INFO, "removeSession");
+      set_host_context(&scope, m_pool.get());
+      auto promise_id = context.getParams().getPromiseId();
+      auto session_id = context.getParams().getSessionId();
+      m_cdm->RemoveSession(promise_id, session_id.begin(), session_id.size());
+      clear_host_context();
+      KJ_DLOG(INFO, "exiting removeSession");
+    });
+  }
+
   kj::Promise<void> timerExpired(TimerExpiredContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    return m_gate.run(CallGate::BACKGROUND, [context, this](kj::WaitScope& scope) mutable {
       KJ_DLOG(INFO, "timerExpired");
-      set_host_context(&scope, &m_allocator);
+      set_host_context(&scope, m_pool.get());
       auto context_ = reinterpret_cast<void*>(context.getParams().getContext());
       m_cdm->TimerExpired(context_);
       clear_host_context();
@@ -286,30 +800,31 @@ public:
   }
 
   kj::Promise<void> decrypt(DecryptContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    data_plane_calls++;
+    m_data_calls++;
+    return m_gate.run(CallGate::DATA, [context, this](kj::WaitScope& scope) mutable {
       KJ_DLOG(INFO, "decrypt");
-      set_host_context(&scope, &m_allocator);
+      CallCounters::Scope counting(m_counters.get(), CDM_PROXY_DECRYPT);
+      auto encrypted_buffer = getInputBuffer(context.getParams().getEncryptedBufferOffset(), context.getParams().getDataRegion());
 
-      auto encrypted_buffer = get_input_buffer_and_fix_pointers(
-        reinterpret_cast<uint8_t*>(m_encrypted_buffers), context.getParams().getEncryptedBufferOffset());
+      set_host_context(&scope, m_pool.get());
+      auto results = context.initResults(DECRYPT_RESULTS_SIZE);
 
-      m_allocator.forget();
+      recycleReturned();
 
       XDecryptedBlock block;
       cdm::Status status = m_cdm->Decrypt(*encrypted_buffer, static_cast<cdm::DecryptedBlock*>(&block));
 
       if (status == cdm::kSuccess) {
-        auto target = context.getResults().getDecryptedBuffer();
-        target.getBuffer().setOffset(m_allocator.getOffset(block.DecryptedBuffer()->Data()));
+        auto target = results.getDecryptedBuffer();
+        target.getBuffer().setOffset(m_pool->arena().getOffset(block.DecryptedBuffer()->Data()));
         target.getBuffer().setSize(block.DecryptedBuffer()->Size());
         target.setTimestamp(block.Timestamp());
       }
 
-      if (block.DecryptedBuffer() != nullptr) {
-        block.DecryptedBuffer()->Destroy();
-      }
+      keepReturned(block.DecryptedBuffer(), status);
 
-      context.getResults().setStatus(status);
+      results.setStatus(status);
 
       clear_host_context();
       KJ_DLOG(INFO, "exiting decrypt");
@@ -317,9 +832,9 @@ public:
   }
 
   kj::Promise<void> initializeVideoDecoder(InitializeVideoDecoderContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    return m_gate.run(CallGate::CONTROL, [context, this](kj::WaitScope& scope) mutable {
       KJ_DLOG(INFO, "initializeVideoDecoder");
-      set_host_context(&scope, &m_allocator);
+      set_host_context(&scope, m_pool.get());
       cdm::VideoDecoderConfig_2 video_decoder_config;
       video_decoder_config.codec             = static_cast<cdm::VideoCodec>(context.getParams().getVideoDecoderConfig().getCodec());
       video_decoder_config.profile           = static_cast<cdm::VideoCodecProfile>(context.getParams().getVideoDecoderConfig().getProfile());
@@ -340,9 +855,9 @@ public:
   }
 
   kj::Promise<void> deinitializeDecoder(DeinitializeDecoderContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    return m_gate.run(CallGate::CONTROL, [context, this](kj::WaitScope& scope) mutable {
       KJ_DLOG(INFO, "deinitializeDecoder");
-      set_host_context(&scope, &m_allocator);
+      set_host_context(&scope, m_pool.get());
       auto decoder_type = static_cast<cdm::StreamType>(context.getParams().getDecoderType());
       m_cdm->DeinitializeDecoder(decoder_type);
       clear_host_context();
@@ -351,9 +866,9 @@ public:
   }
 
   kj::Promise<void> resetDecoder(ResetDecoderContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    return m_gate.run(CallGate::CONTROL, [context, this](kj::WaitScope& scope) mutable {
       KJ_DLOG(INFO, "resetDecoder");
-      set_host_context(&scope, &m_allocator);
+      set_host_context(&scope, m_pool.get());
       auto decoder_type = static_cast<cdm::StreamType>(context.getParams().getDecoderType());
       m_cdm->ResetDecoder(decoder_type);
       clear_host_context();
@@ -362,25 +877,28 @@ public:
   }
 
   kj::Promise<void> decryptAndDecodeFrame(DecryptAndDecodeFrameContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    data_plane_calls++;
+    m_data_calls++;
+    return m_gate.run(CallGate::DATA, [context, this](kj::WaitScope& scope) mutable {
       KJ_DLOG(INFO, "decryptAndDecodeFrame");
-      set_host_context(&scope, &m_allocator);
+      CallCounters::Scope counting(m_counters.get(), CDM_PROXY_DECRYPT_AND_DECODE_FRAME);
+      auto encrypted_buffer = getInputBuffer(context.getParams().getEncryptedBufferOffset(), context.getParams().getDataRegion());
 
-      auto encrypted_buffer = get_input_buffer_and_fix_pointers(
-        reinterpret_cast<uint8_t*>(m_encrypted_buffers), context.getParams().getEncryptedBufferOffset());
+      set_host_context(&scope, m_pool.get());
+      auto results = context.initResults(DECRYPT_AND_DECODE_FRAME_RESULTS_SIZE);
 
-      m_allocator.forget();
+      recycleReturned();
 
       XVideoFrame frame;
       cdm::Status status = m_cdm->DecryptAndDecodeFrame(*encrypted_buffer, static_cast<cdm::VideoFrame*>(&frame));
 
       if (status == cdm::kSuccess) {
-        auto target = context.getResults().getVideoFrame();
+        auto target = results.getVideoFrame();
         target.setFormat(frame.Format());
         target.getSize().setWidth (frame.Size().width);
         target.getSize().setHeight(frame.Size().height);
 
-        target.getFrameBuffer().setOffset(m_allocator.getOffset(frame.FrameBuffer()->Data()));
+        target.getFrameBuffer().setOffset(m_pool->arena().getOffset(frame.FrameBuffer()->Data()));
         target.getFrameBuffer().setSize(frame.FrameBuffer()->Size());
 
         target.setKYPlaneOffset(frame.PlaneOffset(cdm::kYPlane));
@@ -392,11 +910,9 @@ public:
         target.setTimestamp(frame.Timestamp());
       }
 
-      if (frame.FrameBuffer() != nullptr) {
-        frame.FrameBuffer()->Destroy();
-      }
+      keepReturned(frame.FrameBuffer(), status);
 
-      context.getResults().setStatus(status);
+      results.setStatus(status);
 
       clear_host_context();
       KJ_DLOG(INFO, "exiting decryptAndDecodeFrame");
@@ -404,9 +920,9 @@ public:
   }
 
   kj::Promise<void> onQueryOutputProtectionStatus(OnQueryOutputProtectionStatusContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    return m_gate.run(CallGate::BACKGROUND, [context, this](kj::WaitScope& scope) mutable {
       KJ_DLOG(INFO, "onQueryOutputProtectionStatus");
-      set_host_context(&scope, &m_allocator);
+      set_host_context(&scope, m_pool.get());
       auto result                 = context.getParams().getResult();
       auto link_mask              = context.getParams().getLinkMask();
       auto output_protection_mask = context.getParams().getOutputProtectionMask();
@@ -416,20 +932,548 @@ public:
     });
   }
 
-  CdmProxyImpl(cdm::ContentDecryptionModule_10* cdm, kj::AutoCloseFd memfd, XAlloc allocator, void* encrypted_buffers) :
-    m_cdm(cdm), m_memfd(kj::mv(memfd)), m_allocator(kj::mv(allocator)), m_encrypted_buffers(encrypted_buffers) {}
+  kj::Promise<void> ping(PingContext context) override {
+    return m_gate.run(CallGate::DATA, [](kj::WaitScope&) {
+      KJ_DLOG(INFO, "ping");
+    });
+  }
+
+  kj::Promise<void> registerRegion(RegisterRegionContext context) override {
+    KJ_DLOG(INFO, "registerRegion");
+    return context.getParams().getRegion().getFd().then([context, this](kj::Maybe<int> fd) mutable {
+      // the fd goes with the capability, the mapping stays
+      auto id = m_next_region_id++;
+      m_regions.insert(id, kj::heap<MappedRegion>(KJ_REQUIRE_NONNULL(fd, "region sent without its fd")));
+      context.getResults().setId(id);
+      KJ_DLOG(INFO, "exiting registerRegion", id);
+    });
+  }
+
+  kj::Promise<void> unregisterRegion(UnregisterRegionContext context) override {
+    // goes after the decrypts and decodes sent before it, which may still use the region
+    return m_gate.run(CallGate::DATA, [context, this](kj::WaitScope&) mutable {
+      KJ_DLOG(INFO, "unregisterRegion");
+      m_regions.erase(context.getParams().getId());
+      KJ_DLOG(INFO, "exiting unregisterRegion");
+    });
+  }
+
+  kj::Promise<void> getCounters(GetCountersContext context) override {
+    KJ_DLOG(INFO, "getCounters");
+    auto results = context.getResults();
+    if (m_counters.get() == nullptr) {
+      return kj::READY_NOW;
+    }
+
+    struct Entry {
+      uint16_t      method;
+      uint64_t      calls;
+      CounterValues sums;
+    };
+    kj::Vector<Entry> entries;
+    m_counters->forEach([&](uint16_t method, uint64_t calls, const CounterValues& sums) {
+      entries.add(Entry { method, calls, sums });
+    });
+
+    results.setAvailable(CallCounters::available());
+    auto counters = results.initCounters(entries.size());
+    for (uint32_t i = 0; i < entries.size(); i++) {
+      counters[i].setMethod(entries[i].method);
+      counters[i].setCalls(entries[i].calls);
+      auto values = counters[i].initValues(COUNTER_COUNT);
+      for (uint32_t j = 0; j < COUNTER_COUNT; j++) {
+        values.set(j, entries[i].sums.values[j]);
+      }
+    }
+    KJ_DLOG(INFO, "exiting getCounters");
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> readFile(ReadFileContext context) override;
+
+  CdmProxyImpl(cdm::ContentDecryptionModule_10* cdm, kj::AutoCloseFd memfd, kj::Own<BufferPool> pool, void* encrypted_buffers, HostWrapper* host);
+
+  ~CdmProxyImpl() {
+    recycleReturned();
+    m_regions.clear();
+    m_pool->arena().setControl(nullptr);
+    destroy_instance(m_cdm, kj::mv(m_pool), m_host);
+    unmap_arena_control(m_control);
+    KJ_SYSCALL(munmap(m_encrypted_buffers, SHMEM_ARENA_SIZE));
+    for (size_t i = 0; i < s_instances.size(); i++) {
+      if (s_instances[i] == this) {
+        s_instances[i] = s_instances.back();
+        s_instances.removeLast();
+        break;
+      }
+    }
+  }
+};
+
+kj::Vector<CdmProxyImpl*> CdmProxyImpl::s_instances;
+bool                      CdmProxyImpl::s_release_unsupported = false;
+
+static int64_t get_idle_seconds() {
+  char* idle_seconds = getenv("FCDM_IDLE_SECONDS");
+  return idle_seconds != nullptr ? strtoll(idle_seconds, nullptr, 10) : IDLE_SECONDS;
+}
+
+// Releases what idle instances keep resident, every period. Each instance gives back its shared arenas on its own,
+// see CdmProxyImpl::releaseIfIdle(). The recycled fiber stacks and free heap belong to the whole worker, so they go
+// once none of its instances had a decrypt or decode for a whole period. Everything is repopulated on demand by the
+// next call.
+static kj::Promise<void> reclaim_when_idle(kj::Timer& timer, kj::Duration period, uint64_t seen, bool trimmed) {
+  return timer.afterDelay(period).then([&timer, period, seen, trimmed]() mutable {
+
+    CdmProxyImpl::releaseIdleArenas();
+
+    // a fiber waiting on the host keeps its stack and the pool it came from, so wait for it to finish
+    if (data_plane_calls != seen) {
+      trimmed = false;
+    } else if (!trimmed && active_fibers == 0) {
+      KJ_LOG(INFO, "idle, releasing fiber stacks and free heap");
+      fiber_pool = kj::heap<kj::FiberPool>(FIBER_STACK_SIZE);
+      malloc_trim(0);
+      trimmed = true;
+    }
+
+    return reclaim_when_idle(timer, period, data_plane_calls, trimmed);
+  });
+}
+
+// Persistent storage for cdm::FileIO, one per instance, over the directory of its key system under FCDM_STORAGE_PATH
+// (and the uid and scope of daemon clients, see open_file_store()). Reads map files straight from disk and writes are
+// kept in memory and written back in batches by a background thread, so the CDM never waits for the disk.
+//
+// Other instances may use the same directory, in this worker or in others. Each file has a lock file next to it,
+// held from the time the CDM opens the file until it is closed and its writes are persisted, and temporaries get
+// names of their own.
+class FileStore {
+
+  class Contents: public kj::AtomicRefcounted {
+  public:
+    kj::Array<uint8_t> data;
+    Contents(kj::Array<uint8_t> data) : data(kj::mv(data)) {}
+  };
+
+  struct File {
+    kj::Maybe<kj::Own<const Contents>> pending; // written but not persisted yet
+    kj::AutoCloseFd                    lock;    // flock()ed, released with the entry
+    bool dirty  = false;
+    bool opened = false;
+  };
+
+  struct State {
+    kj::HashMap<kj::String, File> files;
+    bool dirty    = false;
+    bool stopping = false;
+  };
+
+  static kj::Vector<FileStore*> s_stores;
+
+  kj::String              m_path;
+  kj::AutoCloseFd         m_dir;
+  kj::MutexGuarded<State> m_state;
+  kj::Own<kj::Thread>     m_flusher;
+
+  void writeFile(kj::StringPtr name, kj::ArrayPtr<const uint8_t> data) {
+
+    if (data.size() == 0) {
+      if (unlinkat(m_dir.get(), name.cStr(), 0) < 0 && errno != ENOENT) {
+        KJ_FAIL_SYSCALL("unlinkat", errno, name);
+      }
+      return;
+    }
+
+    // names starting with '_' are ours, see is_valid_file_name()
+    auto tmp_path = kj::str(m_path, "/_", name, ".XXXXXX");
+
+    int fd;
+    KJ_SYSCALL(fd = mkostemp(tmp_path.begin(), O_CLOEXEC), tmp_path);
+    kj::AutoCloseFd file(fd);
+
+    auto tmp_name = tmp_path.slice(m_path.size() + 1);
+    KJ_ON_SCOPE_FAILURE(unlinkat(m_dir.get(), tmp_name.cStr(), 0));
+
+    kj::FdOutputStream(file.get()).write(data.begin(), data.size());
+    KJ_SYSCALL(fdatasync(file.get()), tmp_name);
+    KJ_SYSCALL(renameat(m_dir.get(), tmp_name.cStr(), m_dir.get(), name.cStr()), name);
+  }
+
+  void flush() {
+
+    struct Pending {
+      kj::String              name;
+      kj::Own<const Contents> contents;
+    };
+
+    kj::Vector<Pending> batch;
+    {
+      auto lock = m_state.lockExclusive();
+      for (auto& entry: lock->files) {
+        KJ_IF_MAYBE(contents, entry.value.pending) {
+          if (entry.value.dirty) {
+            batch.add(Pending { .name = kj::str(entry.key), .contents = kj::atomicAddRef(**contents) });
+            entry.value.dirty = false;
+          }
+        }
+      }
+      lock->dirty = false;
+    }
+
+    if (batch.empty()) {
+      return;
+    }
+
+    KJ_DLOG(INFO, "flushing file store", batch.size());
+
+    for (auto& pending: batch) {
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        writeFile(pending.name, pending.contents->data);
+      })) {
+        KJ_LOG(ERROR, "unable to persist file", pending.name, *exception);
+      }
+    }
+
+    // one directory sync covers all renames of the batch
+    if (fsync(m_dir.get()) < 0) {
+      KJ_LOG(ERROR, "fsync", strerror(errno));
+    }
+
+    auto lock = m_state.lockExclusive();
+    for (auto& pending: batch) {
+      KJ_IF_MAYBE(file, lock->files.find(pending.name)) {
+        KJ_IF_MAYBE(contents, file->pending) {
+          // a newer write that came in meanwhile stays pending
+          if (contents->get() == pending.contents.get()) {
+            file->pending = nullptr;
+          }
+        }
+        if (!file->opened && file->pending == nullptr) {
+          lock->files.erase(pending.name);
+        }
+      }
+    }
+  }
+
+  void flushLoop() {
+    for (;;) {
+      bool stopping = m_state.when(
+        [](const State& state) { return state.dirty || state.stopping; },
+        [](State& state) { return state.stopping; });
+      if (!stopping) {
+        // let further writes join this batch
+        usleep(WRITE_BEHIND_DELAY_MS * 1000);
+      }
+      flush();
+      if (stopping) {
+        return;
+      }
+    }
+  }
+
+public:
+
+  // Returns false if the file is open here or in another instance, or its writes there aren't persisted yet
+  bool open(kj::StringPtr name) {
+    auto lock = m_state.lockExclusive();
+    auto& file = lock->files.findOrCreate(name, [&]() {
+      return kj::HashMap<kj::String, File>::Entry { kj::str(name), File() };
+    });
+    if (file.opened) {
+      return false;
+    }
+
+    if (file.lock == nullptr) {
+      auto            lock_name = kj::str("_", name, ".lock");
+      int             fd        = openat(m_dir.get(), lock_name.cStr(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+      kj::AutoCloseFd lock_file(fd);
+      if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno != EWOULDBLOCK) {
+          KJ_LOG(ERROR, "unable to lock file", lock_name, strerror(errno));
+        }
+        // a new entry, nothing pending in it
+        lock->files.erase(name);
+        return false;
+      }
+      file.lock = kj::mv(lock_file);
+    }
+
+    file.opened = true;
+    return true;
+  }
+
+  void close(kj::StringPtr name) {
+    auto lock = m_state.lockExclusive();
+    KJ_IF_MAYBE(file, lock->files.find(name)) {
+      file->opened = false;
+      if (file->pending == nullptr) {
+        lock->files.erase(name);
+      }
+    }
+  }
+
+  // Calls `func` with the current contents of the file, which are only valid for the duration of the call.
+  // A file that doesn't exist reads as empty.
+  bool read(kj::StringPtr name, kj::FunctionParam<void(kj::ArrayPtr<const uint8_t>)> func) {
+
+    kj::Maybe<kj::Own<const Contents>> pending;
+    {
+      auto lock = m_state.lockExclusive();
+      KJ_IF_MAYBE(file, lock->files.find(name)) {
+        KJ_IF_MAYBE(contents, file->pending) {
+          pending = kj::atomicAddRef(**contents);
+        }
+      }
+    }
+
+    KJ_IF_MAYBE(contents, pending) {
+      func((*contents)->data);
+      return true;
+    }
+
+    int fd = openat(m_dir.get(), name.cStr(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      if (errno == ENOENT) {
+        func(nullptr);
+        return true;
+      }
+      KJ_LOG(ERROR, "openat", name, strerror(errno));
+      return false;
+    }
+    kj::AutoCloseFd file(fd);
+
+    struct stat st;
+    KJ_SYSCALL(fstat(file.get(), &st));
+    if (st.st_size == 0) {
+      func(nullptr);
+      return true;
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, file.get(), 0);
+    if (data == MAP_FAILED) {
+      KJ_LOG(ERROR, "mmap", name, strerror(errno));
+      return false;
+    }
+    KJ_DEFER(KJ_SYSCALL(munmap(data, st.st_size)));
+
+    func(kj::arrayPtr(reinterpret_cast<const uint8_t*>(data), st.st_size));
+    return true;
+  }
+
+  void write(kj::StringPtr name, kj::ArrayPtr<const uint8_t> data) {
+    auto contents = kj::atomicRefcounted<Contents>(kj::heapArray(data));
+    auto lock = m_state.lockExclusive();
+    auto& file = lock->files.findOrCreate(name, [&]() {
+      return kj::HashMap<kj::String, File>::Entry { kj::str(name), File() };
+    });
+    file.pending = kj::Own<const Contents>(kj::mv(contents));
+    file.dirty   = true;
+    lock->dirty  = true;
+  }
+
+  // Persists everything that is still pending and stops the write-behind thread.
+  void shutdown() {
+    if (m_flusher.get() != nullptr) {
+      m_state.lockExclusive()->stopping = true;
+      m_flusher = nullptr;
+    }
+  }
+
+  static void shutdownAll() {
+    for (auto store: s_stores) {
+      store->shutdown();
+    }
+  }
+
+  FileStore(kj::String path, kj::AutoCloseFd dir) : m_path(kj::mv(path)), m_dir(kj::mv(dir)) {
+    m_flusher = kj::heap<kj::Thread>([this]() { flushLoop(); });
+    s_stores.add(this);
+  }
+
+  ~FileStore() noexcept {
+    shutdown();
+    for (size_t i = 0; i < s_stores.size(); i++) {
+      if (s_stores[i] == this) {
+        s_stores[i] = s_stores.back();
+        s_stores.removeLast();
+        break;
+      }
+    }
+  }
 
-  ~CdmProxyImpl() {}
+  KJ_DISALLOW_COPY(FileStore);
 };
 
-class HostWrapper: public cdm::Host_10 {
+kj::Vector<FileStore*> FileStore::s_stores;
+
+// A storage scope is a relative path of plain names, it can't reach out of the client's directory. Empty if the
+// client didn't name one.
+static bool valid_storage_scope(kj::StringPtr scope) {
+  if (scope.size() == 0) {
+    return true;
+  }
+  size_t length    = 0;
+  bool   dots_only = true;
+  for (char c: scope) {
+    if (c == '/') {
+      if (length == 0 || dots_only) {
+        return false;
+      }
+      length    = 0;
+      dots_only = true;
+      continue;
+    }
+    if (!isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '_' && c != '-') {
+      return false;
+    }
+    dots_only = dots_only && c == '.';
+    length++;
+  }
+  return length > 0 && !dots_only;
+}
+
+// The daemon keeps the files of each client apart, under a directory named after its uid and the storage scope it
+// sent, see Daemon::readScope(). Clients that didn't send one get no storage.
+static kj::Own<FileStore> open_file_store(kj::StringPtr key_system, kj::Maybe<uid_t> client, kj::StringPtr scope) {
+
+  char* storage_path = getenv("FCDM_STORAGE_PATH");
+  if (storage_path == nullptr) {
+    KJ_LOG(WARNING, "FCDM_STORAGE_PATH is not set, the CDM won't be able to persist anything");
+    return nullptr;
+  }
+
+  KJ_REQUIRE(key_system.size() > 0 && key_system[0] != '.' && key_system.findFirst('/') == nullptr, "bad key system", key_system);
+
+  auto path = kj::str(storage_path, "/", key_system);
+  KJ_IF_MAYBE(uid, client) {
+    if (scope.size() == 0) {
+      KJ_LOG(WARNING, "the client has no FCDM_STORAGE_SCOPE, the CDM won't be able to persist anything", *uid);
+      return nullptr;
+    }
+    KJ_REQUIRE(valid_storage_scope(scope), "bad storage scope", scope);
+    path = kj::str(storage_path, "/", *uid, "/", scope, "/", key_system);
+  }
+
+  // the storage path and every directory below it
+  for (size_t end = strlen(storage_path); end <= path.size(); end++) {
+    if (end == path.size() || path[end] == '/') {
+      auto dir = kj::heapString(path.begin(), end);
+      if (mkdir(dir.cStr(), 0700) < 0 && errno != EEXIST) {
+        KJ_FAIL_SYSCALL("mkdir", errno, dir);
+      }
+    }
+  }
+
+  int fd;
+  KJ_SYSCALL(fd = open(path.cStr(), O_RDONLY | O_DIRECTORY | O_CLOEXEC), path);
+
+  KJ_LOG(INFO, "using file store", path);
+  return kj::heap<FileStore>(kj::mv(path), kj::AutoCloseFd(fd));
+}
+
+class XFileIO;
+
+class HostWrapper: public cdm::Host_10, private kj::TaskSet::ErrorHandler {
 
-  HostProxy::Client m_host;
+  HostProxy::Client     m_host;
+  kj::Own<FileStore>    m_store;
+  bool                  m_shard; // reads its files through m_host instead, see CdmProxyImpl::readFile()
+  BufferPool*           m_arena = nullptr;
+  CallGate              m_gate;
+  kj::HashSet<XFileIO*> m_files;  // the ones the CDM hasn't closed yet
+  kj::TaskSet           m_posted; // last, so that the callbacks still queued go first
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(FATAL, exception);
+    exit(EXIT_FAILURE);
+  }
 
 public:
 
+  CallGate& GetCallGate() {
+    return m_gate;
+  }
+
+  void SetArena(BufferPool* arena) {
+    m_arena = arena;
+  }
+
+  // nullptr for shards
+  FileStore* GetFileStore() {
+    return m_store.get();
+  }
+
+  bool HasStorage() {
+    return m_store.get() != nullptr || m_shard;
+  }
+
+  // Runs `callback` on its own fiber once the current call has returned. This is how the CDM expects asynchronous
+  // notifications such as FileIOClient completions to arrive.
+  // Callbacks still queued when the instance is destroyed are dropped along with it.
+  void Post(kj::Function<void()> callback) {
+    m_posted.add(kj::evalLater([this, callback = kj::mv(callback)]() mutable {
+      return m_gate.run(CallGate::BACKGROUND, [this, callback = kj::mv(callback)](kj::WaitScope& scope) mutable {
+        set_host_context(&scope, m_arena);
+        callback();
+        clear_host_context();
+      });
+    }));
+  }
+
+  // Hands the contents of `name` to `callback` the way Post() does, or success = false if they can't be read.
+  // A file that doesn't exist reads as empty.
+  void ReadFile(kj::StringPtr name, kj::Function<void(bool, kj::ArrayPtr<const uint8_t>)> callback) {
+
+    if (!m_shard) {
+      Post([this, name = kj::heapString(name), callback = kj::mv(callback)]() mutable {
+        bool success = m_store->read(name, [&](kj::ArrayPtr<const uint8_t> data) {
+          callback(true, data);
+        });
+        if (!success) {
+          callback(false, nullptr);
+        }
+      });
+      return;
+    }
+
+    auto request = m_host.readFileRequest();
+    request.setName(name);
+    auto read = request.send().then([](capnp::Response<FileContents>&& response) -> kj::Maybe<kj::Array<uint8_t>> {
+      if (!response.getSuccess()) {
+        return nullptr;
+      }
+      return kj::heapArray<uint8_t>(response.getData());
+    }, [](kj::Exception&& exception) -> kj::Maybe<kj::Array<uint8_t>> {
+      KJ_LOG(ERROR, "unable to read file through the host", exception);
+      return nullptr;
+    });
+    m_posted.add(read.then([this, callback = kj::mv(callback)](kj::Maybe<kj::Array<uint8_t>> contents) mutable {
+      Post([callback = kj::mv(callback), contents = kj::mv(contents)]() mutable {
+        KJ_IF_MAYBE(data, contents) {
+          callback(true, *data);
+        } else {
+          callback(false, nullptr);
+        }
+      });
+    }));
+  }
+
+  void AddFileIO(XFileIO* file) {
+    m_files.insert(file);
+  }
+
+  void RemoveFileIO(XFileIO* file) {
+    m_files.erase(file);
+  }
+
   cdm::Buffer* Allocate(uint32_t capacity) override {
-    return static_cast<cdm::Buffer*>(new XBuffer(capacity, host_ctx.arena->allocate(capacity)));
+    auto buffer = host_ctx.arena->allocate(capacity);
+    if (buffer == nullptr) {
+      // the CDM fails the decrypt or decode, the worker lives on
+      KJ_LOG(WARNING, "decrypted arena is full", capacity);
+    }
+    return buffer;
   }
 
   void SetTimer(int64_t delay_ms, void* context) override {
@@ -437,7 +1481,7 @@ public:
     auto request = m_host.setTimerRequest();
     request.setDelayMs(delay_ms);
     request.setContext(reinterpret_cast<uint64_t>(context));
-    request.send().wait(*host_ctx.scope);
+    wait_host(request.send());
     KJ_DLOG(INFO, "exiting SetTimer");
   }
 
@@ -452,12 +1496,17 @@ public:
     KJ_DLOG(INFO, "OnInitialized", success);
     auto request = m_host.onInitializedRequest();
     request.setSuccess(success);
-    request.send().wait(*host_ctx.scope);
+    wait_host(request.send());
     KJ_DLOG(INFO, "exiting OnInitialized");
   }
 
   void OnResolveKeyStatusPromise(uint32_t promise_id, cdm::KeyStatus key_status) override {
-    KJ_UNIMPLEMENTED("OnResolveKeyStatusPromise");
+    KJ_DLOG(INFO, "OnResolveKeyStatusPromise", promise_id, key_status);
+    auto request = m_host.onResolveKeyStatusPromiseRequest();
+    request.setPromiseId(promise_id);
+    request.setKeyStatus(key_status);
+    wait_host(request.send());
+    KJ_DLOG(INFO, "exiting OnResolveKeyStatusPromise");
   }
 
   void OnResolveNewSessionPromise(uint32_t promise_id, const char* session_id, uint32_t session_id_size) override {
@@ -465,7 +1514,7 @@ public:
     auto request = m_host.onResolveNewSessionPromiseRequest();
     request.setPromiseId(promise_id);
     request.setSessionId(kj::StringPtr(session_id, session_id_size));
-    request.send().wait(*host_ctx.scope);
+    wait_host(request.send());
     KJ_DLOG(INFO, "exiting OnResolveNewSessionPromise");
   }
 
@@ -473,12 +1522,19 @@ public:
     KJ_DLOG(INFO, "OnResolvePromise", promise_id);
     auto request = m_host.onResolvePromiseRequest();
     request.setPromiseId(promise_id);
-    request.send().wait(*host_ctx.scope);
+    wait_host(request.send());
     KJ_DLOG(INFO, "exiting OnResolvePromise");
   }
 
   void OnRejectPromise(uint32_t promise_id, cdm::Exception exception, uint32_t system_code, const char* error_message, uint32_t error_message_size) override {
-    KJ_UNIMPLEMENTED("OnRejectPromise");
+    KJ_DLOG(INFO, "OnRejectPromise", promise_id, exception, system_code, error_message, error_message_size);
+    auto request = m_host.onRejectPromiseRequest();
+    request.setPromiseId(promise_id);
+    request.setException(exception);
+    request.setSystemCode(system_code);
+    request.setErrorMessage(kj::StringPtr(error_message, error_message_size));
+    wait_host(request.send());
+    KJ_DLOG(INFO, "exiting OnRejectPromise");
   }
 
   void OnSessionMessage(const char* session_id, uint32_t session_id_size, cdm::MessageType message_type, const char* message, uint32_t message_size) override {
@@ -487,7 +1543,7 @@ public:
     request.setSessionId(kj::StringPtr(session_id, session_id_size));
     request.setMessageType(message_type);
     request.setMessage(kj::StringPtr(message, message_size));
-    request.send().wait(*host_ctx.scope);
+    wait_host(request.send());
     KJ_DLOG(INFO, "exiting OnSessionMessage");
   }
 
@@ -502,7 +1558,7 @@ public:
       keys_info_builder[i].setStatus(keys_info[i].status);
       keys_info_builder[i].setSystemCode(keys_info[i].system_code);
     }
-    request.send().wait(*host_ctx.scope);
+    wait_host(request.send());
     KJ_DLOG(INFO, "exiting OnSessionKeysChange");
   }
 
@@ -511,7 +1567,7 @@ public:
     auto request = m_host.onExpirationChangeRequest();
     request.setSessionId(kj::StringPtr(session_id, session_id_size));
     request.setNewExpiryTime(new_expiry_time);
-    request.send().wait(*host_ctx.scope);
+    wait_host(request.send());
     KJ_DLOG(INFO, "exiting OnExpirationChange");
   }
 
@@ -519,7 +1575,7 @@ public:
     KJ_DLOG(INFO, "OnSessionClosed", session_id, session_id_size);
     auto request = m_host.onSessionClosedRequest();
     request.setSessionId(kj::StringPtr(session_id, session_id_size));
-    request.send().wait(*host_ctx.scope);
+    wait_host(request.send());
     KJ_DLOG(INFO, "exiting OnSessionClosed");
   }
 
@@ -534,7 +1590,7 @@ public:
   void QueryOutputProtectionStatus() override {
     KJ_DLOG(INFO, "QueryOutputProtectionStatus");
     auto request = m_host.queryOutputProtectionStatusRequest();
-    request.send().wait(*host_ctx.scope);
+    wait_host(request.send());
     KJ_DLOG(INFO, "exiting QueryOutputProtectionStatus");
   }
 
@@ -542,21 +1598,191 @@ public:
     KJ_UNIMPLEMENTED("OnDeferredInitializationDone");
   }
 
-  cdm::FileIO* CreateFileIO(cdm::FileIOClient* client) override {
-    KJ_UNIMPLEMENTED("CreateFileIO");
-  }
+  cdm::FileIO* CreateFileIO(cdm::FileIOClient* client) override;
 
   void RequestStorageId(uint32_t version) override {
     KJ_UNIMPLEMENTED("RequestStorageId");
   }
 
-  HostWrapper(HostProxy::Client&& host) : m_host(host) {}
+  HostWrapper(HostProxy::Client&& host, kj::Own<FileStore> store, bool shard) :
+    m_host(host), m_store(kj::mv(store)), m_shard(shard), m_posted(*this) {}
+
+  ~HostWrapper();
+
+  KJ_DISALLOW_COPY(HostWrapper);
+};
+
+CdmProxyImpl::CdmProxyImpl(cdm::ContentDecryptionModule_10* cdm, kj::AutoCloseFd memfd, kj::Own<BufferPool> pool, void* encrypted_buffers, HostWrapper* host) :
+  m_cdm(cdm), m_memfd(kj::mv(memfd)), m_pool(kj::mv(pool)), m_encrypted_buffers(encrypted_buffers),
+    m_control(map_arena_control(m_memfd.get())), m_gate(host->GetCallGate()), m_host(host) {
+  m_pool->arena().setControl(m_control);
+  s_instances.add(this);
+}
+
+// Destroys a CDM instance once the shim has let go of it. The CDM may call into the host on its way out, so this
+// happens on a fiber of its own, after whatever the instance still has queued on its gate. The host and the
+// decrypted arena go after the CDM, and with the host the callbacks it still had posted and the files the CDM left
+// open, see ~HostWrapper().
+static void destroy_instance(cdm::ContentDecryptionModule_10* cdm, kj::Own<BufferPool> pool, HostWrapper* host) {
+  host->GetCallGate().run(CallGate::CONTROL, [cdm, pool = pool.get()](kj::WaitScope& scope) {
+    KJ_DLOG(INFO, "destroying instance");
+    set_host_context(&scope, pool);
+    cdm->Destroy();
+    clear_host_context();
+  }).attach(kj::mv(pool), kj::defer([host]() { delete host; })).detach([](kj::Exception&& exception) {
+    KJ_LOG(ERROR, "unable to destroy CDM instance", exception);
+  });
+}
+
+static bool is_valid_file_name(kj::StringPtr name) {
+  if (name.size() == 0 || name.size() > 256 || name[0] == '_') {
+    return false;
+  }
+  for (char c: name) {
+    if (!(('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || ('0' <= c && c <= '9') || c == '.' || c == '_' || c == '-')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+class XFileIO: public cdm::FileIO {
+
+  // lets completions that are still queued notice that the FileIO was closed
+  struct Liveness: public kj::Refcounted {
+    bool alive = true;
+  };
+
+  HostWrapper&       m_host;
+  cdm::FileIOClient* m_client;
+  kj::Own<Liveness>  m_liveness;
+  kj::String         m_name;
+  bool               m_opened = false;
+  bool               m_busy   = false;
+
+  void complete(kj::Function<void()> callback) {
+    m_busy = true;
+    m_host.Post([this, liveness = kj::addRef(*m_liveness), callback = kj::mv(callback)]() mutable {
+      if (liveness->alive) {
+        m_busy = false;
+        callback();
+      }
+    });
+  }
+
+public:
+
+  void Open(const char* file_name, uint32_t file_name_size) override {
+    auto name = kj::heapString(file_name, file_name_size);
+    KJ_DLOG(INFO, "FileIO::Open", name);
+
+    auto status = cdm::FileIOClient::Status::kError;
+    if (m_busy) {
+      status = cdm::FileIOClient::Status::kInUse;
+    } else if (!m_opened && m_host.HasStorage() && is_valid_file_name(name)) {
+      // shards only read, and leave keeping writers apart to the instance they shard for
+      if (m_host.GetFileStore() == nullptr || m_host.GetFileStore()->open(name)) {
+        m_name   = kj::mv(name);
+        m_opened = true;
+        status   = cdm::FileIOClient::Status::kSuccess;
+      } else {
+        status = cdm::FileIOClient::Status::kInUse;
+      }
+    }
+
+    complete([this, status]() {
+      m_client->OnOpenComplete(status);
+    });
+  }
+
+  void Read() override {
+    KJ_DLOG(INFO, "FileIO::Read", m_name);
+
+    if (!m_opened || m_busy) {
+      auto status = m_busy ? cdm::FileIOClient::Status::kInUse : cdm::FileIOClient::Status::kError;
+      complete([this, status]() {
+        m_client->OnReadComplete(status, nullptr, 0);
+      });
+      return;
+    }
+
+    m_busy = true;
+    m_host.ReadFile(m_name, [this, liveness = kj::addRef(*m_liveness)](bool success, kj::ArrayPtr<const uint8_t> data) {
+      if (liveness->alive) {
+        m_busy = false;
+        auto status = success ? cdm::FileIOClient::Status::kSuccess : cdm::FileIOClient::Status::kError;
+        m_client->OnReadComplete(status, data.begin(), data.size());
+      }
+    });
+  }
+
+  void Write(const uint8_t* data, uint32_t data_size) override {
+    KJ_DLOG(INFO, "FileIO::Write", m_name, data_size);
+
+    auto status = cdm::FileIOClient::Status::kError;
+    if (m_busy) {
+      status = cdm::FileIOClient::Status::kInUse;
+    } else if (m_opened && m_host.GetFileStore() != nullptr) {
+      m_host.GetFileStore()->write(m_name, kj::arrayPtr(data, data_size));
+      status = cdm::FileIOClient::Status::kSuccess;
+    }
+
+    complete([this, status]() {
+      m_client->OnWriteComplete(status);
+    });
+  }
+
+  void Close() override {
+    KJ_DLOG(INFO, "FileIO::Close", m_name);
+    if (m_opened && m_host.GetFileStore() != nullptr) {
+      m_host.GetFileStore()->close(m_name);
+    }
+    m_liveness->alive = false;
+    delete this;
+  }
+
+  XFileIO(HostWrapper& host, cdm::FileIOClient* client) :
+    m_host(host), m_client(client), m_liveness(kj::refcounted<Liveness>()) {
+    m_host.AddFileIO(this);
+  }
 
-  ~HostWrapper() noexcept {
-    KJ_ASSERT(0);
+  ~XFileIO() {
+    m_host.RemoveFileIO(this);
   }
 };
 
+cdm::FileIO* HostWrapper::CreateFileIO(cdm::FileIOClient* client) {
+  KJ_DLOG(INFO, "CreateFileIO", client);
+  return static_cast<cdm::FileIO*>(new XFileIO(*this, client));
+}
+
+// The CDM is gone by now, so are the clients of the files it left open
+HostWrapper::~HostWrapper() {
+  kj::Vector<XFileIO*> files;
+  for (auto file: m_files) {
+    files.add(file);
+  }
+  for (auto file: files) {
+    KJ_LOG(WARNING, "closing a file the CDM left open");
+    file->Close();
+  }
+}
+
+// Serves the reads of the shards of this instance, from its file store, unflushed writes included
+kj::Promise<void> CdmProxyImpl::readFile(ReadFileContext context) {
+  auto name = context.getParams().getName();
+  KJ_DLOG(INFO, "readFile", name);
+
+  auto store   = m_host->GetFileStore();
+  bool success = store != nullptr && is_valid_file_name(name) && store->read(name, [&](kj::ArrayPtr<const uint8_t> data) {
+    context.getResults().setData(data);
+  });
+  context.getResults().setSuccess(success);
+
+  KJ_DLOG(INFO, "exiting readFile", success);
+  return kj::READY_NOW;
+}
+
 typedef void (*InitializeCdmModuleFunc)();
 //~ typedef void (*DeinitializeCdmModuleFunc)();
 typedef void* (*CreateCdmInstanceFunc)(int, const char*, uint32_t, GetCdmHostFunc, void*);
@@ -567,6 +1793,8 @@ InitializeCdmModuleFunc   init_cdm_mod_func    = nullptr;
 CreateCdmInstanceFunc     create_cdm_inst_func = nullptr;
 GetCdmVersionFunc         get_cdm_ver_func     = nullptr;
 
+static int64_t cdm_load_ns = 0; // until the first instance reports it
+
 static void* get_cdm_host(int host_interface_version, void* user_data) {
   KJ_DLOG(INFO, "get_cdm_host", host_interface_version, user_data);
   KJ_ASSERT(host_interface_version == 10);
@@ -575,52 +1803,81 @@ static void* get_cdm_host(int host_interface_version, void* user_data) {
 
 class CdmWorkerImpl final: public CdmWorker::Server {
 
-  bool cdm_initialized = false;
+  static bool     cdm_initialized;
+  kj::Maybe<uid_t> m_client; // set in daemon mode
+  kj::String       m_scope;  // the client's storage scope, daemon mode only
 
 public:
 
   kj::Promise<void> createCdmInstance(CreateCdmInstanceContext context) override {
-    return kj::startFiber(FIBER_STACK_SIZE, [context, this](kj::WaitScope& scope) mutable {
+    return start_fiber([context, this](kj::WaitScope& scope) mutable {
 
       auto cdm_interface_version = context.getParams().getCdmInterfaceVersion();
       auto key_system            = context.getParams().getKeySystem();
       auto host_proxy            = context.getParams().getHostProxy();
+      auto shard                 = context.getParams().getShard();
 
       KJ_DLOG(INFO, "createCdmInstance", cdm_interface_version, key_system);
       KJ_ASSERT(cdm_interface_version == 10);
 
-      if (!cdm_initialized) {
-        KJ_LOG(INFO, "cdm version", get_cdm_ver_func());
-        init_cdm_mod_func();
-        cdm_initialized = true;
-      }
+      auto create_start         = monotonic_ns();
+      auto initialize_module_ns = initializeModule();
 
       int fd;
-      KJ_SYSCALL(fd = syscall(SYS_memfd_create, "decrypted buffers", 0));
+      KJ_SYSCALL(fd = syscall(SYS_memfd_create, "decrypted buffers", MFD_ALLOW_SEALING));
       kj::AutoCloseFd memfd(fd);
 
       long page_size;
       KJ_SYSCALL(page_size = sysconf(_SC_PAGESIZE));
       // encrypted buffers + decrypted buffers + 1 page
       KJ_SYSCALL(ftruncate(memfd.get(), SHMEM_ARENA_SIZE * 2 + page_size));
-      //TODO: seal memfd?
+      // the shim maps it too, and pages are only ever given back by punching holes
+      KJ_SYSCALL(fcntl(memfd.get(), F_ADD_SEALS, F_SEAL_SHRINK));
 
       void* encrypted_buffers = mmap(nullptr, SHMEM_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
       if (encrypted_buffers == MAP_FAILED) {
         KJ_FAIL_SYSCALL("mmap", errno);
       }
 
-      XAlloc allocator(memfd.get(), SHMEM_ARENA_SIZE, SHMEM_ARENA_SIZE + page_size);
-
-      //TODO: somebody is supposed to dispose of the host object
-      void* host = reinterpret_cast<void*>(new HostWrapper(kj::mv(host_proxy)));
-
-      set_host_context(&scope, &allocator);
-      void* cdm  = create_cdm_inst_func(cdm_interface_version, key_system.begin(), key_system.size(), get_cdm_host, host);
+      // the decrypted arena comes last, so that it can grow when a frame doesn't fit
+      auto pool = kj::heap<BufferPool>(XAlloc(memfd.get(), SHMEM_ARENA_SIZE, SHMEM_ARENA_SIZE + page_size, SHMEM_ARENA_MAX_SIZE));
+
+      // growth is charged to the host's budget before the memfd is extended, see HostProxyImpl::resizeArena()
+      pool->arena().setReserve([host_proxy = HostProxy::Client(host_proxy)](int64_t bytes) mutable {
+        auto request = host_proxy.resizeArenaRequest();
+        request.setBytes(bytes);
+        if (bytes < 0) {
+          // the arena shrinks when the worker goes idle, outside of any call
+          request.send().detach([](kj::Exception&& exception) {
+            KJ_LOG(ERROR, "unable to return arena growth", exception);
+          });
+          return true;
+        }
+        // grows from Host_10::Allocate, inside a call
+        if (host_ctx.scope == nullptr) {
+          return false;
+        }
+        return wait_host(request.send()).getGranted();
+      });
+
+      // owned by the CdmProxyImpl from here on, see destroy_instance()
+      auto host = new HostWrapper(kj::mv(host_proxy), shard ? kj::Own<FileStore>(nullptr) : open_file_store(key_system, m_client, m_scope), shard);
+      host->SetArena(pool.get());
+
+      set_host_context(&scope, pool.get());
+      void* cdm  = create_cdm_inst_func(cdm_interface_version, key_system.begin(), key_system.size(), get_cdm_host, reinterpret_cast<void*>(host));
       clear_host_context();
       KJ_ASSERT(cdm != nullptr);
 
-      context.getResults().setCdmProxy(kj::heap<CdmProxyImpl>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm), kj::mv(memfd), kj::mv(allocator), encrypted_buffers));
+      auto cdm_proxy = kj::heap<CdmProxyImpl>(reinterpret_cast<cdm::ContentDecryptionModule_10*>(cdm), kj::mv(memfd), kj::mv(pool),
+        encrypted_buffers, host);
+      context.getResults().setCdmProxy(kj::mv(cdm_proxy));
+
+      auto startup = context.getResults().initStartup();
+      startup.setLoadNs(cdm_load_ns);
+      startup.setInitializeModuleNs(initialize_module_ns);
+      startup.setCreateInstanceNs(monotonic_ns() - create_start - initialize_module_ns);
+      cdm_load_ns = 0;
 
       KJ_DLOG(INFO, "exiting createCdmInstance");
     });
@@ -630,15 +1887,306 @@ public:
     context.getResults().setVersion(get_cdm_ver_func());
     return kj::READY_NOW;
   }
+
+  // Calls InitializeCdmModule the first time, returns how long that took
+  static int64_t initializeModule() {
+    if (cdm_initialized) {
+      return 0;
+    }
+    auto start = monotonic_ns();
+    KJ_LOG(INFO, "cdm version", get_cdm_ver_func());
+    init_cdm_mod_func();
+    cdm_initialized = true;
+    return monotonic_ns() - start;
+  }
+
+  CdmWorkerImpl(kj::Maybe<uid_t> client = nullptr, kj::String scope = nullptr) : m_client(client), m_scope(kj::mv(scope)) {}
+};
+
+bool CdmWorkerImpl::cdm_initialized = false;
+
+// Daemon mode, `fcdm-worker --listen <path>`: one copy of the CDM for all host processes on the box. Clients connect
+// to the Unix socket at `path` and are let in by their peer credentials: root, the daemon's own user and the uids
+// listed in FCDM_DAEMON_UIDS. The CDM is loaded and initialized once, then each connection is served by a child
+// forked off the daemon, which shares those pages copy-on-write. A crash or a slow decode only takes down or holds
+// up the instance of that connection. The shim hangs up on a child it finds wedged, and a child still running
+// WATCHDOG_MS after its client hung up is killed. The files of the CDM go to FCDM_STORAGE_PATH/<uid>/<scope>,
+// where the scope is the FCDM_STORAGE_SCOPE of the client.
+class Daemon {
+
+public:
+
+  struct Client {
+    kj::AutoCloseFd fd;
+    uid_t           uid;
+    kj::String      scope;
+  };
+
+private:
+
+  struct Child {
+    pid_t           pid;
+    kj::AutoCloseFd connection;    // our copy, to see the client hang up. Closed once it has.
+    int64_t         hangup_ns = 0;
+  };
+
+  kj::AutoCloseFd   m_fd;
+  kj::Vector<uid_t> m_allowed;
+  kj::Vector<Child> m_children;
+
+  static kj::AutoCloseFd listen(kj::StringPtr path) {
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    KJ_REQUIRE(path.size() < sizeof(address.sun_path), "socket path too long", path);
+    strcpy(address.sun_path, path.cStr());
+
+    int fd;
+    KJ_SYSCALL(fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    kj::AutoCloseFd socket(fd);
+
+    // left behind by an earlier daemon
+    if (unlink(path.cStr()) < 0 && errno != ENOENT) {
+      KJ_FAIL_SYSCALL("unlink", errno, path);
+    }
+    KJ_SYSCALL(bind(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)), path);
+    // who gets in is decided by peer credentials
+    KJ_SYSCALL(chmod(path.cStr(), 0666), path);
+    KJ_SYSCALL(::listen(fd, SOMAXCONN));
+
+    return socket;
+  }
+
+  bool allowed(uid_t uid) {
+    if (uid == 0 || uid == geteuid()) {
+      return true;
+    }
+    for (auto allowed_uid: m_allowed) {
+      if (uid == allowed_uid) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The client names its storage scope before the RPC connection starts: a length byte and that many bytes of text,
+  // see connect_daemon() in the shim. nullptr if it hung up first, as probing whether the daemon is up does. Only
+  // ever blocks the child serving that client.
+  static kj::Maybe<kj::String> readScope(int fd) {
+    kj::FdInputStream stream(fd);
+    uint8_t length;
+    if (stream.tryRead(&length, 1, 1) == 0) {
+      return nullptr;
+    }
+    auto scope = kj::heapString(length);
+    stream.read(scope.begin(), scope.size());
+    return kj::mv(scope);
+  }
+
+  // In the child, after the fork
+  static kj::Maybe<Client> serve(kj::AutoCloseFd fd, uid_t uid) {
+
+    kj::String scope;
+    KJ_IF_MAYBE(sent, readScope(fd.get())) {
+      scope = kj::mv(*sent);
+    } else {
+      KJ_LOG(INFO, "client hung up");
+      return nullptr;
+    }
+
+    if (!valid_storage_scope(scope)) {
+      KJ_LOG(WARNING, "refusing client with a bad storage scope", scope);
+      return nullptr;
+    }
+
+    return Client { kj::mv(fd), uid, kj::mv(scope) };
+  }
+
+  // Forks a child for each client waiting. Returns true in a child, with the client it serves in `client`, which
+  // stays nullptr if there is nothing to serve.
+  bool acceptClients(kj::Maybe<Client>& client) {
+    for (;;) {
+      int fd = accept4(m_fd.get(), nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+          return false;
+        }
+        // out of fds or memory: the clients already in keep going, the waiting ones are taken in once some left
+        KJ_LOG(ERROR, "unable to accept client, backing off", strerror(errno));
+        usleep(ACCEPT_BACKOFF_MS * 1000);
+        return false;
+      }
+      kj::AutoCloseFd connection(fd);
+
+      struct ucred credentials;
+      socklen_t    size = sizeof(credentials);
+      if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) < 0) {
+        KJ_LOG(ERROR, "unable to get client credentials", strerror(errno));
+        continue;
+      }
+      if (!allowed(credentials.uid)) {
+        KJ_LOG(WARNING, "refusing client", credentials.pid, credentials.uid);
+        continue;
+      }
+
+      pid_t pid = LogWriter::get().fork();
+      if (pid < 0) {
+        KJ_LOG(ERROR, "unable to fork for client", credentials.pid, strerror(errno));
+        continue;
+      }
+      if (pid == 0) {
+        // the listening socket and the other clients' connections are the daemon's
+        m_fd = nullptr;
+        m_children.clear();
+        client = serve(kj::mv(connection), credentials.uid);
+        return true;
+      }
+
+      KJ_LOG(INFO, "client connected", credentials.pid, credentials.uid, pid);
+      m_children.add(Child { pid, kj::mv(connection) });
+    }
+  }
+
+  void reap() {
+    for (;;) {
+      int   status;
+      pid_t pid = waitpid(-1, &status, WNOHANG);
+      if (pid <= 0) {
+        return;
+      }
+
+      if (WIFSIGNALED(status)) {
+        KJ_LOG(ERROR, "child serving a client died", pid, strsignal(WTERMSIG(status)));
+      } else if (WEXITSTATUS(status) != 0) {
+        KJ_LOG(ERROR, "child serving a client failed", pid, WEXITSTATUS(status));
+      } else {
+        KJ_LOG(INFO, "client disconnected", pid);
+      }
+
+      // closing our copy of the connection lets the client see it's gone
+      for (size_t i = 0; i < m_children.size(); i++) {
+        if (m_children[i].pid == pid) {
+          m_children[i] = kj::mv(m_children.back());
+          m_children.removeLast();
+          break;
+        }
+      }
+    }
+  }
+
+  // Kills the children whose clients hung up WATCHDOG_MS ago
+  void killHungUp() {
+
+    static const int64_t watchdog_ns = getenv_int("FCDM_WATCHDOG_MS", WATCHDOG_MS) * 1000000;
+
+    auto now = monotonic_ns();
+    for (auto& child: m_children) {
+      if (child.hangup_ns != 0 && now - child.hangup_ns >= watchdog_ns) {
+        KJ_LOG(ERROR, "child still running after its client hung up, killing it", child.pid);
+        KJ_SYSCALL(kill(child.pid, SIGKILL));
+        child.hangup_ns = INT64_MAX; // reaped soon
+      }
+    }
+  }
+
+public:
+
+  // Takes in clients until it returns in a child, with the client that child serves, or nullptr if there is none
+  kj::Maybe<Client> run() {
+    for (;;) {
+      reap();
+      killHungUp();
+
+      kj::Vector<struct pollfd> fds;
+      kj::Vector<Child*>        watched;
+      fds.add(pollfd { m_fd.get(), POLLIN, 0 });
+      for (auto& child: m_children) {
+        if (child.hangup_ns == 0) {
+          // hangups are reported whatever we ask for
+          fds.add(pollfd { child.connection.get(), 0, 0 });
+          watched.add(&child);
+        }
+      }
+
+      // children are reaped every REAP_INTERVAL_MS, the shim sees them go once our copy of the connection is closed
+      if (poll(fds.begin(), fds.size(), REAP_INTERVAL_MS) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        KJ_FAIL_SYSCALL("poll", errno);
+      }
+
+      for (size_t i = 0; i < watched.size(); i++) {
+        if (fds[i + 1].revents & (POLLHUP | POLLERR)) {
+          watched[i]->hangup_ns  = monotonic_ns();
+          watched[i]->connection = nullptr;
+        }
+      }
+
+      kj::Maybe<Client> client;
+      if ((fds[0].revents & POLLIN) && acceptClients(client)) {
+        return kj::mv(client);
+      }
+    }
+  }
+
+  Daemon(kj::StringPtr path) : m_fd(listen(path)) {
+
+    char* uids = getenv("FCDM_DAEMON_UIDS");
+    if (uids != nullptr) {
+      auto list = kj::heapString(uids);
+      for (char* entry = strtok(list.begin(), ","); entry != nullptr; entry = strtok(nullptr, ",")) {
+        m_allowed.add(strtoul(entry, nullptr, 10));
+      }
+    }
+
+    KJ_LOG(INFO, "listening", path);
+  }
+
+  KJ_DISALLOW_COPY(Daemon);
 };
 
 #define X_STR_(x) #x
 #define X_STR(x) X_STR_(x)
 
+// Moves us into the cgroup the shim made for this worker, see WorkerCgroup in lib.cpp
+static void join_cgroup(const char* path) {
+
+  int fd = open(kj::str(path, "/cgroup.procs").cStr(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    KJ_LOG(WARNING, "unable to join cgroup", path, strerror(errno));
+    return;
+  }
+  kj::AutoCloseFd procs(fd);
+
+  auto pid = kj::str(getpid());
+  if (write(fd, pid.begin(), pid.size()) < 0) {
+    KJ_LOG(WARNING, "unable to join cgroup", path, strerror(errno));
+  }
+}
+
 int main(int argc, char* argv[]) {
 
   kj::TopLevelProcessContext context(argv[0]);
-  context.increaseLoggingVerbosity();
+  setup_logging();
+
+  LogCallback log_callback;
+  atexit([]() { LogWriter::get().flush(); });
+
+  bool daemon_mode = argc == 3 && kj::StringPtr(argv[1]) == "--listen";
+  if (argc != 2 && argc != 3) {
+    KJ_LOG(FATAL, "wrong number of args");
+    exit(EXIT_FAILURE);
+  }
+
+  // before the CDM is loaded, so that all of it is accounted there
+  if (argc == 3 && !daemon_mode) {
+    join_cgroup(argv[2]);
+  }
 
   char* cdm_path = getenv("FCDM_CDM_SO_PATH");
   if (cdm_path == nullptr) {
@@ -646,7 +2194,8 @@ int main(int argc, char* argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  void* cdm = dlopen(cdm_path, RTLD_LAZY);
+  auto  load_start = monotonic_ns();
+  void* cdm        = dlopen(cdm_path, RTLD_LAZY);
   KJ_ASSERT(cdm != nullptr);
 
   init_cdm_mod_func = (InitializeCdmModuleFunc)dlsym(cdm, X_STR(INITIALIZE_CDM_MODULE));
@@ -661,25 +2210,28 @@ int main(int argc, char* argv[]) {
   get_cdm_ver_func = (GetCdmVersionFunc)dlsym(cdm, "GetCdmVersion");
   KJ_ASSERT(get_cdm_ver_func != nullptr);
 
+  cdm_load_ns = monotonic_ns() - load_start;
   KJ_LOG(INFO, "started");
 
-  if (argc != 2) {
-    KJ_LOG(FATAL, "wrong number of args");
-    exit(EXIT_FAILURE);
+  // The daemon returns from run() only in the children it forks, each with one client to serve. The CDM is
+  // initialized first, so that they share that as well, and it was loaded long before any of them got a client.
+  kj::Maybe<Daemon::Client> client;
+  if (daemon_mode) {
+    CdmWorkerImpl::initializeModule();
+    cdm_load_ns = 0;
+    client = Daemon(argv[2]).run();
+    if (client == nullptr) {
+      exit(EXIT_SUCCESS);
+    }
   }
 
-  errno = 0;
-  intmax_t socket_fd = strtoimax(argv[1], nullptr, 10);
-  KJ_ASSERT(errno != ERANGE && errno != EINVAL);
-
   auto io = kj::setupAsyncIo();
-  capnp::TwoPartyServer server(kj::heap<CdmWorkerImpl>());
-  server.accept(io.lowLevelProvider->wrapUnixSocketFd(socket_fd), 1 /* maxFdsPerMessage */);
 
   class ErrorHandlerImpl: public kj::TaskSet::ErrorHandler {
   public:
     void taskFailed(kj::Exception&& exception) override {
       KJ_LOG(FATAL, exception);
+      FileStore::shutdownAll();
       exit(EXIT_FAILURE);
     }
   };
@@ -687,11 +2239,52 @@ int main(int argc, char* argv[]) {
   ErrorHandlerImpl error_handler;
   kj::TaskSet tasks(error_handler);
 
-  tasks.add(server.drain().then([]() -> void {
+  kj::Own<capnp::TwoPartyServer> server;
+
+  KJ_IF_MAYBE(daemon_client, client) {
+    server = kj::heap<capnp::TwoPartyServer>(kj::heap<CdmWorkerImpl>(daemon_client->uid, kj::mv(daemon_client->scope)));
+    server->accept(io.lowLevelProvider->wrapUnixSocketFd(daemon_client->fd.release(), kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP), 1 /* maxFdsPerMessage */);
+  } else {
+    errno = 0;
+    intmax_t socket_fd = strtoimax(argv[1], nullptr, 10);
+    KJ_ASSERT(errno != ERANGE && errno != EINVAL);
+
+    server = kj::heap<capnp::TwoPartyServer>(kj::heap<CdmWorkerImpl>());
+    server->accept(io.lowLevelProvider->wrapUnixSocketFd(socket_fd), 1 /* maxFdsPerMessage */);
+  }
+
+  // the instances the shim dropped last are still being destroyed
+  tasks.add(server->drain().then([]() { return kj::evalLast([]() {}); }).then([]() -> void {
     KJ_LOG(INFO, "exiting...");
+    FileStore::shutdownAll();
     exit(EXIT_SUCCESS);
   }));
 
-  kj::NEVER_DONE.wait(io.waitScope);
+  auto idle_seconds = get_idle_seconds();
+  if (idle_seconds > 0) {
+    tasks.add(reclaim_when_idle(io.provider->getTimer(), idle_seconds * kj::SECONDS, data_plane_calls, false));
+  }
+
+  auto spin_ns = get_spin_ns();
+  if (spin_ns == 0) {
+    kj::NEVER_DONE.wait(io.waitScope);
+  }
+
+  // The next frame usually follows shortly after a response went out, so keep polling the socket for spin_ns
+  // after the last decrypt or decode before going to sleep in the event port.
+  for (;;) {
+    auto seen     = data_plane_calls;
+    auto deadline = monotonic_ns() + spin_ns;
+    for (auto now = monotonic_ns(); now < deadline; now = monotonic_ns()) {
+      io.waitScope.poll();
+      if (data_plane_calls != seen) {
+        seen     = data_plane_calls;
+        deadline = now + spin_ns;
+      }
+    }
+    io.unixEventPort.wait();
+    io.waitScope.poll();
+  }
+
   return 0;
 }